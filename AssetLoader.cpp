@@ -0,0 +1,172 @@
+/************************************************************************
+     File:        AssetLoader.cpp
+
+     Comment:     Loads assets on a worker thread. See AssetLoader.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#pragma warning(push)
+#pragma warning(disable:4312)
+#pragma warning(disable:4311)
+#include <Fl/Fl.h>
+#pragma warning(pop)
+
+#include <algorithm>
+
+#include "AssetLoader.H"
+#include "Utilities/Trace.H"
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+AssetLoader::
+AssetLoader()
+	: quit(false), nextOrder(0), outstanding(0),
+	  worker(&AssetLoader::run, this)
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// * Destructor - the window is going away, so the requests still waiting
+//   (and loads that finished but weren't handed over yet) are cancelled:
+//   their done would put things into a window that's being taken apart.
+//   they're dropped here, and stop counting as pending
+//============================================================================
+AssetLoader::
+~AssetLoader()
+//============================================================================
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		quit = true;
+	}
+	wake.notify_one();
+	worker.join();
+
+	outstanding -= queue.size() + finished.size();
+	queue.clear();
+	finished.clear();
+}
+
+//****************************************************************************
+//
+// * the heap puts whatever this says is "less" last, so lower priorities
+//   and later requests are less
+//============================================================================
+bool AssetLoader::
+runsAfter(const Job& a, const Job& b)
+//============================================================================
+{
+	if (a.priority != b.priority)
+		return a.priority < b.priority;
+	return a.order > b.order;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void AssetLoader::
+request(int priority, const char* name, Load load, Done done)
+//============================================================================
+{
+	Job job;
+	job.priority = priority;
+	job.name = name;
+	job.load = load;
+	job.done = done;
+	job.ok = false;
+	outstanding++;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		job.order = nextOrder++;
+		queue.push_back(std::move(job));
+		std::push_heap(queue.begin(), queue.end(), runsAfter);
+	}
+	wake.notify_one();
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t AssetLoader::
+pending() const
+//============================================================================
+{
+	return outstanding;
+}
+
+//****************************************************************************
+//
+// * the worker: take the most important request, load it, pass it back
+//============================================================================
+void AssetLoader::
+run()
+//============================================================================
+{
+	Trace::setThreadName("AssetLoader");
+
+	for (;;) {
+		Job job;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			wake.wait(guard, [this] { return !queue.empty() || quit; });
+			if (quit)
+				return;
+			std::pop_heap(queue.begin(), queue.end(), runsAfter);
+			job = std::move(queue.back());
+			queue.pop_back();
+		}
+
+		{
+			TRACE_SCOPE(job.name);
+			job.ok = job.load(job.error);
+		}
+		// the load function is done with; don't keep what it holds on to
+		job.load = Load();
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			finished.push_back(std::move(job));
+		}
+		Fl::awake(deliverCB, this);
+	}
+}
+
+//****************************************************************************
+//
+// * (on the UI thread)
+//============================================================================
+void AssetLoader::
+deliverCB(void* loader)
+//============================================================================
+{
+	((AssetLoader*) loader)->deliver();
+}
+
+//****************************************************************************
+//
+// * hand every finished load to its done. they're taken out first, so a
+//   done can make new requests
+//============================================================================
+void AssetLoader::
+deliver()
+//============================================================================
+{
+	vector<Job> ready;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		ready.swap(finished);
+	}
+	for (size_t i = 0; i < ready.size(); ++i) {
+		if (ready[i].done)
+			ready[i].done(ready[i].ok, ready[i].error);
+		outstanding--;
+	}
+}
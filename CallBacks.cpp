@@ -22,15 +22,19 @@
 
 #include <time.h>
 #include <math.h>
+#include <algorithm>
 
 #include "TrainWindow.H"
 #include "TrainView.H"
 #include "CallBacks.H"
+#include "TrackIO.H"
+#include "TrackExport.H"
 
 #pragma warning(push)
 #pragma warning(disable:4312)
 #pragma warning(disable:4311)
 #include <Fl/Fl_File_Chooser.H>
+#include <Fl/fl_ask.h>
 #include <Fl/math.h>
 #pragma warning(pop)
 
@@ -44,7 +48,7 @@ void resetCB(Fl_Widget*, TrainWindow* tw)
 	tw->m_Track.resetPoints();
 	tw->trainView->selectedCube = -1;
 	tw->m_Track.trainU = 0;
-	tw->damageMe();
+	tw->trackChanged();
 }
 
 //***************************************************************************
@@ -56,6 +60,17 @@ void damageCB(Fl_Widget*, TrainWindow* tw)
 	tw->damageMe();
 }
 
+//***************************************************************************
+//
+// * the kind of curve (or its tension) changed, so the track needs to be
+//   compiled again
+//===========================================================================
+void trackChangedCB(Fl_Widget*, TrainWindow* tw)
+//===========================================================================
+{
+	tw->trackChanged();
+}
+
 //***************************************************************************
 //
 // * Callback that adds a new point to the spline
@@ -82,7 +97,7 @@ void addPointCB(Fl_Widget*, TrainWindow* tw)
 		if (tw->m_Track.trainU >= npts) tw->m_Track.trainU -= npts;
 	}
 
-	tw->damageMe();
+	tw->trackChanged();
 }
 
 //***************************************************************************
@@ -98,7 +113,7 @@ void deletePointCB(Fl_Widget*, TrainWindow* tw)
 		} else
 			tw->m_Track.points.pop_back();
 	}
-	tw->damageMe();
+	tw->trackChanged();
 }
 //***************************************************************************
 //
@@ -143,6 +158,59 @@ void runButtonCB(TrainWindow* tw)
 	}
 }
 
+//***************************************************************************
+//
+// * the worker finished compiling the track - show it
+//===========================================================================
+void trackReadyCB(TrainWindow* tw)
+//===========================================================================
+{
+	tw->damageMe();
+}
+
+//***************************************************************************
+//
+// * the track file changed on disk. this is the watcher's thread, so
+//   don't touch anything - just pass it on
+//===========================================================================
+void trackFileWatchCB(TrainWindow* tw)
+//===========================================================================
+{
+	Fl::awake((Fl_Awake_Handler) trackFileChangedCB, tw);
+}
+
+//***************************************************************************
+//
+// * and this is the UI thread, where the track can be read again
+//===========================================================================
+void trackFileChangedCB(TrainWindow* tw)
+//===========================================================================
+{
+	tw->reloadTrack();
+}
+
+//***************************************************************************
+//
+// * more of a big track has been read
+//===========================================================================
+void trackStreamCB(TrainWindow* tw)
+//===========================================================================
+{
+	TrackIOError error;
+	if (!tw->streamProgress(error))
+		fl_alert("Can't load the track\n%s", error.message);
+}
+
+//***************************************************************************
+//
+// *
+//===========================================================================
+void cancelLoadCB(Fl_Widget*, TrainWindow* tw)
+//===========================================================================
+{
+	tw->cancelStream();
+}
+
 //***************************************************************************
 //
 // * Load the control points from the files
@@ -151,10 +219,11 @@ void loadCB(Fl_Widget*, TrainWindow* tw)
 //===========================================================================
 {
 	const char* fname = 
-		fl_file_chooser("Pick a Track File","*.txt","TrackFiles/track.txt");
-	if (fname) {
-		tw->m_Track.readPoints(fname);
-		tw->damageMe();
+		fl_file_chooser("Pick a Track File","*.{txt,trk}","TrackFiles/track.txt");
+	if (fname && shouldStreamTrack(fname)) {
+		tw->streamTrack(fname);
+	} else if (fname) {
+		tw->loadTrack(fname);
 	}
 }
 //***************************************************************************
@@ -165,9 +234,168 @@ void saveCB(Fl_Widget*, TrainWindow* tw)
 //===========================================================================
 {
 	const char* fname = 
-		fl_input("File name for save (should be *.txt)","TrackFiles/");
-	if (fname)
-		tw->m_Track.writePoints(fname);
+		fl_input("File name for save (should be *.txt or *.trk)","TrackFiles/");
+	if (fname) {
+		TrackIOError error;
+		TrackSnapshot compiled = tw->trackStore.current();
+		if (!tw->m_Track.writePoints(fname, compiled.get(), error))
+			fl_alert("Can't save the track\n%s", error.message);
+	}
+}
+
+//***************************************************************************
+//
+// * Export the track and the train, as they are now shown - or the
+//   g-forces of riding it, for a .csv or .gfs
+//===========================================================================
+void exportCB(Fl_Widget*, TrainWindow* tw)
+//===========================================================================
+{
+	TrackSnapshot compiled = tw->trackStore.current();
+	if (!compiled)
+		return;
+
+	const char* fname = 
+		fl_input("File name for export (*.obj, *.ply, *.stl, ..., or *.csv, *.gfs for the g-forces)","TrackFiles/");
+	if (fname && isGForceFile(fname)) {
+		tw->updateAnalysis();
+		TrackIOError error;
+		if (!writeGForces(fname, tw->analysis.series(), error))
+			fl_alert("Can't write the g-forces\n%s", error.message);
+	}
+	else if (fname) {
+		TrackExportOptions options;
+		options.parallelRails = tw->rail_parallel->value() != 0;
+		options.ties = tw->rail_tile->value() != 0;
+		options.supports = tw->rail_support->value() != 0;
+		options.tunnel = tw->rail_tunnel->value() != 0;
+		options.tunnelLength = (float) tw->tunnel_length->value();
+		tw->trainView->placeTrain(*compiled, options.cars);
+
+		TrackIOError error;
+		if (!exportTrack(fname, *compiled, options, error))
+			fl_alert("Can't export the track\n%s", error.message);
+	}
+}
+
+//***************************************************************************
+//
+// * another train on the track, spread out from the others by the golden
+//   ratio so however many there are they don't bunch up
+//===========================================================================
+void addTrainCB(Fl_Widget*, TrainWindow* tw)
+//===========================================================================
+{
+	tw->syncWorld();
+	TrackSnapshot track = tw->world.track(0);
+	if (!track || track->totalLength <= 0)
+		return;
+
+	size_t n = std::count(tw->world.trackId.begin(), tw->world.trackId.end(), 0u);
+	float length = track->totalLength;
+	float along = fmodf(tw->trainView->current_length + (n + 1) * 0.618034f * length, length);
+	tw->world.addTrain(0, along, tw->trainView->num_cars);
+	tw->damageMe();
+}
+
+//***************************************************************************
+//
+// * a copy of the track as it is now, with three trains of its own. the
+//   copies are laid out in rows of ten, far enough apart not to touch
+//===========================================================================
+void addCoasterCB(Fl_Widget*, TrainWindow* tw)
+//===========================================================================
+{
+	tw->syncWorld();
+	TrackSnapshot track = tw->world.track(0);
+	if (!track || track->arcPoints.empty() || track->totalLength <= 0)
+		return;
+
+	float minX = track->arcPoints[0].x, maxX = minX;
+	float minZ = track->arcPoints[0].z, maxZ = minZ;
+	for (size_t i = 1; i < track->arcPoints.size(); ++i) {
+		const Pnt3f& p = track->arcPoints[i];
+		minX = p.x < minX ? p.x : minX;
+		maxX = p.x > maxX ? p.x : maxX;
+		minZ = p.z < minZ ? p.z : minZ;
+		maxZ = p.z > maxZ ? p.z : maxZ;
+	}
+	float size = (maxX - minX > maxZ - minZ ? maxX - minX : maxZ - minZ) + 50;
+
+	size_t k = tw->world.numTracks();
+	size_t id = tw->world.addTrack(track, Pnt3f((k % 10) * size, 0, (k / 10) * size));
+	for (int i = 0; i < 3; ++i)
+		tw->world.addTrain(id, i * track->totalLength / 3, tw->trainView->num_cars);
+	tw->damageMe();
+}
+
+//***************************************************************************
+//
+// *
+//===========================================================================
+void clearWorldCB(Fl_Widget*, TrainWindow* tw)
+//===========================================================================
+{
+	tw->world.clear();
+	tw->damageMe();
+}
+
+//***************************************************************************
+//
+// * starting a recording asks where to put it; stopping it waits for the
+//   rest to be written
+//===========================================================================
+void recordCB(Fl_Widget*, TrainWindow* tw)
+//===========================================================================
+{
+	TrackIOError error;
+	if (tw->recordButton->value()) {
+		const char* fname = 
+			fl_input("File name for the recording (*.trr)","TrackFiles/");
+		if (!fname || !tw->recorder.start(fname, error)) {
+			tw->recordButton->value(0);
+			if (fname)
+				fl_alert("Can't record\n%s", error.message);
+		}
+	}
+	else if (!tw->recorder.stop(error))
+		fl_alert("Can't write all of the recording\n%s", error.message);
+}
+
+//***************************************************************************
+//
+// *
+//===========================================================================
+void replayCB(Fl_Widget*, TrainWindow* tw)
+//===========================================================================
+{
+	if (tw->replayButton->value()) {
+		const char* fname = 
+			fl_file_chooser("Pick a Recording","*" RECORDING_EXTENSION,"TrackFiles/");
+		TrackIOError error;
+		if (!fname || !tw->startReplay(fname, error)) {
+			tw->replayButton->value(0);
+			if (fname)
+				fl_alert("Can't play the recording\n%s", error.message);
+		}
+	}
+	else
+		tw->stopReplay();
+}
+
+//***************************************************************************
+//
+// *
+//===========================================================================
+void replaySeekCB(Fl_Widget*, TrainWindow* tw)
+//===========================================================================
+{
+	if (!tw->replay.isOpen())
+		return;
+	size_t tick = (size_t) (tw->replaySlider->value() * RECORD_TICKS_PER_SECOND + 0.5);
+	if (tick >= tw->replay.numTicks())
+		tick = tw->replay.numTicks() - 1;
+	tw->showReplayTick(tick);
 }
 
 //***************************************************************************
@@ -184,7 +412,7 @@ void rollx(TrainWindow* tw, float dir)
 		tw->m_Track.points[s].orient.y = co * old.y - si * old.z;
 		tw->m_Track.points[s].orient.z = si * old.y + co * old.z;
 	}
-	tw->damageMe();
+	tw->trackChanged();
 } 
 
 //***************************************************************************
@@ -225,7 +453,7 @@ void rollz(TrainWindow* tw, float dir)
 		tw->m_Track.points[s].orient.x = si * old.y + co * old.x;
 	}
 
-	tw->damageMe();
+	tw->trackChanged();
 }
 
 //***************************************************************************
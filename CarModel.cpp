@@ -0,0 +1,441 @@
+/************************************************************************
+     File:        CarModel.cpp
+
+     Comment:     Car models, cooked once and then mapped. See CarModel.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include "assimp/cimport.h"
+#include "assimp/postprocess.h"
+#include "assimp/scene.h"
+
+#include "CarModel.H"
+#include "Utilities/Hash.H"
+#include "Utilities/Trace.H"
+
+using std::vector;
+
+//****************************************************************************
+//
+// * the cooked format. it's only ever read by the machine that wrote it,
+//   so everything is as it is in memory. every array starts on an 8 byte
+//   boundary:
+//
+//     CookedHeader
+//     vertices[nVertices] (CarVertex)
+//     indices[nIndices]   (indexSize bytes each)
+//============================================================================
+#define COOKED_MAGIC			"CAR\x1a"
+#define COOKED_VERSION		1
+
+struct CookedHeader {
+	char			magic[4];
+	uint32_t		version;
+	uint32_t		headerSize;		// sizeof(CookedHeader)
+	uint32_t		indexSize;
+	uint64_t		nVertices;
+	uint64_t		nIndices;
+	uint64_t		sourceHash;		// hashBytes of the model file it was cooked from
+	float			boundsMin[3];
+	float			boundsMax[3];
+};
+
+static_assert(sizeof(CarVertex) == 6 * sizeof(float), "vertices are written as they are");
+
+// what we ask assimp to do to a model on the way in: all triangles, with
+// normals, the node transforms baked in, and the vertices shared and
+// ordered for the vertex cache
+#define COOK_FLAGS (aiProcess_Triangulate | aiProcess_SortByPType | \
+						  aiProcess_GenSmoothNormals | aiProcess_JoinIdenticalVertices | \
+						  aiProcess_PreTransformVertices | aiProcess_ImproveCacheLocality)
+
+//****************************************************************************
+//
+// *
+//============================================================================
+static size_t padded(size_t offset)
+//============================================================================
+{
+	return (offset + 7) & ~(size_t) 7;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+static bool hasExtension(const char* filename, const char* extension)
+//============================================================================
+{
+	size_t n = strlen(filename);
+	size_t e = strlen(extension);
+	if (n < e)
+		return false;
+	const char* ext = filename + n - e;
+	for (size_t i = 0; i < e; ++i)
+		if (tolower((unsigned char) ext[i]) != extension[i])
+			return false;
+	return true;
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+CarModel::
+CarModel()
+	: verts(0), nVerts(0), index(0), nIndices(0), indexBytes(0)
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// * a .car file is mapped as it is. anything else is hashed to find its
+//   cooked file, which is cooked first if it isn't there
+//============================================================================
+bool CarModel::
+load(const char* filename, TrackIOError& error)
+//============================================================================
+{
+	TRACE_SCOPE("CarModel::load");
+
+	close();
+
+	if (hasExtension(filename, CAR_MODEL_EXTENSION))
+		return map(filename, 0, error);
+
+	uint64_t hash;
+	{
+		MappedFile source;
+		if (!source.open(filename)) {
+			error.set(filename, 0, 0, "can't open the model");
+			return false;
+		}
+		// a new version of the format gets new names too
+		uint32_t version = COOKED_VERSION;
+		hash = hashBytes(&version, sizeof(version));
+		hash = hashBytes(source.data(), source.size(), hash);
+	}
+
+	char cooked[256];
+	snprintf(cooked, sizeof(cooked), "%s%016llx%s", CAR_MODEL_CACHE_DIR,
+				(unsigned long long) hash, CAR_MODEL_EXTENSION);
+
+	TrackIOError ignored;
+	if (map(cooked, hash, ignored))
+		return true;
+
+#ifdef _WIN32
+	_mkdir(CAR_MODEL_CACHE_DIR);
+#else
+	mkdir(CAR_MODEL_CACHE_DIR, 0777);
+#endif
+	return cookCarModel(filename, cooked, hash, error) && map(cooked, hash, error);
+}
+
+//****************************************************************************
+//
+// * map a cooked file, making sure it's whole and every index is in range.
+//   sourceHash is what it has to have been cooked from (0 for anything)
+//============================================================================
+bool CarModel::
+map(const char* cooked, uint64_t sourceHash, TrackIOError& error)
+//============================================================================
+{
+	if (!file.open(cooked)) {
+		error.set(cooked, 0, 0, "can't open the cooked model");
+		return false;
+	}
+
+	const char* data = file.data();
+	size_t length = file.size();
+
+	CookedHeader h;
+	if (length < sizeof(h)) {
+		error.set(cooked, 0, 0, "the cooked model is too short");
+		file.close();
+		return false;
+	}
+	memcpy(&h, data, sizeof(h));
+	if (memcmp(h.magic, COOKED_MAGIC, 4) != 0 || h.version != COOKED_VERSION ||
+		 h.headerSize != sizeof(h) || (h.indexSize != 2 && h.indexSize != 4) ||
+		 (sourceHash && h.sourceHash != sourceHash)) {
+		error.set(cooked, 0, 0, "not a cooked model, or an old one");
+		file.close();
+		return false;
+	}
+
+	size_t vertexOffset = padded(sizeof(h));
+	size_t space = length - std::min(length, vertexOffset);
+	if (h.nVertices > space / sizeof(CarVertex) || h.nVertices > UINT32_MAX) {
+		error.set(cooked, 0, 0, "the cooked model is cut short");
+		file.close();
+		return false;
+	}
+	size_t indexOffset = padded(vertexOffset + (size_t) h.nVertices * sizeof(CarVertex));
+	space = length - std::min(length, indexOffset);
+	if (h.nIndices > space / h.indexSize || h.nIndices % 3) {
+		error.set(cooked, 0, 0, "the cooked model is cut short");
+		file.close();
+		return false;
+	}
+
+	// a bad index would have GL reading past the vertices
+	const char* ip = data + indexOffset;
+	size_t n = (size_t) h.nIndices;
+	uint32_t maxIndex = 0;
+	if (h.indexSize == 2) {
+		const uint16_t* ix = (const uint16_t*) ip;
+		for (size_t i = 0; i < n; ++i)
+			maxIndex = std::max<uint32_t>(maxIndex, ix[i]);
+	} else {
+		const uint32_t* ix = (const uint32_t*) ip;
+		for (size_t i = 0; i < n; ++i)
+			maxIndex = std::max(maxIndex, ix[i]);
+	}
+	if (n && maxIndex >= h.nVertices) {
+		error.set(cooked, 0, 0, "the cooked model has an index out of range");
+		file.close();
+		return false;
+	}
+
+	// the mapping starts on a page, so the arrays are all aligned
+	verts = (const CarVertex*) (data + vertexOffset);
+	nVerts = (size_t) h.nVertices;
+	index = ip;
+	nIndices = n;
+	indexBytes = h.indexSize;
+	lo = Pnt3f(h.boundsMin[0], h.boundsMin[1], h.boundsMin[2]);
+	hi = Pnt3f(h.boundsMax[0], h.boundsMax[1], h.boundsMax[2]);
+	return true;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void CarModel::
+close()
+//============================================================================
+{
+	file.close();
+	verts = 0;
+	nVerts = 0;
+	index = 0;
+	nIndices = 0;
+	indexBytes = 0;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool CarModel::
+isLoaded() const
+//============================================================================
+{
+	return nIndices != 0;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const CarVertex* CarModel::
+vertices() const
+//============================================================================
+{
+	return verts;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t CarModel::
+numVertices() const
+//============================================================================
+{
+	return nVerts;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const void* CarModel::
+indices() const
+//============================================================================
+{
+	return index;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t CarModel::
+numIndices() const
+//============================================================================
+{
+	return nIndices;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t CarModel::
+indexSize() const
+//============================================================================
+{
+	return indexBytes;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const Pnt3f& CarModel::
+boundsMin() const
+//============================================================================
+{
+	return lo;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const Pnt3f& CarModel::
+boundsMax() const
+//============================================================================
+{
+	return hi;
+}
+
+//****************************************************************************
+//
+// * the triangles of every mesh go into one vertex and one index array
+//   (the transforms are already baked in, so the nodes don't matter).
+//   the file is written under a temporary name and swapped in
+//============================================================================
+bool cookCarModel(const char* source, const char* cooked, uint64_t sourceHash,
+						TrackIOError& error)
+//============================================================================
+{
+	TRACE_SCOPE("cookCarModel");
+
+	const aiScene* scene = aiImportFile(source, COOK_FLAGS);
+	if (!scene) {
+		error.set(source, 0, 0, "assimp can't read the model: %s", aiGetErrorString());
+		return false;
+	}
+
+	vector<CarVertex> vertices;
+	vector<uint32_t> indices;
+	for (unsigned m = 0; m < scene->mNumMeshes; ++m) {
+		const aiMesh* mesh = scene->mMeshes[m];
+		// points and lines were sorted into meshes of their own
+		if (!(mesh->mPrimitiveTypes & aiPrimitiveType_TRIANGLE) || !mesh->HasNormals())
+			continue;
+
+		uint32_t base = (uint32_t) vertices.size();
+		for (unsigned i = 0; i < mesh->mNumVertices; ++i) {
+			const aiVector3D& p = mesh->mVertices[i];
+			const aiVector3D& n = mesh->mNormals[i];
+			CarVertex v;
+			v.pos = Pnt3f(p.x, p.y, p.z);
+			v.normal = Pnt3f(n.x, n.y, n.z);
+			vertices.push_back(v);
+		}
+		for (unsigned f = 0; f < mesh->mNumFaces; ++f) {
+			const aiFace& face = mesh->mFaces[f];
+			if (face.mNumIndices != 3)
+				continue;
+			for (int k = 0; k < 3; ++k)
+				indices.push_back(base + face.mIndices[k]);
+		}
+	}
+	aiReleaseImport(scene);
+
+	if (indices.empty()) {
+		error.set(source, 0, 0, "the model has no triangles");
+		return false;
+	}
+
+	CookedHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, COOKED_MAGIC, 4);
+	h.version = COOKED_VERSION;
+	h.headerSize = sizeof(h);
+	h.indexSize = vertices.size() <= 0x10000 ? 2 : 4;
+	h.nVertices = vertices.size();
+	h.nIndices = indices.size();
+	h.sourceHash = sourceHash;
+
+	Pnt3f lo = vertices[0].pos;
+	Pnt3f hi = vertices[0].pos;
+	for (size_t i = 1; i < vertices.size(); ++i) {
+		const Pnt3f& p = vertices[i].pos;
+		lo = Pnt3f(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+		hi = Pnt3f(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+	}
+	h.boundsMin[0] = lo.x;	h.boundsMin[1] = lo.y;	h.boundsMin[2] = lo.z;
+	h.boundsMax[0] = hi.x;	h.boundsMax[1] = hi.y;	h.boundsMax[2] = hi.z;
+
+	// small models get 16 bit indices
+	vector<uint16_t> shortIndices;
+	const void* indexData = indices.data();
+	if (h.indexSize == 2) {
+		shortIndices.assign(indices.begin(), indices.end());
+		indexData = shortIndices.data();
+	}
+
+	char temp[1024];
+	int n = snprintf(temp, sizeof(temp), "%s.tmp", cooked);
+	if (n < 0 || n >= (int) sizeof(temp)) {
+		error.set(cooked, 0, 0, "the file name is too long");
+		return false;
+	}
+	FILE* fp = fopen(temp, "wb");
+	if (!fp) {
+		error.set(cooked, 0, 0, "can't open the file for writing");
+		return false;
+	}
+
+	static const char zeros[8] = { 0 };
+	size_t vertexBytes = vertices.size() * sizeof(CarVertex);
+	size_t indexBytes = indices.size() * h.indexSize;
+	bool ok =
+		fwrite(&h, sizeof(h), 1, fp) == 1 &&
+		fwrite(zeros, 1, padded(sizeof(h)) - sizeof(h), fp) == padded(sizeof(h)) - sizeof(h) &&
+		fwrite(vertices.data(), 1, vertexBytes, fp) == vertexBytes &&
+		fwrite(zeros, 1, padded(vertexBytes) - vertexBytes, fp) == padded(vertexBytes) - vertexBytes &&
+		fwrite(indexData, 1, indexBytes, fp) == indexBytes;
+	if (fclose(fp) != 0)
+		ok = false;
+	if (ok && !replaceFile(temp, cooked))
+		ok = false;
+	if (!ok) {
+		remove(temp);
+		error.set(cooked, 0, 0, "couldn't write the cooked model");
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,507 @@
+/************************************************************************
+     File:        CompiledTrack.cpp
+
+     Comment:     The track, "compiled". See CompiledTrack.H
+
+						Nothing in here touches OpenGL or the widgets, so a
+						track can be compiled on any thread.
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#include "CompiledTrack.H"
+#include "Utilities/Hash.H"
+#include "Utilities/ThreadPool.H"
+#include "Utilities/Trace.H"
+
+//****************************************************************************
+//
+// * the curve is G * M * T, with G the four points, M the basis matrix and
+//   T = (t^3, t^2, t, 1). we just work out the four weights M * T
+//============================================================================
+Pnt3f splinePoint(const Pnt3f& p0, const Pnt3f& p1, const Pnt3f& p2, const Pnt3f& p3,
+						float t, int type, float tension)
+//============================================================================
+{
+	float t2 = t * t;
+	float t3 = t2 * t;
+	float w0, w1, w2, w3;
+
+	if (type == SPLINE_CARDINAL) {
+		float s = tension;
+		w0 = -s * t3 + 2 * s * t2 - s * t;
+		w1 = (2 - s) * t3 + (s - 3) * t2 + 1;
+		w2 = (s - 2) * t3 + (3 - 2 * s) * t2 + s * t;
+		w3 = s * t3 - s * t2;
+	}
+	else if (type == SPLINE_BSPLINE) {
+		w0 = (-t3 + 3 * t2 - 3 * t + 1) / 6.0f;
+		w1 = (3 * t3 - 6 * t2 + 4) / 6.0f;
+		w2 = (-3 * t3 + 3 * t2 + 3 * t + 1) / 6.0f;
+		w3 = t3 / 6.0f;
+	}
+	else {
+		// linear - just go from p1 to p2 like the other curves do
+		w0 = 0;
+		w1 = 1 - t;
+		w2 = t;
+		w3 = 0;
+	}
+
+	return Pnt3f(p0.x * w0 + p1.x * w1 + p2.x * w2 + p3.x * w3,
+					 p0.y * w0 + p1.y * w1 + p2.y * w2 + p3.y * w3,
+					 p0.z * w0 + p1.z * w1 + p2.z * w2 + p3.z * w3);
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+CompiledTrack::
+CompiledTrack()
+	: splineType(SPLINE_CARDINAL), tension(0.5f), divide(1), totalLength(0),
+	  tessellateNs(0), arcLengthNs(0)
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t CompiledTrack::
+numSegments() const
+//============================================================================
+{
+	return segmentLength.size();
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t CompiledTrack::
+numSteps() const
+//============================================================================
+{
+	return forward.size();
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const Pnt3f& CompiledTrack::
+stepStart(size_t step) const
+//============================================================================
+{
+	size_t seg = step / divide;
+	return samples[seg * (divide + 1) + step % divide];
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const Pnt3f& CompiledTrack::
+stepEnd(size_t step) const
+//============================================================================
+{
+	size_t seg = step / divide;
+	return samples[seg * (divide + 1) + step % divide + 1];
+}
+
+//****************************************************************************
+//
+// * the first segment that ends past this length (wrapping around at the
+//   end of the track)
+//============================================================================
+size_t CompiledTrack::
+segmentAt(float length) const
+//============================================================================
+{
+	if (sumLength.empty())
+		return 0;
+	size_t seg = std::upper_bound(sumLength.begin(), sumLength.end(), length) - sumLength.begin();
+	return seg % sumLength.size();
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+float CompiledTrack::
+segmentFraction(size_t seg, float length) const
+//============================================================================
+{
+	float start = seg ? sumLength[seg - 1] : 0;
+	float len = sumLength[seg] - start;
+	return (len > 0) ? (length - start) / len : 0;
+}
+
+//****************************************************************************
+//
+// * the linear track goes between this point and the next; the cubic ones
+//   use the four points from this one on
+//============================================================================
+void CompiledTrack::
+segmentControls(size_t seg, const ControlPoint* c[4]) const
+//============================================================================
+{
+	size_t npts = points.size();
+	if (splineType == SPLINE_LINEAR) {
+		c[0] = c[1] = &points[seg % npts];
+		c[2] = c[3] = &points[(seg + 1) % npts];
+	} else {
+		for (int k = 0; k < 4; ++k)
+			c[k] = &points[(seg + k) % npts];
+	}
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+Pnt3f CompiledTrack::
+pointAt(size_t seg, float u) const
+//============================================================================
+{
+	const ControlPoint* c[4];
+	segmentControls(seg, c);
+	return splinePoint(c[0]->pos, c[1]->pos, c[2]->pos, c[3]->pos, u, splineType, tension);
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+Pnt3f CompiledTrack::
+orientAt(size_t seg, float u) const
+//============================================================================
+{
+	const ControlPoint* c[4];
+	segmentControls(seg, c);
+	return splinePoint(c[0]->orient, c[1]->orient, c[2]->orient, c[3]->orient, u, splineType, tension);
+}
+
+//****************************************************************************
+//
+// * the rail vertices of one step
+//============================================================================
+static inline void meshStep(CompiledTrack& ct, size_t step)
+//============================================================================
+{
+	const Pnt3f& p0 = ct.stepStart(step);
+	const Pnt3f& p1 = ct.stepEnd(step);
+	const Pnt3f& c = ct.cross[step];
+
+	Pnt3f* r = &ct.railLines[step * 2];
+	r[0] = p0;
+	r[1] = p1;
+	Pnt3f* pr = &ct.parallelLines[step * 4];
+	pr[0] = p0 + c;
+	pr[1] = p1 + c;
+	pr[2] = p0 - c;
+	pr[3] = p1 - c;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void CompiledTrack::
+buildMesh()
+//============================================================================
+{
+	size_t nSteps = numSteps();
+	railLines.resize(nSteps * 2);
+	parallelLines.resize(nSteps * 4);
+	ThreadPool::shared().parallelFor(nSteps, 64 * 1024, [this](size_t begin, size_t end) {
+		for (size_t step = begin; step < end; ++step)
+			meshStep(*this, step);
+	});
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+uint64_t trackKey(const vector<ControlPoint>& points,
+						int splineType, float tension, int divide)
+//============================================================================
+{
+	uint64_t h = hashBytes(points.data(), points.size() * sizeof(ControlPoint));
+	h = hashBytes(&splineType, sizeof(splineType), h);
+	h = hashBytes(&tension, sizeof(tension), h);
+	h = hashBytes(&divide, sizeof(divide), h);
+	return h;
+}
+
+//****************************************************************************
+//
+// * sample one segment of the curve, and get the frame and the rail
+//   vertices of each of its steps
+//============================================================================
+static void tessellateSegment(CompiledTrack& ct, size_t i)
+//============================================================================
+{
+	int divide = ct.divide;
+	float percent = 1.0f / divide;
+
+	const ControlPoint* c[4];
+	ct.segmentControls(i, c);
+	const Pnt3f* p[4] = { &c[0]->pos, &c[1]->pos, &c[2]->pos, &c[3]->pos };
+	const Pnt3f* o[4] = { &c[0]->orient, &c[1]->orient, &c[2]->orient, &c[3]->orient };
+
+	Pnt3f* s = &ct.samples[i * (divide + 1)];
+	float length = 0;
+	float t = 0;
+	s[0] = splinePoint(*p[0], *p[1], *p[2], *p[3], t, ct.splineType, ct.tension);
+	for (int j = 0; j < divide; ++j) {
+		t += percent;
+		s[j + 1] = splinePoint(*p[0], *p[1], *p[2], *p[3], t, ct.splineType, ct.tension);
+
+		Pnt3f d = s[j + 1] - s[j];
+		length += sqrt(d.x * d.x + d.y * d.y + d.z * d.z);
+
+		Pnt3f orient_t = splinePoint(*o[0], *o[1], *o[2], *o[3], t, ct.splineType, ct.tension);
+		orient_t.normalize();
+
+		Pnt3f forward = d;
+		forward.normalize();
+		Pnt3f cross_t = d * orient_t;
+		cross_t.normalize();
+		cross_t = cross_t * RAIL_GAUGE;
+
+		size_t step = i * divide + j;
+		ct.forward[step] = forward;
+		ct.cross[step] = cross_t;
+		meshStep(ct, step);
+	}
+	ct.segmentLength[i] = length;
+}
+
+//****************************************************************************
+//
+// * the running totals of the segment lengths. each chunk adds up its own
+//   part, then the chunk totals get added up, then each chunk adds the
+//   total of the chunks before it to its part
+//============================================================================
+static float prefixSum(ThreadPool& pool, const vector<float>& in, vector<float>& out)
+//============================================================================
+{
+	size_t n = in.size();
+	out.resize(n);
+
+	size_t nChunks = pool.size() * 4;
+	size_t grain = (n + nChunks - 1) / nChunks;
+	if (grain < 1024)
+		grain = 1024;
+	nChunks = (n + grain - 1) / grain;
+
+	vector<float> chunkTotal(nChunks + 1, 0.0f);
+	pool.parallelFor(nChunks, 1, [&](size_t begin, size_t end) {
+		for (size_t c = begin; c < end; ++c) {
+			size_t last = std::min(n, (c + 1) * grain);
+			float sum = 0;
+			for (size_t i = c * grain; i < last; ++i) {
+				sum += in[i];
+				out[i] = sum;
+			}
+			chunkTotal[c + 1] = sum;
+		}
+	});
+
+	for (size_t c = 0; c < nChunks; ++c)
+		chunkTotal[c + 1] += chunkTotal[c];
+
+	pool.parallelFor(nChunks, 1, [&](size_t begin, size_t end) {
+		for (size_t c = begin; c < end; ++c) {
+			if (!c)
+				continue;
+			size_t last = std::min(n, (c + 1) * grain);
+			for (size_t i = c * grain; i < last; ++i)
+				out[i] += chunkTotal[c];
+		}
+	});
+
+	return chunkTotal[nChunks];
+}
+
+//****************************************************************************
+//
+// * the arc points and ties that fall in one segment. they go at whole
+//   units (and whole TIE_SPACINGs) of the distance along the track, so
+//   each segment only needs to know where it starts
+//============================================================================
+static void segmentMarks(const CompiledTrack& ct, size_t i,
+								 vector<Pnt3f>& arcPoints, vector<int>& ties)
+//============================================================================
+{
+	double along = i ? ct.sumLength[i - 1] : 0;
+	double nextArc = floor(along) + 1;
+	double nextTie = (floor(along / TIE_SPACING) + 1) * TIE_SPACING;
+
+	for (int j = 0; j < ct.divide; ++j) {
+		size_t step = i * ct.divide + j;
+		Pnt3f d = ct.stepEnd(step) - ct.stepStart(step);
+		along += sqrt(d.x * d.x + d.y * d.y + d.z * d.z);
+
+		while (along >= nextArc) {
+			arcPoints.push_back(ct.stepEnd(step));
+			nextArc += 1;
+		}
+		if (along >= nextTie) {
+			ties.push_back((int) step);
+			nextTie += TIE_SPACING;
+		}
+	}
+}
+
+//****************************************************************************
+//
+// * true if any of the control points of a segment differ between the two
+//   (which have the same settings and number of points)
+//============================================================================
+static bool segmentChanged(const CompiledTrack& ct, const CompiledTrack& previous, size_t i)
+//============================================================================
+{
+	const ControlPoint* now[4];
+	const ControlPoint* then[4];
+	ct.segmentControls(i, now);
+	previous.segmentControls(i, then);
+	for (int k = 0; k < 4; ++k)
+		if (memcmp(now[k], then[k], sizeof(ControlPoint)))
+			return true;
+	return false;
+}
+
+//****************************************************************************
+//
+// * tessellate the curve and work out the arc length tables. the segments
+//   don't depend on each other, so they are spread over the thread pool
+//============================================================================
+TrackSnapshot compileTrack(const vector<ControlPoint>& points,
+									int splineType, float tension, int divide,
+									const CompiledTrack* previous)
+//============================================================================
+{
+	TRACE_SCOPE("compileTrack");
+
+	std::shared_ptr<CompiledTrack> track(new CompiledTrack);
+	CompiledTrack& ct = *track;
+	ct.points = points;
+	ct.splineType = splineType;
+	ct.tension = tension;
+	ct.divide = divide;
+
+	size_t npts = points.size();
+	if (npts < 2 || divide < 1)
+		return track;
+
+	ThreadPool& pool = ThreadPool::shared();
+	// a few thousand steps a task, so the queues aren't the bottleneck
+	size_t grain = std::max((size_t) 1, (size_t) (4096 / divide));
+
+	//*********************************************************************
+	// sample the curve, and get the frame of every step
+	//*********************************************************************
+	uint64_t start = Trace::now();
+
+	// an edit usually only moves a few points, and only the segments
+	// those are part of need doing again. segments are numbered from the
+	// first point, so a track that grew (or shrank) at the end can still
+	// take the ones it has in common with previous
+	size_t reuse = 0;
+	if (previous && previous->splineType == splineType && previous->tension == tension &&
+		 previous->divide == divide && previous->segmentLength.size() == previous->points.size())
+		reuse = std::min(npts, previous->points.size());
+
+	size_t nSteps = npts * divide;
+	size_t keep = reuse * divide;
+	if (reuse) {
+		ct.samples.assign(previous->samples.begin(), previous->samples.begin() + reuse * (divide + 1));
+		ct.forward.assign(previous->forward.begin(), previous->forward.begin() + keep);
+		ct.cross.assign(previous->cross.begin(), previous->cross.begin() + keep);
+		ct.railLines.assign(previous->railLines.begin(), previous->railLines.begin() + keep * 2);
+		ct.parallelLines.assign(previous->parallelLines.begin(), previous->parallelLines.begin() + keep * 4);
+		ct.segmentLength.assign(previous->segmentLength.begin(), previous->segmentLength.begin() + reuse);
+	}
+	ct.samples.resize(npts * (divide + 1));
+	ct.forward.resize(nSteps);
+	ct.cross.resize(nSteps);
+	ct.railLines.resize(nSteps * 2);
+	ct.parallelLines.resize(nSteps * 4);
+	ct.segmentLength.resize(npts);
+
+	vector<size_t> todo;
+	todo.reserve(npts - reuse);
+	for (size_t i = 0; i < npts; ++i)
+		if (i >= reuse || segmentChanged(ct, *previous, i))
+			todo.push_back(i);
+	pool.parallelFor(todo.size(), grain, [&](size_t begin, size_t end) {
+		for (size_t k = begin; k < end; ++k)
+			tessellateSegment(ct, todo[k]);
+	});
+	ct.tessellateNs = Trace::now() - start;
+
+	//*********************************************************************
+	// arc length: the running totals, a point every unit of length (for
+	// moving the train at a steady speed), and a tie every TIE_SPACING
+	//*********************************************************************
+	start = Trace::now();
+
+	ct.totalLength = prefixSum(pool, ct.segmentLength, ct.sumLength);
+
+	vector< vector<Pnt3f> > segArcPoints(npts);
+	vector< vector<int> > segTies(npts);
+	pool.parallelFor(npts, grain, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+			segmentMarks(ct, i, segArcPoints[i], segTies[i]);
+	});
+
+	// arcPoints[i] is i units along the track
+	size_t nArc = 1, nTies = 0;
+	for (size_t i = 0; i < npts; ++i) {
+		nArc += segArcPoints[i].size();
+		nTies += segTies[i].size();
+	}
+	ct.arcPoints.reserve(nArc);
+	ct.ties.reserve(nTies);
+	ct.arcPoints.push_back(ct.samples[0]);
+	for (size_t i = 0; i < npts; ++i) {
+		ct.arcPoints.insert(ct.arcPoints.end(), segArcPoints[i].begin(), segArcPoints[i].end());
+		ct.ties.insert(ct.ties.end(), segTies[i].begin(), segTies[i].end());
+	}
+	ct.arcLengthNs = Trace::now() - start;
+
+	return track;
+}
+
+//****************************************************************************
+//
+// * swap in the new snapshot - readers that already have the old one keep
+//   it until they are done with it
+//============================================================================
+void TrackSnapshotStore::
+publish(const TrackSnapshot& track)
+//============================================================================
+{
+	std::atomic_store(&snapshot, track);
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+TrackSnapshot TrackSnapshotStore::
+current() const
+//============================================================================
+{
+	return std::atomic_load(&snapshot);
+}
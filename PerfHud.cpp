@@ -0,0 +1,353 @@
+/************************************************************************
+     File:        PerfHud.cpp
+
+     Comment:
+						Frame statistics and the on screen performance
+						overlay. See PerfHud.H
+
+						The heap numbers come from replacing the global
+						operator new - every allocation bumps a counter.
+						The counter is the allocating thread's own, and
+						the frame reads the UI thread's, so the compiler,
+						the loaders, the recorder's writer and the pool
+						threads working at the same time don't end up in
+						the frame's figure. Define TRAIN_NO_HEAP_COUNTER to
+						leave operator new alone (the HUD then shows 0
+						bytes).
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include <windows.h>
+#include <GL/gl.h>
+
+#pragma warning(push)
+#pragma warning(disable:4312)
+#pragma warning(disable:4311)
+#include <FL/gl.h>
+#pragma warning(pop)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+
+#include "PerfHud.H"
+#include "Utilities/Trace.H"
+
+const char* perfStageNames[PERF_NUM_STAGES] = {
+	"tessellate",
+	"arc length",
+	"draw track",
+	"draw trains",
+	"shadows",
+	"floor"
+};
+
+//****************************************************************************
+//
+// * count the heap traffic, a thread at a time
+//============================================================================
+static thread_local uint64_t heapCounter = 0;
+
+#ifndef TRAIN_NO_HEAP_COUNTER
+void* operator new(size_t size)
+{
+	heapCounter += size;
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+#endif
+
+//****************************************************************************
+//
+// *
+//============================================================================
+uint64_t PerfHud::
+heapBytes()
+//============================================================================
+{
+	return heapCounter;
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+PerfHud::
+PerfHud()
+	: vertices(0), drawCalls(0), frameHeapBytes(0), nFrames(0),
+	  startTime(0), startHeap(0), curVertices(0), curDrawCalls(0), current(0)
+//============================================================================
+{
+	for (int i = 0; i < PERF_NUM_STAGES; ++i) {
+		stageMs[i] = 0;
+		stageNs[i] = 0;
+	}
+	for (int i = 0; i < HISTORY; ++i) {
+		frameMs[i] = 0;
+		frameStart[i] = 0;
+	}
+}
+
+//****************************************************************************
+//
+// * start collecting for a new frame
+//============================================================================
+void PerfHud::
+beginFrame()
+//============================================================================
+{
+	startTime = Trace::now();
+	startHeap = heapBytes();
+	for (int i = 0; i < PERF_NUM_STAGES; ++i)
+		stageNs[i] = 0;
+	curVertices = 0;
+	curDrawCalls = 0;
+	current = 0;
+}
+
+//****************************************************************************
+//
+// * the frame is done - move the tallies over to what the HUD shows
+//============================================================================
+void PerfHud::
+endFrame()
+//============================================================================
+{
+	uint64_t end = Trace::now();
+
+	int slot = nFrames % HISTORY;
+	frameMs[slot] = (float) ((end - startTime) / 1.0e6);
+	frameStart[slot] = startTime / 1.0e9;
+	nFrames++;
+
+	for (int i = 0; i < PERF_NUM_STAGES; ++i)
+		stageMs[i] = stageNs[i] / 1.0e6;
+	vertices = curVertices;
+	drawCalls = curDrawCalls;
+	frameHeapBytes = heapBytes() - startHeap;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void PerfHud::
+addDrawCalls(int calls, int verts)
+//============================================================================
+{
+	curDrawCalls += calls;
+	curVertices += verts;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void PerfHud::
+addStageNs(PerfStage stage, uint64_t ns)
+//============================================================================
+{
+	stageNs[stage] += ns;
+}
+
+//****************************************************************************
+//
+// * frames per second over (at most) the last 60 frames
+//============================================================================
+float PerfHud::
+fps() const
+//============================================================================
+{
+	int n = std::min(nFrames, std::min((int) HISTORY, 60));
+	if (n < 2)
+		return 0;
+	double last = frameStart[(nFrames - 1) % HISTORY];
+	double first = frameStart[(nFrames - n) % HISTORY];
+	if (last <= first)
+		return 0;
+	return (float) ((n - 1) / (last - first));
+}
+
+//****************************************************************************
+//
+// * p in [0,1] - the frame time that this fraction of frames stays under
+//============================================================================
+float PerfHud::
+percentile(float p) const
+//============================================================================
+{
+	int n = std::min(nFrames, (int) HISTORY);
+	if (n == 0)
+		return 0;
+	float sorted[HISTORY];
+	memcpy(sorted, frameMs, n * sizeof(float));
+	std::sort(sorted, sorted + n);
+	int i = (int) (p * (n - 1) + 0.5f);
+	return sorted[std::max(0, std::min(n - 1, i))];
+}
+
+//****************************************************************************
+//
+// * draw the overlay in the top left corner
+//============================================================================
+void PerfHud::
+draw(int w, int h)
+//============================================================================
+{
+	const int lineH = 14;
+	const int panelW = 250;
+	const int nBuckets = 16;		// histogram buckets, 2 ms each
+	const float bucketMs = 2.0f;
+	const int histH = 40;
+	const int nLines = 5 + PERF_NUM_STAGES;
+	const int panelH = nLines * lineH + histH + 20;
+
+	glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT | GL_COLOR_BUFFER_BIT);
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	glOrtho(0, w, 0, h, -1, 1);
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glLoadIdentity();
+
+	glDisable(GL_LIGHTING);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_STENCIL_TEST);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	// a dark backing panel so the text is readable over anything
+	int left = 5, top = h - 5;
+	glColor4f(0, 0, 0, .6f);
+	glBegin(GL_QUADS);
+		glVertex2i(left, top);
+		glVertex2i(left + panelW, top);
+		glVertex2i(left + panelW, top - panelH);
+		glVertex2i(left, top - panelH);
+	glEnd();
+
+	// the text
+	char buf[128];
+	int y = top - lineH;
+	gl_font(FL_COURIER, 12);
+	glColor3f(1, 1, 1);
+
+	sprintf(buf, "fps %6.1f", fps());
+	gl_draw(buf, (float) left + 5, (float) y);	y -= lineH;
+	sprintf(buf, "p50 %5.2f p95 %5.2f p99 %5.2f ms",
+		percentile(.5f), percentile(.95f), percentile(.99f));
+	gl_draw(buf, (float) left + 5, (float) y);	y -= lineH;
+
+	for (int i = 0; i < PERF_NUM_STAGES; ++i) {
+		sprintf(buf, "%-12s %7.2f ms", perfStageNames[i], stageMs[i]);
+		gl_draw(buf, (float) left + 5, (float) y);	y -= lineH;
+	}
+
+	sprintf(buf, "verts %d  calls %d", vertices, drawCalls);
+	gl_draw(buf, (float) left + 5, (float) y);	y -= lineH;
+	if (frameHeapBytes >= 1024 * 1024)
+		sprintf(buf, "heap %.1f MB this frame", frameHeapBytes / (1024.0 * 1024.0));
+	else
+		sprintf(buf, "heap %.1f KB this frame", frameHeapBytes / 1024.0);
+	gl_draw(buf, (float) left + 5, (float) y);	y -= lineH;
+
+	// the frame time histogram - the last bucket also holds everything slower
+	int counts[nBuckets];
+	for (int i = 0; i < nBuckets; ++i)
+		counts[i] = 0;
+	int n = std::min(nFrames, (int) HISTORY);
+	int most = 1;
+	for (int i = 0; i < n; ++i) {
+		int b = std::min(nBuckets - 1, (int) (frameMs[i] / bucketMs));
+		most = std::max(most, ++counts[b]);
+	}
+	sprintf(buf, "0 .. %d ms", (int) (nBuckets * bucketMs));
+	gl_draw(buf, (float) left + 5, (float) y);
+
+	int barW = (panelW - 10) / nBuckets;
+	int base = top - panelH + 5;
+	glBegin(GL_QUADS);
+	for (int i = 0; i < nBuckets; ++i) {
+		int bh = counts[i] * histH / most;
+		if (!bh)
+			continue;
+		// green for anything that makes 60Hz, then yellow, then red
+		float ms = i * bucketMs;
+		if (ms < 16)			glColor3f(.2f, .9f, .2f);
+		else if (ms < 32)		glColor3f(.9f, .9f, .2f);
+		else						glColor3f(.9f, .2f, .2f);
+		int x0 = left + 5 + i * barW;
+		glVertex2i(x0, base);
+		glVertex2i(x0 + barW - 1, base);
+		glVertex2i(x0 + barW - 1, base + bh);
+		glVertex2i(x0, base + bh);
+	}
+	glEnd();
+
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+	glPopMatrix();
+	glPopAttrib();
+}
+
+//****************************************************************************
+//
+// * start timing a stage - it becomes the innermost stage
+//============================================================================
+PerfStageTimer::
+PerfStageTimer(PerfHud& _hud, PerfStage _stage)
+	: hud(_hud), stage(_stage), parent(_hud.current), start(Trace::now()), childNs(0),
+	  running(true)
+//============================================================================
+{
+	hud.current = this;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+PerfStageTimer::
+~PerfStageTimer()
+//============================================================================
+{
+	stop();
+}
+
+//****************************************************************************
+//
+// * charge our time (minus nested stages) to the stage and tell our parent
+//   how long we took so it doesn't count it twice
+//============================================================================
+void PerfStageTimer::
+stop()
+//============================================================================
+{
+	if (!running)
+		return;
+	running = false;
+
+	uint64_t end = Trace::now();
+	uint64_t elapsed = end - start;
+	hud.stageNs[stage] += elapsed - childNs;
+	if (parent)
+		parent->childNs += elapsed;
+	hud.current = parent;
+
+	if (Trace::enabled())
+		Trace::record(perfStageNames[stage], start, end);
+}
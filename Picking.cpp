@@ -0,0 +1,252 @@
+/************************************************************************
+     File:        Picking.cpp
+
+     Comment:     Finding what is under the mouse. See Picking.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include <math.h>
+#include <string.h>
+
+#include "Picking.H"
+#include "Utilities/Trace.H"
+
+// the shape ControlPoint::draw makes, in the point's own space: a cube
+// 2 * POINT_SIZE on a side, with a pyramid up to 3 * POINT_SIZE
+#define POINT_SIZE	2.0f
+
+// what a car covers in drawTrain's cube space (x forward, y up, z right):
+// the cube, and the splash panels that stick out of it
+static const Bounds CAR_BOX(Pnt3f(0, -0.84f, -0.6f), Pnt3f(1.8f, 1, 1.2f));
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+PickHit::
+PickHit()
+	: kind(PICK_NOTHING), index(-1), t(FLT_MAX)
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+PickPad::
+PickPad(float at0_, float perT_)
+	: at0(at0_), perT(perT_)
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// * behind the eye a perspective ray would get thinner than nothing
+//============================================================================
+float PickPad::
+at(float t) const
+//============================================================================
+{
+	float pad = at0 + perT * t;
+	return pad > 0 ? pad : 0;
+}
+
+//****************************************************************************
+//
+// * the axes draw() turns a point to: a turn of theta1 about y, then one of
+//   theta2 about z. y ends up along orient
+//============================================================================
+static void pointAxes(const ControlPoint& point, Pnt3f& x, Pnt3f& y, Pnt3f& z)
+//============================================================================
+{
+	const Pnt3f& o = point.orient;
+	float a = -atan2f(o.z, o.x);
+	float b = -acosf(o.y < -1 ? -1 : o.y > 1 ? 1 : o.y);
+	float ca = cosf(a), sa = sinf(a);
+	float cb = cosf(b), sb = sinf(b);
+	x = Pnt3f(cb * ca, sb, -cb * sa);
+	y = Pnt3f(-sb * ca, cb, sb * sa);
+	z = Pnt3f(sa, 0, ca);
+}
+
+//****************************************************************************
+//
+// * a box around all of a point however it's turned
+//============================================================================
+static Bounds pointBounds(const ControlPoint& point)
+//============================================================================
+{
+	Bounds b;
+	b.add(point.pos);
+	b.grow(3 * POINT_SIZE);
+	return b;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+static inline float dot(const Pnt3f& a, const Pnt3f& b)
+//============================================================================
+{
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+//****************************************************************************
+//
+// * where the ray goes into a box in the space with the given origin and
+//   axes (which are at right angles, but may be any length), or FLT_MAX.
+//   the ray is pad thick, in the world's units, so the box grows by that
+//   over the length of each axis
+//============================================================================
+static float hitFrame(const Pnt3f& origin, const Pnt3f& dir, float tMin, float tMax,
+							 const Pnt3f& at, const Pnt3f& x, const Pnt3f& y, const Pnt3f& z,
+							 const Bounds& box, float pad)
+//============================================================================
+{
+	// into the frame's coordinates: for axes at right angles, that's a dot
+	// product divided by the length squared
+	Pnt3f rel = origin - at;
+	float xx = 1 / dot(x, x), yy = 1 / dot(y, y), zz = 1 / dot(z, z);
+	Pnt3f o(dot(rel, x) * xx, dot(rel, y) * yy, dot(rel, z) * zz);
+	Pnt3f d(dot(dir, x) * xx, dot(dir, y) * yy, dot(dir, z) * zz);
+	Pnt3f inv(1 / d.x, 1 / d.y, 1 / d.z);
+
+	Pnt3f grow(pad * sqrtf(xx), pad * sqrtf(yy), pad * sqrtf(zz));
+	Bounds padded(box.lo - grow, box.hi + grow);
+
+	float t;
+	if (!padded.hit(o, inv, tMin, tMax, t))
+		return FLT_MAX;
+	return t;
+}
+
+//****************************************************************************
+//
+// * how far along the ray it passes nearest to p
+//============================================================================
+static inline float alongRay(const Pnt3f& origin, const Pnt3f& dir, const Pnt3f& p)
+//============================================================================
+{
+	return dot(p - origin, dir) / dot(dir, dir);
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+PointPicker::
+PointPicker()
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void PointPicker::
+update(const vector<ControlPoint>& points)
+//============================================================================
+{
+	if (points.size() != built.size()) {
+		vector<Bounds> boxes(points.size());
+		for (size_t i = 0; i < points.size(); ++i)
+			boxes[i] = pointBounds(points[i]);
+		tree.build(boxes);
+		built = points;
+		return;
+	}
+
+	bool moved = false;
+	for (size_t i = 0; i < points.size(); ++i) {
+		if (memcmp(&points[i], &built[i], sizeof(ControlPoint))) {
+			built[i] = points[i];
+			tree.setBox(i, pointBounds(points[i]));
+			moved = true;
+		}
+	}
+	if (moved)
+		tree.refit();
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool PointPicker::
+pick(const vector<ControlPoint>& points, const Pnt3f& origin, const Pnt3f& dir,
+	  PickHit& hit, const PickPad& pad)
+//============================================================================
+{
+	TRACE_SCOPE("PointPicker::pick");
+
+	update(points);
+
+	// the cube and the pyramid, which fits in the top of a box
+	static const Bounds shape(Pnt3f(-POINT_SIZE, -POINT_SIZE, -POINT_SIZE),
+									  Pnt3f(POINT_SIZE, 3 * POINT_SIZE, POINT_SIZE));
+
+	// the tree's boxes are grown by the thickest the ray gets over all the
+	// points (at whichever corner of them is furthest along it); each point
+	// is then tested with how thick the ray is where it is
+	Bounds all = tree.bounds();
+	float tFar = PICK_NEAR_T;
+	for (int c = 0; c < 8 && !points.empty(); ++c) {
+		Pnt3f corner(c & 1 ? all.hi.x : all.lo.x, c & 2 ? all.hi.y : all.lo.y,
+						 c & 4 ? all.hi.z : all.lo.z);
+		float t = alongRay(origin, dir, corner);
+		if (t > tFar)
+			tFar = t;
+	}
+	float treePad = pad.at(tFar) > pad.at(PICK_NEAR_T) ? pad.at(tFar) : pad.at(PICK_NEAR_T);
+
+	float tMax = hit.t;
+	long found = tree.raycast(origin, dir, PICK_NEAR_T, tMax,
+		[&](size_t i, float tMin, float tLimit) {
+			Pnt3f x, y, z;
+			pointAxes(built[i], x, y, z);
+			float here = pad.at(alongRay(origin, dir, built[i].pos));
+			return hitFrame(origin, dir, tMin, tLimit, built[i].pos, x, y, z, shape, here);
+		}, treePad);
+	if (found < 0)
+		return false;
+
+	hit.kind = PICK_POINT;
+	hit.index = (int) found;
+	hit.t = tMax;
+	return true;
+}
+
+//****************************************************************************
+//
+// * each car is drawn in the frame drawTrain sets up: its axes are the
+//   car's forward, up and right, 5 long, from pos - 0.5 X + Y - 0.5 Z
+//============================================================================
+bool pickCar(const vector<TrainCar>& cars, const Pnt3f& origin, const Pnt3f& dir,
+				 PickHit& hit, const PickPad& pad)
+//============================================================================
+{
+	bool found = false;
+	for (size_t i = 0; i < cars.size(); ++i) {
+		const TrainCar& car = cars[i];
+		Pnt3f x = car.forward * 5;
+		Pnt3f y = car.up * 5;
+		Pnt3f z = car.right * 5;
+		Pnt3f at = car.pos + x * -0.5f + y + z * -0.5f;
+
+		float here = pad.at(alongRay(origin, dir, car.pos));
+		float t = hitFrame(origin, dir, PICK_NEAR_T, hit.t, at, x, y, z, CAR_BOX, here);
+		if (t < hit.t) {
+			hit.kind = PICK_CAR;
+			hit.index = (int) i;
+			hit.t = t;
+			found = true;
+		}
+	}
+	return found;
+}
@@ -25,8 +25,7 @@
 *************************************************************************/
 
 #include "Track.H"
-
-#include <FL/fl_ask.h>
+#include "TrackIO.H"
 
 //****************************************************************************
 //
@@ -58,121 +57,34 @@ resetPoints()
 	trainU = 0.0;
 }
 
-//****************************************************************************
-//
-// * Handy utility to break a string into a list of words
-//============================================================================
-void breakString(char* str, std::vector<const char*>& words) 
-//============================================================================
-{
-	// start with no words
-	words.clear();
-
-	// scan through the string, starting at the beginning
-	char* p = str;
-
-	// stop when we hit the end of the string
-	while(*p) {
-		// skip over leading whitespace - stop at the first character or end of string
-		while (*p && *p<=' ') p++;
-
-		// now we're pointing at the first thing after the spaces
-		// make sure its not a comment, and that we're not at the end of the string
-		// (that's actually the same thing)
-		if (! (*p) || *p == '#')
-		break;
-
-		// so we're pointing at a word! add it to the word list
-		words.push_back(p);
-
-		// now find the end of the word
-		while(*p > ' ') p++;	// stop at space or end of string
-
-		// if its ethe end of the string, we're done
-		if (! *p) break;
-
-		// otherwise, turn this space into and end of string (to end the word)
-		// and keep going
-		*p = 0;
-		p++;
-	}
-}
-
 //****************************************************************************
 //
 // * The file format is simple
 //   first line: an integer with the number of control points
 //	  other lines: one line per control point
 //   either 3 (X,Y,Z) numbers on the line, or 6 numbers (X,Y,Z, orientation)
+//   unless the name ends in .trk, which is the binary format
+//   (see TrackIO.H)
 //============================================================================
-void CTrack::
-readPoints(const char* filename)
+bool CTrack::
+readPoints(const char* filename, TrackIOError& error, TrackSnapshot* compiled)
 //============================================================================
 {
-	FILE* fp = fopen(filename,"r");
-	if (!fp) {
-		fl_alert("Can't Open File!\n");
-	} 
-	else {
-		char buf[512];
-
-		// first line = number of points
-		fgets(buf,512,fp);
-		size_t npts = (size_t) atoi(buf);
-
-		if( (npts<4) || (npts>65535)) {
-			fl_alert("Illegal Number of Points Specified in File");
-		} else {
-			points.clear();
-			// get lines until EOF or we have enough points
-			while( (points.size() < npts) && fgets(buf,512,fp) ) {
-				Pnt3f pos,orient;
-				vector<const char*> words;
-				breakString(buf,words);
-				if (words.size() >= 3) {
-					pos.x = (float) strtod(words[0],0);
-					pos.y = (float) strtod(words[1],0);
-					pos.z = (float) strtod(words[2],0);
-				} else {
-					pos.x=0;
-					pos.y=0;
-					pos.z=0;
-				}
-				if (words.size() >= 6) {
-					orient.x = (float) strtod(words[3],0);
-					orient.y = (float) strtod(words[4],0);
-					orient.z = (float) strtod(words[5],0);
-				} else {
-					orient.x = 0;
-					orient.y = 1;
-					orient.z = 0;
-				}
-				orient.normalize();
-				points.push_back(ControlPoint(pos,orient));
-			}
-		}
-		fclose(fp);
-	}
+	if (!readTrackFile(filename, points, error, compiled))
+		return false;
 	trainU = 0;
+	return true;
 }
 
 //****************************************************************************
 //
-// * write the control points to our simple format
+// * write the control points (and for a binary file, the compiled track
+//   if it goes with them)
 //============================================================================
-void CTrack::
-writePoints(const char* filename)
+bool CTrack::
+writePoints(const char* filename, const CompiledTrack* compiled, TrackIOError& error)
 //============================================================================
 {
-	FILE* fp = fopen(filename,"w");
-	if (!fp) {
-		fl_alert("Can't open file for writing");
-	} else {
-		fprintf(fp,"%d\n",points.size());
-		for(size_t i=0; i<points.size(); ++i)
-			fprintf(fp,"%g %g %g %g %g %g\n",
-				points[i].pos.x, points[i].pos.y, points[i].pos.z, 
-				points[i].orient.x, points[i].orient.y, points[i].orient.z);
-		fclose(fp);
-	}
+	// atomic, so a failed save doesn't lose the track that was there
+	return writeTrackFile(filename, points, compiled, error, true);
 }
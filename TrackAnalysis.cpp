@@ -0,0 +1,435 @@
+/************************************************************************
+     File:        TrackAnalysis.cpp
+
+     Comment:     What riding the track feels like. See TrackAnalysis.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "TrackAnalysis.H"
+#include "Utilities/ThreadPool.H"
+#include "Utilities/Trace.H"
+
+#define DEGREES 57.2957795f
+
+//****************************************************************************
+//
+// * Pnt3f's constructor isn't inline, so the loops over the samples work
+//   on these instead
+//============================================================================
+struct V3 {
+	float x, y, z;
+};
+
+static inline V3 v3(float x, float y, float z) { V3 v = { x, y, z }; return v; }
+static inline V3 v3(const Pnt3f& p) { return v3(p.x, p.y, p.z); }
+static inline V3 operator+(const V3& a, const V3& b) { return v3(a.x + b.x, a.y + b.y, a.z + b.z); }
+static inline V3 operator-(const V3& a, const V3& b) { return v3(a.x - b.x, a.y - b.y, a.z - b.z); }
+static inline V3 operator*(const V3& a, float s) { return v3(a.x * s, a.y * s, a.z * s); }
+static inline float dot(const V3& a, const V3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+static inline V3 cross(const V3& a, const V3& b)
+{
+	return v3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+//****************************************************************************
+//
+// * the weights splinePoint gives the four control points, as cubics in t:
+//   basis[i] is (t^3, t^2, t, 1) for point i
+//============================================================================
+static void splineBasis(int type, float s, float basis[4][4])
+//============================================================================
+{
+	if (type == SPLINE_CARDINAL) {
+		float b[4][4] = {
+			{ -s, 2 * s, -s, 0 },
+			{ 2 - s, s - 3, 0, 1 },
+			{ s - 2, 3 - 2 * s, s, 0 },
+			{ s, -s, 0, 0 },
+		};
+		memcpy(basis, b, sizeof(b));
+	} else if (type == SPLINE_BSPLINE) {
+		float b[4][4] = {
+			{ -1 / 6.0f, 3 / 6.0f, -3 / 6.0f, 1 / 6.0f },
+			{ 3 / 6.0f, -6 / 6.0f, 0, 4 / 6.0f },
+			{ -3 / 6.0f, 3 / 6.0f, 3 / 6.0f, 1 / 6.0f },
+			{ 1 / 6.0f, 0, 0, 0 },
+		};
+		memcpy(basis, b, sizeof(b));
+	} else {
+		float b[4][4] = {
+			{ 0, 0, 0, 0 },
+			{ 0, 0, -1, 1 },
+			{ 0, 0, 1, 0 },
+			{ 0, 0, 0, 0 },
+		};
+		memcpy(basis, b, sizeof(b));
+	}
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void steadySpeedProfile(const CompiledTrack& track, float speed, vector<float>& profile)
+//============================================================================
+{
+	profile.assign(track.arcPoints.size(), speed);
+}
+
+//****************************************************************************
+//
+// * step a train round twice, and keep the speeds of the second lap at
+//   each sample it passes (in between steps, the speed goes in a straight
+//   line). a train that never gets round gives up after long enough to
+//   do so at a crawl
+//============================================================================
+void physicsSpeedProfile(const TrackPhysics& physics, const PhysicsOptions& options,
+								 vector<float>& profile)
+//============================================================================
+{
+	TRACE_SCOPE("physicsSpeedProfile");
+
+	profile.clear();
+	if (!physics.ready())
+		return;
+	const CompiledTrack& track = *physics.track();
+	size_t n = track.arcPoints.size();
+	float length = track.totalLength;
+	profile.assign(n, options.minSpeed);
+
+	float crawl = options.minSpeed > 0.1f ? options.minSpeed : 0.1f;
+	double maxSteps = 4 * length / crawl / PHYSICS_STEP;
+	float s = 0, v = 0;
+	int lap = 0;
+	for (double k = 0; k < maxSteps && lap < 2; ++k) {
+		float lastS = s, lastV = v;
+		physics.advance(&s, &v, 1, 1, options);
+
+		// fill in the samples this step passed: after from, up to to. the
+		// first lap only counts once it comes round to the start again
+		bool wrapped = s < lastS;
+		float span = s - lastS + (wrapped ? length : 0);
+		float from, to;
+		if (lap == 1) {
+			from = lastS;
+			to = wrapped ? length : s;
+		} else if (wrapped) {
+			from = lastS - length;
+			to = s;
+		} else
+			continue;
+
+		float next = floorf(from) + 1;
+		for (size_t i = (size_t) (next > 0 ? next : 0); i < n && i <= to; ++i)
+			profile[i] = lastV + (v - lastV) * ((i - from) / span);
+		if (wrapped)
+			++lap;
+	}
+}
+
+//****************************************************************************
+//
+// * first, where each sample is: which segment, how far through it (the
+//   curve's own parameter, found from the lengths of the steps) and which
+//   step it's on - a segment at a time. then the forces at each sample
+//============================================================================
+void analyseTrack(const CompiledTrack& track, const vector<float>& profile, float gravity,
+						GForceSeries& series)
+//============================================================================
+{
+	TRACE_SCOPE("analyseTrack");
+
+	size_t n = track.arcPoints.size();
+	size_t nSegs = track.numSegments();
+	size_t nSteps = track.numSteps();
+	series.along.resize(n);
+	series.speed.resize(n);
+	series.vertical.resize(n);
+	series.lateral.resize(n);
+	series.longitudinal.resize(n);
+	series.normal.resize(n);
+	series.jerk.resize(n);
+	series.bankNeeded.resize(n);
+	series.bank.resize(n);
+	series.stepVertical.assign(nSteps, 1);
+	if (n < 3 || !nSegs || profile.size() != n || gravity <= 0)
+		return;
+
+	ThreadPool& pool = ThreadPool::shared();
+	int divide = track.divide;
+
+	float basis[4][4];
+	splineBasis(track.splineType, track.tension, basis);
+
+	// the cubic of each segment, (t^3, t^2, t, 1)
+	vector<V3> coeff(nSegs * 4);
+	vector<uint32_t> sampleSeg(n), sampleStep(n), stepSample(nSteps);
+	vector<float> sampleU(n);
+
+	pool.parallelFor(nSegs, 16, [&](size_t begin, size_t end) {
+		vector<float> lengths(divide);
+		for (size_t seg = begin; seg < end; ++seg) {
+			const ControlPoint* c[4];
+			track.segmentControls(seg, c);
+			for (int k = 0; k < 4; ++k) {
+				V3 sum = v3(0, 0, 0);
+				for (int i = 0; i < 4; ++i)
+					sum = sum + v3(c[i]->pos) * basis[i][k];
+				coeff[seg * 4 + k] = sum;
+			}
+
+			float start = seg ? track.sumLength[seg - 1] : 0;
+			float stop = seg + 1 < nSegs ? track.sumLength[seg] : (float) n;
+			size_t firstStep = seg * divide;
+			for (int j = 0; j < divide; ++j) {
+				V3 d = v3(track.stepEnd(firstStep + j)) - v3(track.stepStart(firstStep + j));
+				lengths[j] = sqrtf(dot(d, d));
+			}
+
+			float at = start;
+			for (int j = 0; j < divide; ++j) {
+				float nearest = at + 0.5f;
+				stepSample[firstStep + j] = (uint32_t) (nearest < n - 1 ? nearest : n - 1);
+				at += lengths[j];
+			}
+
+			at = start;
+			int j = 0;
+			for (size_t i = (size_t) ceilf(start); i < n && (float) i < stop; ++i) {
+				while (j < divide - 1 && at + lengths[j] <= i)
+					at += lengths[j++];
+				float f = lengths[j] > 0 ? (i - at) / lengths[j] : 0;
+				f = f < 0 ? 0 : f > 1 ? 1 : f;
+				sampleSeg[i] = (uint32_t) seg;
+				sampleStep[i] = (uint32_t) (firstStep + j);
+				sampleU[i] = (j + f) / divide;
+			}
+		}
+	});
+
+	// the speed along the track changes at v dv/ds, and that changes at
+	// v d(v dv/ds)/ds - from the profile's neighbours either side
+	vector<float> accel(n), accelRate(n);
+	pool.parallelFor(n, 4096, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+			accel[i] = profile[i] * (profile[(i + 1) % n] - profile[(i + n - 1) % n]) * 0.5f;
+	});
+	pool.parallelFor(n, 4096, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+			accelRate[i] = profile[i] * (accel[(i + 1) % n] - accel[(i + n - 1) % n]) * 0.5f;
+	});
+
+	// r', r'' and r''' from the cubic give the direction T, the curvature
+	// vector K = (r'' q - r' p) / q^2 (q = r'.r', p = r'.r'') and how fast
+	// it changes. the rider feels the acceleration a T + v^2 K, plus
+	// holding them up against gravity; the jerk is how fast that changes,
+	// a' T + 3 v a K + v^3 dK/ds
+	pool.parallelFor(n, 2048, [&](size_t begin, size_t end) {
+		const V3 worldUp = v3(0, 1, 0);
+		for (size_t i = begin; i < end; ++i) {
+			const V3* c = &coeff[sampleSeg[i] * 4];
+			float u = sampleU[i];
+			V3 d1 = c[0] * (3 * u * u) + c[1] * (2 * u) + c[2];
+			V3 d2 = c[0] * (6 * u) + c[1] * 2;
+			V3 d3 = c[0] * 6;
+
+			float q = dot(d1, d1);
+			float p = dot(d1, d2);
+			float pace = sqrtf(q);
+			V3 t, k, dk;
+			if (pace > 1e-6f) {
+				t = d1 * (1 / pace);
+				k = (d2 * q - d1 * p) * (1 / (q * q));
+				V3 top = d3 * q + d2 * p - d1 * (dot(d2, d2) + dot(d1, d3));
+				dk = (top * (1 / (q * q)) - k * (4 * p / q)) * (1 / pace);
+			} else {
+				Pnt3f f = track.forward[sampleStep[i]];
+				t = v3(f);
+				k = dk = v3(0, 0, 0);
+			}
+
+			// the track's frame, from its cross vector
+			V3 right = v3(track.cross[sampleStep[i]]);
+			right = right - t * dot(right, t);
+			right = right * (1 / sqrtf(dot(right, right) + 1e-20f));
+			V3 up = cross(right, t);
+
+			// the frame of the track without any bank
+			V3 level = cross(t, worldUp);
+			float levelLength = sqrtf(dot(level, level));
+			V3 right0 = levelLength > 1e-4f ? level * (1 / levelLength) : right;
+			V3 up0 = cross(right0, t);
+
+			float v = profile[i];
+			float a = accel[i];
+			V3 feel = t * a + k * (v * v) + worldUp * gravity;
+			V3 across = feel - t * dot(feel, t);
+			V3 jerk = t * accelRate[i] + k * (3 * v * a) + dk * (v * v * v);
+
+			series.along[i] = (float) i;
+			series.speed[i] = v;
+			series.vertical[i] = dot(feel, up) / gravity;
+			series.lateral[i] = dot(feel, right) / gravity;
+			series.longitudinal[i] = dot(feel, t) / gravity;
+			series.normal[i] = sqrtf(dot(across, across)) / gravity;
+			series.jerk[i] = sqrtf(dot(jerk, jerk)) / gravity;
+			series.bankNeeded[i] = atan2f(dot(across, right0), dot(across, up0)) * DEGREES;
+			series.bank[i] = atan2f(dot(up, right0), dot(up, up0)) * DEGREES;
+		}
+	});
+
+	pool.parallelFor(nSteps, 4096, [&](size_t begin, size_t end) {
+		for (size_t s = begin; s < end; ++s)
+			series.stepVertical[s] = series.vertical[stepSample[s]];
+	});
+}
+
+//****************************************************************************
+//
+// * does the file name end in ext (which is lower case)?
+//============================================================================
+static bool hasExtension(const char* filename, const char* ext)
+//============================================================================
+{
+	const char* dot = strrchr(filename, '.');
+	if (!dot || strlen(dot) != strlen(ext))
+		return false;
+	for (size_t i = 0; dot[i]; ++i)
+		if (tolower((unsigned char) dot[i]) != ext[i])
+			return false;
+	return true;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool isGForceFile(const char* filename)
+//============================================================================
+{
+	return hasExtension(filename, ".csv") || hasExtension(filename, GFORCE_BINARY_EXTENSION);
+}
+
+// the binary file starts with this
+struct GForceHeader {
+	char			magic[4];
+	uint32_t		version;
+	uint32_t		count;
+	uint32_t		series;
+};
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool writeGForces(const char* filename, const GForceSeries& series, TrackIOError& error)
+//============================================================================
+{
+	TRACE_SCOPE("writeGForces");
+
+	const vector<float>* columns[] = {
+		&series.along, &series.speed, &series.vertical, &series.lateral,
+		&series.longitudinal, &series.normal, &series.jerk, &series.bankNeeded, &series.bank
+	};
+	const size_t nColumns = sizeof(columns) / sizeof(columns[0]);
+	size_t n = series.size();
+
+	bool binary = hasExtension(filename, GFORCE_BINARY_EXTENSION);
+
+	FILE* fp = fopen(filename, binary ? "wb" : "w");
+	if (!fp) {
+		error.set(filename, 0, 0, "can't open the file for writing");
+		return false;
+	}
+
+	bool ok = true;
+	if (binary) {
+		GForceHeader header;
+		memcpy(header.magic, "GFS\x1a", 4);
+		header.version = 1;
+		header.count = (uint32_t) n;
+		header.series = (uint32_t) nColumns;
+		ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+		for (size_t c = 0; ok && c < nColumns; ++c)
+			ok = !n || fwrite(columns[c]->data(), sizeof(float), n, fp) == n;
+	} else {
+		ok = fprintf(fp, "along,speed,vertical,lateral,longitudinal,normal,jerk,bank_needed,bank\n") > 0;
+		for (size_t i = 0; ok && i < n; ++i) {
+			for (size_t c = 0; ok && c < nColumns; ++c)
+				ok = fprintf(fp, c + 1 < nColumns ? "%.6g," : "%.6g\n", (*columns[c])[i]) > 0;
+		}
+	}
+
+	if (fclose(fp) != 0)
+		ok = false;
+	if (!ok)
+		error.set(filename, 0, 0, "couldn't write all of the file");
+	return ok;
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+TrackAnalysis::
+TrackAnalysis()
+	: analysed(false), usedPhysics(false), usedSpeed(0)
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const GForceSeries& TrackAnalysis::
+series() const
+//============================================================================
+{
+	return result;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool TrackAnalysis::
+update(const TrackSnapshot& track, const TrackPhysics* physics,
+		 const PhysicsOptions& options, float steadySpeed)
+//============================================================================
+{
+	bool samePhysics = physics ?
+		usedPhysics && options.gravity == usedOptions.gravity &&
+		options.friction == usedOptions.friction && options.drag == usedOptions.drag &&
+		options.minSpeed == usedOptions.minSpeed && options.lift == usedOptions.lift &&
+		options.liftStart == usedOptions.liftStart && options.liftEnd == usedOptions.liftEnd &&
+		options.liftSpeed == usedOptions.liftSpeed :
+		!usedPhysics && steadySpeed == usedSpeed && options.gravity == usedOptions.gravity;
+	if (analysed && track == snapshot && samePhysics)
+		return false;
+
+	snapshot = track;
+	analysed = true;
+	usedPhysics = physics != 0;
+	usedOptions = options;
+	usedSpeed = steadySpeed;
+
+	if (!track) {
+		result = GForceSeries();
+		return true;
+	}
+	if (physics && physics->track() == track)
+		physicsSpeedProfile(*physics, options, profile);
+	else
+		steadySpeedProfile(*track, steadySpeed, profile);
+	analyseTrack(*track, profile, options.gravity, result);
+	return true;
+}
@@ -0,0 +1,87 @@
+/************************************************************************
+     File:        TrackCache.cpp
+
+     Comment:     Compiled tracks kept on disk. See TrackCache.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include "TrackCache.H"
+#include "TrackIO.H"
+#include "Utilities/Trace.H"
+
+//****************************************************************************
+//
+// * where the entry for this key lives
+//============================================================================
+static void entryName(uint64_t key, char* name, size_t size)
+//============================================================================
+{
+	snprintf(name, size, "%s%016llx%s", TRACK_CACHE_DIR,
+				(unsigned long long) key, TRACK_BINARY_EXTENSION);
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+TrackSnapshot findCachedTrack(const vector<ControlPoint>& points,
+										int splineType, float tension, int divide)
+//============================================================================
+{
+	TRACE_SCOPE("findCachedTrack");
+
+	char name[256];
+	entryName(trackKey(points, splineType, tension, divide), name, sizeof(name));
+
+	// the tables are only handed back if their key matches the points in
+	// the file; make sure those are our points, not a hash collision
+	vector<ControlPoint> cached;
+	TrackSnapshot track;
+	TrackIOError error;
+	if (!readTrackFile(name, cached, error, &track) || !track)
+		return TrackSnapshot();
+	if (track->splineType != splineType || track->tension != tension ||
+		 track->divide != divide || cached.size() != points.size() ||
+		 memcmp(cached.data(), points.data(), points.size() * sizeof(ControlPoint)))
+		return TrackSnapshot();
+	return track;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void storeCachedTrack(const CompiledTrack& track)
+//============================================================================
+{
+	if (track.tessellateNs + track.arcLengthNs < TRACK_CACHE_MIN_NS)
+		return;
+
+	TRACE_SCOPE("storeCachedTrack");
+
+#ifdef _WIN32
+	_mkdir(TRACK_CACHE_DIR);
+#else
+	mkdir(TRACK_CACHE_DIR, 0777);
+#endif
+
+	char name[256];
+	entryName(trackKey(track.points, track.splineType, track.tension, track.divide),
+				 name, sizeof(name));
+
+	// the cache is only an optimization - if it can't be written, we just
+	// do without
+	TrackIOError error;
+	writeTrackFile(name, track.points, &track, error, true);
+}
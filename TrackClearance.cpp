@@ -0,0 +1,587 @@
+/************************************************************************
+     File:        TrackClearance.cpp
+
+     Comment:     Checking that the track doesn't run into itself. See
+						TrackClearance.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include <float.h>
+#include <math.h>
+
+#include <algorithm>
+#include <mutex>
+
+#include "TrackClearance.H"
+#include "Utilities/BoxTree.H"
+#include "Utilities/ThreadPool.H"
+#include "Utilities/Trace.H"
+
+// how many pieces a task of the pair search looks at
+#define CLEARANCE_GRAIN 64
+
+// the length of half a circle, for a diameter of 1
+#define HALF_TURN 1.5707963f
+
+//****************************************************************************
+//
+// *
+//============================================================================
+static inline float dot(const Pnt3f& a, const Pnt3f& b)
+//============================================================================
+{
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+static inline float clamp01(float v)
+//============================================================================
+{
+	return v < 0 ? 0 : v > 1 ? 1 : v;
+}
+
+//****************************************************************************
+//
+// * the closest points of the segments p1-q1 and p2-q2, and the squared
+//   distance between them
+//============================================================================
+static float closestBetween(const Pnt3f& p1, const Pnt3f& q1, const Pnt3f& p2, const Pnt3f& q2,
+									 Pnt3f& c1, Pnt3f& c2)
+//============================================================================
+{
+	const float tiny = 1e-12f;
+	Pnt3f d1 = q1 - p1;
+	Pnt3f d2 = q2 - p2;
+	Pnt3f r = p1 - p2;
+	float a = dot(d1, d1), e = dot(d2, d2), f = dot(d2, r);
+
+	float s = 0, t = 0;
+	if (a <= tiny) {
+		if (e > tiny)
+			t = clamp01(f / e);
+	} else {
+		float c = dot(d1, r);
+		if (e <= tiny)
+			s = clamp01(-c / a);
+		else {
+			// the closest points of the two lines, then pulled back onto
+			// the segments
+			float b = dot(d1, d2);
+			float denom = a * e - b * b;
+			s = denom > 0 ? clamp01((b * f - c * e) / denom) : 0;
+			t = (b * s + f) / e;
+			if (t < 0) {
+				t = 0;
+				s = clamp01(-c / a);
+			} else if (t > 1) {
+				t = 1;
+				s = clamp01((b - c) / a);
+			}
+		}
+	}
+	c1 = p1 + d1 * s;
+	c2 = p2 + d2 * t;
+	Pnt3f off = c1 - c2;
+	return dot(off, off);
+}
+
+//****************************************************************************
+//
+// * the envelope sizes come from what TrainView draws: the ties stick out
+//   2 * RAIL_GAUGE to the side and hang 1 below, the cars sit up to 10
+//   above the track, and the tunnel walls are 3.6 * RAIL_GAUGE out with
+//   the roof at 11
+//============================================================================
+ClearanceOptions::
+ClearanceOptions()
+	: clearance(TRACK_CLEARANCE), tunnelLength(0)
+//============================================================================
+{
+	track.halfWidth = 2 * RAIL_GAUGE;
+	track.below = 1;
+	track.above = 10;
+	tunnel.halfWidth = 3.6f * RAIL_GAUGE;
+	tunnel.below = 1;
+	tunnel.above = 11;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+static bool sameEnvelope(const ClearanceEnvelope& a, const ClearanceEnvelope& b)
+//============================================================================
+{
+	return a.halfWidth == b.halfWidth && a.below == b.below && a.above == b.above;
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+TrackClearance::
+TrackClearance()
+	: checked(false), trackLength(0), minRadius(0), cellSize(1)
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const vector<ClearanceConflict>& TrackClearance::
+conflicts() const
+//============================================================================
+{
+	return found;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool TrackClearance::
+update(const TrackSnapshot& track, const ClearanceOptions& newOptions)
+//============================================================================
+{
+	if (checked && track == snapshot &&
+		 options.clearance == newOptions.clearance &&
+		 options.tunnelLength == newOptions.tunnelLength &&
+		 sameEnvelope(options.track, newOptions.track) &&
+		 sameEnvelope(options.tunnel, newOptions.tunnel))
+		return false;
+
+	snapshot = track;
+	options = newOptions;
+	checked = true;
+	found.clear();
+	if (track)
+		check(*track);
+	return true;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void TrackClearance::
+check(const CompiledTrack& track)
+//============================================================================
+{
+	TRACE_SCOPE("TrackClearance::check");
+
+	if (track.numSteps() < 2)
+		return;
+	buildCapsules(track);
+	buildPieces();
+	buildHash();
+	findClose();
+	gather();
+}
+
+//****************************************************************************
+//
+// * a capsule for every step. its axis is the step, lifted to the middle
+//   of the envelope's cross-section, and its radius reaches the corners
+//   of the cross-section. the distance along the track is worked out a
+//   segment at a time, so the segments can be done in parallel
+//============================================================================
+void TrackClearance::
+buildCapsules(const CompiledTrack& track)
+//============================================================================
+{
+	size_t nSteps = track.numSteps();
+	size_t tunnelSteps = (size_t) (nSteps * options.tunnelLength);
+	capsules.resize(nSteps);
+
+	ThreadPool::shared().parallelFor(track.numSegments(), 16, [&](size_t begin, size_t end) {
+		for (size_t seg = begin; seg < end; ++seg) {
+			float along = seg ? track.sumLength[seg - 1] : 0;
+			for (size_t s = seg * track.divide; s < (seg + 1) * track.divide; ++s) {
+				const ClearanceEnvelope& env = s < tunnelSteps ? options.tunnel : options.track;
+				float height = (env.above - env.below) / 2;
+				float half = (env.above + env.below) / 2;
+
+				Pnt3f right = track.cross[s];
+				right.normalize();
+				Pnt3f up = right * track.forward[s];
+				up.normalize();
+
+				Capsule& c = capsules[s];
+				c.a = track.stepStart(s) + up * height;
+				c.b = track.stepEnd(s) + up * height;
+				c.radius = sqrtf(env.halfWidth * env.halfWidth + half * half);
+				Pnt3f d = track.stepEnd(s) - track.stepStart(s);
+				c.length = sqrtf(dot(d, d));
+				c.along = along;
+				along += c.length;
+			}
+		}
+	});
+	trackLength = capsules.back().along + capsules.back().length;
+}
+
+//****************************************************************************
+//
+// * the steps are cut into pieces short enough that a piece and the ones
+//   either side of it are all neighbours of each other, and each piece
+//   gets a sphere round all of its capsules. the cells are big enough
+//   that a piece can only have steps too close to steps of the pieces
+//   whose middles are in the cells around its own
+//============================================================================
+void TrackClearance::
+buildPieces()
+//============================================================================
+{
+	size_t nSteps = capsules.size();
+
+	minRadius = FLT_MAX;
+	for (size_t s = 0; s < nSteps; ++s)
+		if (capsules[s].radius < minRadius)
+			minRadius = capsules[s].radius;
+	float pieceLength = HALF_TURN * (2 * minRadius + options.clearance) / 2;
+
+	pieces.clear();
+	Piece piece;
+	piece.first = 0;
+	float length = 0;
+	for (size_t s = 0; s < nSteps; ++s) {
+		if (s > piece.first && length + capsules[s].length > pieceLength) {
+			piece.last = (uint32_t) s;
+			pieces.push_back(piece);
+			piece.first = (uint32_t) s;
+			length = 0;
+		}
+		length += capsules[s].length;
+	}
+	piece.last = (uint32_t) nSteps;
+	pieces.push_back(piece);
+
+	ThreadPool::shared().parallelFor(pieces.size(), 256, [&](size_t begin, size_t end) {
+		for (size_t k = begin; k < end; ++k) {
+			Piece& p = pieces[k];
+			Bounds box;
+			for (size_t s = p.first; s < p.last; ++s) {
+				box.add(capsules[s].a);
+				box.add(capsules[s].b);
+			}
+			p.centre = box.centre();
+			float farSq = 0, radius = 0;
+			for (size_t s = p.first; s < p.last; ++s) {
+				Pnt3f da = capsules[s].a - p.centre;
+				Pnt3f db = capsules[s].b - p.centre;
+				farSq = std::max(farSq, std::max(dot(da, da), dot(db, db)));
+				radius = std::max(radius, capsules[s].radius);
+			}
+			p.bound = sqrtf(farSq) + radius;
+		}
+	});
+
+	float biggest = 0;
+	for (size_t k = 0; k < pieces.size(); ++k)
+		biggest = std::max(biggest, pieces[k].bound);
+	cellSize = 2 * biggest + options.clearance;
+	if (cellSize <= 0)
+		cellSize = 1;
+	for (size_t k = 0; k < pieces.size(); ++k) {
+		Piece& p = pieces[k];
+		p.cell[0] = (int) floorf(p.centre.x / cellSize);
+		p.cell[1] = (int) floorf(p.centre.y / cellSize);
+		p.cell[2] = (int) floorf(p.centre.z / cellSize);
+	}
+}
+
+//****************************************************************************
+//
+// * the hash is filled by counting the pieces in each bucket, then
+//   dealing them out
+//============================================================================
+void TrackClearance::
+buildHash()
+//============================================================================
+{
+	size_t nPieces = pieces.size();
+	size_t nBuckets = 1;
+	while (nBuckets < 2 * nPieces)
+		nBuckets <<= 1;
+	bucketStart.assign(nBuckets + 1, 0);
+	cellPieces.resize(nPieces);
+
+	for (size_t k = 0; k < nPieces; ++k)
+		++bucketStart[bucketOf(pieces[k].cell) + 1];
+	for (size_t b = 0; b < nBuckets; ++b)
+		bucketStart[b + 1] += bucketStart[b];
+	// dealing moves each start to the end of its bucket, which is the
+	// start of the next; then they're moved back along one
+	for (size_t k = 0; k < nPieces; ++k)
+		cellPieces[bucketStart[bucketOf(pieces[k].cell)]++] = (uint32_t) k;
+	for (size_t b = nBuckets; b > 0; --b)
+		bucketStart[b] = bucketStart[b - 1];
+	bucketStart[0] = 0;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t TrackClearance::
+bucketOf(const int cell[3]) const
+//============================================================================
+{
+	uint32_t h = ((uint32_t) cell[0] * 73856093u) ^ ((uint32_t) cell[1] * 19349663u) ^
+					 ((uint32_t) cell[2] * 83492791u);
+	return h & (bucketStart.size() - 2);
+}
+
+//****************************************************************************
+//
+// * steps i < j are neighbours if the gap between them along the track
+//   (either way round) is less than half a circle whose diameter is how
+//   close they're allowed to get - the track can't turn back that fast
+//============================================================================
+bool TrackClearance::
+neighbours(size_t i, size_t j, float reach) const
+//============================================================================
+{
+	const Capsule& a = capsules[i];
+	const Capsule& b = capsules[j];
+	float ahead = b.along - (a.along + a.length);
+	float behind = trackLength - (b.along + b.length) + a.along;
+	float gap = ahead < behind ? ahead : behind;
+	return gap < HALF_TURN * reach;
+}
+
+//****************************************************************************
+//
+// * each piece against the later pieces in the cells around it. the hash
+//   can put several cells in one bucket, so a piece only counts for the
+//   cell it is really in
+//============================================================================
+void TrackClearance::
+findClose()
+//============================================================================
+{
+	close.clear();
+	std::mutex closeLock;
+
+	ThreadPool::shared().parallelFor(pieces.size(), CLEARANCE_GRAIN, [&](size_t begin, size_t end) {
+		vector<Close> mine;
+		for (size_t p = begin; p < end; ++p) {
+			const Piece& pp = pieces[p];
+			int cell[3];
+			for (int dx = -1; dx <= 1; ++dx)
+			for (int dy = -1; dy <= 1; ++dy)
+			for (int dz = -1; dz <= 1; ++dz) {
+				cell[0] = pp.cell[0] + dx;
+				cell[1] = pp.cell[1] + dy;
+				cell[2] = pp.cell[2] + dz;
+				size_t bucket = bucketOf(cell);
+				for (uint32_t k = bucketStart[bucket]; k < bucketStart[bucket + 1]; ++k) {
+					size_t q = cellPieces[k];
+					const Piece& qq = pieces[q];
+					if (q <= p || qq.cell[0] != cell[0] || qq.cell[1] != cell[1] ||
+						 qq.cell[2] != cell[2])
+						continue;
+
+					Pnt3f apart = qq.centre - pp.centre;
+					float bound = pp.bound + qq.bound + options.clearance;
+					if (dot(apart, apart) < bound * bound)
+						closeSteps(pp, qq, mine);
+				}
+			}
+		}
+		if (!mine.empty()) {
+			std::lock_guard<std::mutex> lock(closeLock);
+			close.insert(close.end(), mine.begin(), mine.end());
+		}
+	});
+
+	std::sort(close.begin(), close.end());
+}
+
+//****************************************************************************
+//
+// * the steps of two pieces that are too close (all of p's steps come
+//   before q's). for each step of p, the steps of q that can be more than
+//   neighbours are the ones far enough ahead of it, and far enough behind
+//   it round the end of the track - a range that only moves forward as
+//   the step of p does
+//============================================================================
+void TrackClearance::
+closeSteps(const Piece& p, const Piece& q, vector<Close>& out) const
+//============================================================================
+{
+	float apart = HALF_TURN * (2 * minRadius + options.clearance);
+	size_t lo = q.first, hi = q.first;
+	for (size_t i = p.first; i < p.last; ++i) {
+		const Capsule& ci = capsules[i];
+		while (lo < q.last && capsules[lo].along - (ci.along + ci.length) < apart)
+			++lo;
+		if (hi < lo)
+			hi = lo;
+		float limit = trackLength + ci.along - apart;
+		while (hi < q.last && capsules[hi].along + capsules[hi].length <= limit)
+			++hi;
+
+		Pnt3f midI = (ci.a + ci.b) * 0.5f;
+		Pnt3f toQ = q.centre - midI;
+		float qBound = ci.length / 2 + ci.radius + q.bound + options.clearance;
+		if (lo == hi || dot(toQ, toQ) >= qBound * qBound)
+			continue;
+		for (size_t j = lo; j < hi; ++j) {
+			const Capsule& cj = capsules[j];
+			float reach = ci.radius + cj.radius + options.clearance;
+			Pnt3f off = (cj.a + cj.b) * 0.5f - midI;
+			float bound = (ci.length + cj.length) / 2 + reach;
+			if (dot(off, off) >= bound * bound || neighbours(i, j, reach))
+				continue;
+
+			Close c;
+			float dSq = closestBetween(ci.a, ci.b, cj.a, cj.b, c.firstPos, c.secondPos);
+			if (dSq >= reach * reach)
+				continue;
+			c.first = (uint32_t) i;
+			c.second = (uint32_t) j;
+			c.separation = sqrtf(dSq) - ci.radius - cj.radius;
+			out.push_back(c);
+		}
+	}
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+static uint32_t findRoot(vector<uint32_t>& parent, uint32_t i)
+//============================================================================
+{
+	while (parent[i] != i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+//****************************************************************************
+//
+// * the stretch of a (closed) track covered by some steps: everything but
+//   the biggest gap between them
+//============================================================================
+static void stepRange(vector<uint32_t>& steps, size_t nSteps, uint32_t& first, uint32_t& last)
+//============================================================================
+{
+	std::sort(steps.begin(), steps.end());
+	steps.erase(std::unique(steps.begin(), steps.end()), steps.end());
+
+	first = steps.front();
+	last = steps.back();
+	size_t biggest = nSteps - 1 - steps.back() + steps.front();
+	for (size_t i = 1; i < steps.size(); ++i) {
+		size_t gap = steps[i] - steps[i - 1] - 1;
+		if (gap > biggest) {
+			biggest = gap;
+			first = steps[i];
+			last = steps[i - 1];
+		}
+	}
+}
+
+//****************************************************************************
+//
+// * pairs of close steps that are next to each other (either step one on,
+//   or both) are the same conflict. in each conflict, the side a step is
+//   on is whichever it is nearer along the track to the first pair's
+//   first step (the two sides are never neighbours, so that can't mix
+//   them up, even where a conflict runs past the start of the track)
+//============================================================================
+void TrackClearance::
+gather()
+//============================================================================
+{
+	if (close.empty())
+		return;
+
+	size_t nSteps = capsules.size();
+	size_t nClose = close.size();
+	vector<uint32_t> parent(nClose);
+	for (size_t p = 0; p < nClose; ++p)
+		parent[p] = (uint32_t) p;
+
+	static const int nextTo[4][2] = { { 0, 1 }, { 1, -1 }, { 1, 0 }, { 1, 1 } };
+	for (size_t p = 0; p < nClose; ++p) {
+		for (int k = 0; k < 4; ++k) {
+			Close key;
+			key.first = (uint32_t) ((close[p].first + nSteps + nextTo[k][0]) % nSteps);
+			key.second = (uint32_t) ((close[p].second + nSteps + nextTo[k][1]) % nSteps);
+			if (key.first > key.second)
+				std::swap(key.first, key.second);
+			vector<Close>::const_iterator at = std::lower_bound(close.begin(), close.end(), key);
+			if (at != close.end() && at->first == key.first && at->second == key.second) {
+				uint32_t a = findRoot(parent, (uint32_t) p);
+				uint32_t b = findRoot(parent, (uint32_t) (at - close.begin()));
+				if (a != b)
+					parent[b] = a;
+			}
+		}
+	}
+
+	// the pairs of each conflict together
+	vector<std::pair<uint32_t, uint32_t> > byConflict(nClose);
+	for (size_t p = 0; p < nClose; ++p)
+		byConflict[p] = std::make_pair(findRoot(parent, (uint32_t) p), (uint32_t) p);
+	std::sort(byConflict.begin(), byConflict.end());
+
+	vector<uint32_t> aSteps, bSteps;
+	for (size_t begin = 0; begin < nClose;) {
+		size_t end = begin;
+		while (end < nClose && byConflict[end].first == byConflict[begin].first)
+			++end;
+
+		ClearanceConflict conflict;
+		conflict.separation = FLT_MAX;
+		aSteps.clear();
+		bSteps.clear();
+		uint32_t ref = close[byConflict[begin].second].first;
+		for (size_t k = begin; k < end; ++k) {
+			const Close& c = close[byConflict[k].second];
+			size_t toFirst = c.first > ref ? c.first - ref : ref - c.first;
+			size_t toSecond = c.second > ref ? c.second - ref : ref - c.second;
+			toFirst = std::min(toFirst, nSteps - toFirst);
+			toSecond = std::min(toSecond, nSteps - toSecond);
+			bool swapped = toSecond < toFirst;
+
+			aSteps.push_back(swapped ? c.second : c.first);
+			bSteps.push_back(swapped ? c.first : c.second);
+			if (c.separation < conflict.separation) {
+				conflict.separation = c.separation;
+				conflict.aPos = swapped ? c.secondPos : c.firstPos;
+				conflict.bPos = swapped ? c.firstPos : c.secondPos;
+			}
+		}
+
+		uint32_t first, last;
+		stepRange(aSteps, nSteps, first, last);
+		conflict.aStart = capsules[first].along;
+		conflict.aEnd = capsules[last].along + capsules[last].length;
+		stepRange(bSteps, nSteps, first, last);
+		conflict.bStart = capsules[first].along;
+		conflict.bEnd = capsules[last].along + capsules[last].length;
+		if (conflict.bStart < conflict.aStart) {
+			std::swap(conflict.aStart, conflict.bStart);
+			std::swap(conflict.aEnd, conflict.bEnd);
+			std::swap(conflict.aPos, conflict.bPos);
+		}
+		found.push_back(conflict);
+		begin = end;
+	}
+
+	std::sort(found.begin(), found.end(), [](const ClearanceConflict& a, const ClearanceConflict& b) {
+		return a.aStart < b.aStart;
+	});
+}
@@ -0,0 +1,133 @@
+/************************************************************************
+     File:        TrackCompiler.cpp
+
+     Comment:     Compiles the track on a worker thread. See
+						TrackCompiler.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#pragma warning(push)
+#pragma warning(disable:4312)
+#pragma warning(disable:4311)
+#include <Fl/Fl.h>
+#pragma warning(pop)
+
+#include "TrackCompiler.H"
+#include "TrackCache.H"
+#include "Utilities/Trace.H"
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+TrackCompiler::
+TrackCompiler(TrackSnapshotStore& _store, ReadyCallback _ready, void* _readyData)
+	: store(_store), ready(_ready), readyData(_readyData),
+	  quit(false), working(false), pending(false),
+	  splineType(SPLINE_CARDINAL), tension(0.5f), divide(1), useCache(false),
+	  worker(&TrackCompiler::run, this)
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// * Destructor
+//============================================================================
+TrackCompiler::
+~TrackCompiler()
+//============================================================================
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		quit = true;
+	}
+	wake.notify_one();
+	worker.join();
+}
+
+//****************************************************************************
+//
+// * hand the worker a new set of points. anything it hadn't started on yet
+//   gets thrown away
+//============================================================================
+void TrackCompiler::
+request(const vector<ControlPoint>& _points, int _splineType, float _tension, int _divide,
+		  bool _useCache)
+//============================================================================
+{
+	// copy outside the lock, so the worker never waits on it
+	vector<ControlPoint> copy(_points);
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		points.swap(copy);
+		splineType = _splineType;
+		tension = _tension;
+		divide = _divide;
+		useCache = _useCache;
+		pending = true;
+	}
+	wake.notify_one();
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool TrackCompiler::
+busy()
+//============================================================================
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return pending || working;
+}
+
+//****************************************************************************
+//
+// * the worker: wait for a request, compile it, publish it, repeat
+//============================================================================
+void TrackCompiler::
+run()
+//============================================================================
+{
+	Trace::setThreadName("TrackCompiler");
+
+	vector<ControlPoint> work;
+	for (;;) {
+		int type, div;
+		float ten;
+		bool cache;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			working = false;
+			wake.wait(guard, [this] { return pending || quit; });
+			if (quit)
+				return;
+			work.swap(points);
+			type = splineType;
+			ten = tension;
+			div = divide;
+			cache = useCache;
+			pending = false;
+			working = true;
+		}
+
+		TrackSnapshot track;
+		if (cache)
+			track = findCachedTrack(work, type, ten, div);
+		if (!track) {
+			// whatever is showing now was most likely compiled from nearly
+			// the same points
+			TrackSnapshot previous = store.current();
+			track = compileTrack(work, type, ten, div, previous.get());
+			store.publish(track);
+			if (cache)
+				storeCachedTrack(*track);
+		} else
+			store.publish(track);
+		if (ready)
+			Fl::awake(ready, readyData);
+	}
+}
@@ -0,0 +1,407 @@
+/************************************************************************
+     File:        TrackExport.cpp
+
+     Comment:     Writes the track out through assimp. See TrackExport.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include <ctype.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+
+#include "assimp/cexport.h"
+#include "assimp/material.h"
+#include "assimp/scene.h"
+
+#include "TrackExport.H"
+#include "Utilities/Trace.H"
+
+// the materials, in the order they're made
+enum ExportMaterial {
+	MATERIAL_RAILS,
+	MATERIAL_TIES,
+	MATERIAL_SUPPORTS,
+	MATERIAL_TUNNEL,
+	MATERIAL_CARS,
+	MATERIAL_ENGINE,
+	NUM_MATERIALS
+};
+
+//****************************************************************************
+//
+// * the shapes, as drawCompiledTrack and drawTrain draw them. every quad is
+//   four corners, each a mix of the frame vectors
+//============================================================================
+
+// a tie: (forward, right, up) around the end of its step, with forward
+// and right doubled
+static const float TIE_QUADS[4][4][3] = {
+	{ {  1, -1,  0 }, {  1,  1,  0 }, { -1,  1,  0 }, { -1, -1,  0 } },	// top
+	{ {  1, -1, -1 }, {  1,  1, -1 }, { -1,  1, -1 }, { -1, -1, -1 } },	// bottom
+	{ {  1,  1,  0 }, {  1,  1, -1 }, { -1,  1, -1 }, { -1,  1,  0 } },	// sides
+	{ {  1, -1,  0 }, {  1, -1, -1 }, { -1, -1, -1 }, { -1, -1,  0 } },
+};
+
+// a slice of the tunnel: (right, up, forward) from the start of its
+// step, with right 3 * cross, up 10 long and forward 0.1 long
+static const float TUNNEL_QUADS[9][4][3] = {
+	{ {  1.0f, 0.0f, 0 }, {  1.0f, 1.0f, 0 }, {  1.2f, 1.0f, 0 }, {  1.2f, 0.0f, 0 } },	// right
+	{ { -1.2f, 1.0f, 0 }, {  1.2f, 1.0f, 0 }, {  1.2f, 1.1f, 0 }, { -1.2f, 1.1f, 0 } },	// top
+	{ {  1.2f, 1.1f, 0 }, { -1.2f, 1.1f, 0 }, { -1.2f, 1.1f, 1 }, {  1.2f, 1.1f, 1 } },	// top outside
+	{ {  1.2f, 1.0f, 0 }, { -1.2f, 1.0f, 0 }, { -1.2f, 1.0f, 1 }, {  1.2f, 1.0f, 1 } },	// top inside
+	{ {  1.2f, 0.0f, 0 }, {  1.2f, 1.0f, 0 }, {  1.2f, 1.0f, 1 }, {  1.2f, 0.0f, 1 } },	// right outside
+	{ {  1.0f, 0.0f, 0 }, {  1.0f, 1.0f, 0 }, {  1.0f, 1.0f, 1 }, {  1.0f, 0.0f, 1 } },	// right inside
+	{ { -1.0f, 0.0f, 0 }, { -1.0f, 1.0f, 0 }, { -1.2f, 1.0f, 0 }, { -1.2f, 0.0f, 0 } },	// left
+	{ { -1.2f, 0.0f, 0 }, { -1.2f, 1.0f, 0 }, { -1.2f, 1.0f, 1 }, { -1.2f, 0.0f, 1 } },	// left outside
+	{ { -1.0f, 0.0f, 0 }, { -1.0f, 1.0f, 0 }, { -1.0f, 1.0f, 1 }, { -1.0f, 0.0f, 1 } },	// left inside
+};
+
+// the engine's cube, in the car's own space (x forward, y up, z right)
+static const float CUBE_QUADS[6][4][3] = {
+	{ { 0, 0, 0 }, { 1, 0, 0 }, { 1, 0, 1 }, { 0, 0, 1 } },
+	{ { 0, 1, 1 }, { 1, 1, 1 }, { 1, 1, 0 }, { 0, 1, 0 } },
+	{ { 0, 0, 0 }, { 0, 1, 0 }, { 1, 1, 0 }, { 1, 0, 0 } },
+	{ { 1, 0, 0 }, { 1, 1, 0 }, { 1, 1, 1 }, { 1, 0, 1 } },
+	{ { 0, 0, 1 }, { 1, 0, 1 }, { 1, 1, 1 }, { 0, 1, 1 } },
+	{ { 0, 0, 0 }, { 0, 0, 1 }, { 0, 1, 1 }, { 0, 1, 0 } },
+};
+
+// the splash panels every car has, before drawTrain turns them a quarter
+// turn, scales them by 1.2 and moves them by -0.5 (see splashToCar)
+static const float SPLASH_QUADS[6][4][3] = {
+	{ { -0.5f, -0.7f, 0.1f }, {  0.5f, -0.7f, 0.1f }, {  0.5f, -0.2f, 0.1f }, { -0.5f, -0.2f, 0.1f } },	// back
+	{ {  0.5f, -0.7f, 0.1f }, {  0.5f, -0.2f, 0.1f }, {  0.5f, -0.2f, 1.5f }, {  0.5f, -0.7f, 1.5f } },	// left
+	{ {  0.5f, -0.7f, 0.1f }, {  0.5f, -0.7f, 1.5f }, { -0.5f, -0.7f, 1.5f }, { -0.5f, -0.7f, 0.1f } },	// bottom
+	{ {  0.5f, -0.2f, 0.1f }, {  0.5f, -0.2f, 1.5f }, { -0.5f, -0.2f, 1.5f }, { -0.5f, -0.2f, 0.1f } },	// top
+	{ { -0.5f, -0.7f, 0.1f }, { -0.5f, -0.2f, 0.1f }, { -0.5f, -0.2f, 1.5f }, { -0.5f, -0.7f, 1.5f } },	// right
+	{ { -0.5f, -0.7f, 1.5f }, {  0.5f, -0.7f, 1.5f }, {  0.5f, -0.2f, 1.5f }, { -0.5f, -0.2f, 1.5f } },	// front
+};
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+TrackExportOptions::
+TrackExportOptions()
+	: parallelRails(false), ties(false), supports(false), tunnel(false),
+	  tunnelLength(0.5f)
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+static inline aiVector3D toAi(const Pnt3f& p)
+//============================================================================
+{
+	return aiVector3D(p.x, p.y, p.z);
+}
+
+//****************************************************************************
+//
+// * a splash panel corner in the car's space: the quarter turn takes
+//   (x, y, z) to (z, y, -x)
+//============================================================================
+static inline aiVector3D splashToCar(const float* p)
+//============================================================================
+{
+	return aiVector3D(1.2f * p[2], 1.2f * p[1], -1.2f * (p[0] - 0.5f));
+}
+
+//****************************************************************************
+//
+// * make the meshes for count things of itemVertices vertices each,
+//   cutting them into meshes of at most EXPORT_CHUNK_VERTICES. fill(i, v)
+//   writes the vertices of thing i to v. lines go in pairs; everything
+//   else in quads, which get a flat normal and become two triangles
+//============================================================================
+template <class Fill>
+static void addMeshes(vector<aiMesh*>& meshes, size_t count, unsigned itemVertices,
+							 bool lines, unsigned material, Fill fill)
+//============================================================================
+{
+	size_t perMesh = std::max<size_t>(1, EXPORT_CHUNK_VERTICES / itemVertices);
+	for (size_t first = 0; first < count; first += perMesh) {
+		size_t n = std::min(perMesh, count - first);
+		unsigned nv = (unsigned) (n * itemVertices);
+
+		aiMesh* mesh = new aiMesh;
+		meshes.push_back(mesh);
+		mesh->mMaterialIndex = material;
+		mesh->mNumVertices = nv;
+		mesh->mVertices = new aiVector3D[nv];
+		for (size_t i = 0; i < n; ++i)
+			fill(first + i, &mesh->mVertices[i * itemVertices]);
+
+		if (lines) {
+			mesh->mPrimitiveTypes = aiPrimitiveType_LINE;
+			mesh->mNumFaces = nv / 2;
+			mesh->mFaces = new aiFace[mesh->mNumFaces];
+			for (unsigned f = 0; f < mesh->mNumFaces; ++f) {
+				aiFace& face = mesh->mFaces[f];
+				face.mNumIndices = 2;
+				face.mIndices = new unsigned[2];
+				face.mIndices[0] = f * 2;
+				face.mIndices[1] = f * 2 + 1;
+			}
+		} else {
+			mesh->mPrimitiveTypes = aiPrimitiveType_TRIANGLE;
+			mesh->mNormals = new aiVector3D[nv];
+			mesh->mNumFaces = nv / 2;
+			mesh->mFaces = new aiFace[mesh->mNumFaces];
+			for (unsigned q = 0; q < nv / 4; ++q) {
+				const aiVector3D* v = &mesh->mVertices[q * 4];
+				aiVector3D normal = (v[1] - v[0]) ^ (v[2] - v[0]);
+				normal.Normalize();
+				for (int k = 0; k < 4; ++k)
+					mesh->mNormals[q * 4 + k] = normal;
+
+				static const unsigned corners[2][3] = { { 0, 1, 2 }, { 0, 2, 3 } };
+				for (int t = 0; t < 2; ++t) {
+					aiFace& face = mesh->mFaces[q * 2 + t];
+					face.mNumIndices = 3;
+					face.mIndices = new unsigned[3];
+					for (int k = 0; k < 3; ++k)
+						face.mIndices[k] = q * 4 + corners[t][k];
+				}
+			}
+		}
+	}
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+static aiMaterial* makeMaterial(const char* name, float r, float g, float b)
+//============================================================================
+{
+	aiMaterial* material = new aiMaterial;
+	aiString aname;
+	aname.Set(name);
+	material->AddProperty(&aname, AI_MATKEY_NAME);
+	aiColor3D color(r, g, b);
+	material->AddProperty(&color, 1, AI_MATKEY_COLOR_DIFFUSE);
+	return material;
+}
+
+//****************************************************************************
+//
+// * the assimp export format that writes files with this one's extension
+//   (null if there isn't one)
+//============================================================================
+static const char* exportFormat(const char* filename)
+//============================================================================
+{
+	const char* dot = strrchr(filename, '.');
+	if (!dot || strchr(dot, '/') || strchr(dot, '\\'))
+		return 0;
+	const char* ext = dot + 1;
+
+	size_t n = aiGetExportFormatCount();
+	for (size_t i = 0; i < n; ++i) {
+		const aiExportFormatDesc* desc = aiGetExportFormatDescription(i);
+		if (!desc || !desc->fileExtension)
+			continue;
+		const char* a = desc->fileExtension;
+		const char* b = ext;
+		while (*a && *b && tolower((unsigned char) *a) == tolower((unsigned char) *b)) {
+			a++;
+			b++;
+		}
+		if (!*a && !*b)
+			return desc->id;
+	}
+	return 0;
+}
+
+//****************************************************************************
+//
+// * the track meshes first, all on the root node; then the car meshes, with
+//   a node for each car that puts it in its place
+//============================================================================
+bool exportTrack(const char* filename, const CompiledTrack& track,
+					  const TrackExportOptions& options, TrackIOError& error)
+//============================================================================
+{
+	TRACE_SCOPE("exportTrack");
+
+	const char* format = exportFormat(filename);
+	if (!format) {
+		error.set(filename, 0, 0, "assimp can't write files of this type");
+		return false;
+	}
+	if (!track.numSteps()) {
+		error.set(filename, 0, 0, "there is no track to export");
+		return false;
+	}
+
+	vector<aiMesh*> meshes;
+
+	//*********************************************************************
+	// the rails
+	//*********************************************************************
+	const vector<Pnt3f>& rails = options.parallelRails ? track.parallelLines : track.railLines;
+	addMeshes(meshes, rails.size() / 2, 2, true, MATERIAL_RAILS,
+		[&](size_t i, aiVector3D* v) {
+			v[0] = toAi(rails[i * 2]);
+			v[1] = toAi(rails[i * 2 + 1]);
+		});
+
+	//*********************************************************************
+	// the ties
+	//*********************************************************************
+	if (options.ties) {
+		addMeshes(meshes, track.ties.size(), 16, false, MATERIAL_TIES,
+			[&](size_t i, aiVector3D* v) {
+				int step = track.ties[i];
+				Pnt3f qt = track.stepEnd(step);
+				Pnt3f right = track.cross[step] * 2;
+				Pnt3f forward = track.forward[step] * 2;
+				Pnt3f up = right * forward;
+				up.normalize();
+				for (int q = 0; q < 4; ++q)
+					for (int k = 0; k < 4; ++k) {
+						const float* c = TIE_QUADS[q][k];
+						*v++ = toAi(qt + forward * c[0] + right * c[1] + up * c[2]);
+					}
+			});
+	}
+
+	//*********************************************************************
+	// the supports: down to the ground under every other tie, one under
+	// the middle rail or one under each of the parallel ones
+	//*********************************************************************
+	if (options.supports) {
+		unsigned perSupport = options.parallelRails ? 4 : 2;
+		addMeshes(meshes, (track.ties.size() + 1) / 2, perSupport, true, MATERIAL_SUPPORTS,
+			[&](size_t i, aiVector3D* v) {
+				int step = track.ties[i * 2];
+				Pnt3f qt = track.stepEnd(step);
+				if (!options.parallelRails) {
+					v[0] = toAi(qt);
+					v[1] = aiVector3D(qt.x, 0, qt.z);
+				} else {
+					Pnt3f right = track.cross[step];
+					Pnt3f a = qt + right;
+					Pnt3f b = qt - right;
+					v[0] = toAi(a);
+					v[1] = aiVector3D(a.x, 0, a.z);
+					v[2] = toAi(b);
+					v[3] = aiVector3D(b.x, 0, b.z);
+				}
+			});
+	}
+
+	//*********************************************************************
+	// the tunnel, over the first part of the track
+	//*********************************************************************
+	if (options.tunnel) {
+		size_t tunnelSteps = (size_t) (track.numSteps() * options.tunnelLength);
+		addMeshes(meshes, tunnelSteps, 36, false, MATERIAL_TUNNEL,
+			[&](size_t step, aiVector3D* v) {
+				Pnt3f qt = track.stepStart(step);
+				Pnt3f right = track.cross[step] * 3;
+				Pnt3f forward = track.forward[step] * 3;
+				Pnt3f up = right * forward;
+				forward.normalize();
+				forward = forward * 0.1f;
+				up.normalize();
+				up = up * 10;
+				for (int q = 0; q < 9; ++q)
+					for (int k = 0; k < 4; ++k) {
+						const float* c = TUNNEL_QUADS[q][k];
+						*v++ = toAi(qt + right * c[0] + up * c[1] + forward * c[2]);
+					}
+			});
+	}
+
+	unsigned nTrackMeshes = (unsigned) meshes.size();
+
+	//*********************************************************************
+	// the cars: one mesh for the cars, one for the engine (which has its
+	// cube too), both in the car's own space
+	//*********************************************************************
+	unsigned carMesh = (unsigned) meshes.size();
+	addMeshes(meshes, 1, 24, false, MATERIAL_CARS,
+		[&](size_t, aiVector3D* v) {
+			for (int q = 0; q < 6; ++q)
+				for (int k = 0; k < 4; ++k)
+					*v++ = splashToCar(SPLASH_QUADS[q][k]);
+		});
+	unsigned engineMesh = (unsigned) meshes.size();
+	addMeshes(meshes, 1, 24, false, MATERIAL_ENGINE,
+		[&](size_t, aiVector3D* v) {
+			for (int q = 0; q < 6; ++q)
+				for (int k = 0; k < 4; ++k) {
+					const float* c = CUBE_QUADS[q][k];
+					*v++ = aiVector3D(c[0], c[1], c[2]);
+				}
+		});
+
+	//*********************************************************************
+	// put the scene together (it owns everything from here on)
+	//*********************************************************************
+	std::unique_ptr<aiScene> scene(new aiScene);
+
+	scene->mNumMaterials = NUM_MATERIALS;
+	scene->mMaterials = new aiMaterial*[NUM_MATERIALS];
+	scene->mMaterials[MATERIAL_RAILS] = makeMaterial("rails", 1, 0, 0);
+	scene->mMaterials[MATERIAL_TIES] = makeMaterial("ties", 1, 0, 0);
+	scene->mMaterials[MATERIAL_SUPPORTS] = makeMaterial("supports", 1, 0, 0);
+	scene->mMaterials[MATERIAL_TUNNEL] = makeMaterial("tunnel", 0.5f, 0.5f, 0.1f);
+	scene->mMaterials[MATERIAL_CARS] = makeMaterial("cars", 0, 0, 0);
+	scene->mMaterials[MATERIAL_ENGINE] = makeMaterial("engine", 0.5f, 0, 0.5f);
+
+	scene->mNumMeshes = (unsigned) meshes.size();
+	scene->mMeshes = new aiMesh*[meshes.size()];
+	std::copy(meshes.begin(), meshes.end(), scene->mMeshes);
+
+	aiNode* root = new aiNode("RollerCoaster");
+	scene->mRootNode = root;
+	root->mNumMeshes = nTrackMeshes;
+	root->mMeshes = new unsigned[std::max(1u, nTrackMeshes)];
+	for (unsigned i = 0; i < nTrackMeshes; ++i)
+		root->mMeshes[i] = i;
+
+	size_t nCars = options.cars.size();
+	if (nCars) {
+		root->mNumChildren = (unsigned) nCars;
+		root->mChildren = new aiNode*[nCars];
+		for (size_t i = 0; i < nCars; ++i) {
+			const TrainCar& car = options.cars[i];
+			aiNode* node = new aiNode(car.engine ? "engine" : "car");
+			node->mParent = root;
+			root->mChildren[i] = node;
+
+			// drawTrain: move to the car, turn to its frame, scale by 5,
+			// then move by (-0.5, 1, -0.5)
+			Pnt3f x = car.forward * 5;
+			Pnt3f y = car.up * 5;
+			Pnt3f z = car.right * 5;
+			Pnt3f t = car.pos + x * -0.5f + y + z * -0.5f;
+			node->mTransformation = aiMatrix4x4(x.x, y.x, z.x, t.x,
+															x.y, y.y, z.y, t.y,
+															x.z, y.z, z.z, t.z,
+															0, 0, 0, 1);
+
+			node->mNumMeshes = car.engine ? 2 : 1;
+			node->mMeshes = new unsigned[node->mNumMeshes];
+			node->mMeshes[0] = carMesh;
+			if (car.engine)
+				node->mMeshes[1] = engineMesh;
+		}
+	}
+
+	if (aiExportScene(scene.get(), format, filename, 0) != aiReturn_SUCCESS) {
+		error.set(filename, 0, 0, "assimp couldn't write the file");
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,1014 @@
+/************************************************************************
+     File:        TrackIO.cpp
+
+     Comment:     Reading (and writing) track files. See TrackIO.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include <ctype.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+#include <algorithm>
+#include <charconv>
+
+#include "TrackIO.H"
+#include "Utilities/Hash.H"
+#include "Utilities/MappedFile.H"
+#include "Utilities/ThreadPool.H"
+#include "Utilities/Trace.H"
+
+// the least text worth giving its own parsing task
+#define PARSE_CHUNK_BYTES (64 * 1024)
+// how many points make a chunk of text to format (and write) at once
+#define WRITE_CHUNK_POINTS 8192
+// orientations closer than this (squared) to unit length are left alone
+#define UNIT_LENGTH_SLOP 1e-6f
+// the longest a point's line can be (6 floats, spaces and a newline)
+#define MAX_LINE_CHARS 128
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+TrackIOError::
+TrackIOError()
+	: line(0), column(0)
+//============================================================================
+{
+	message[0] = 0;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void TrackIOError::
+set(const char* filename, int _line, int _column, const char* format, ...)
+//============================================================================
+{
+	line = _line;
+	column = _column;
+
+	int n;
+	if (line > 0)
+		n = snprintf(message, sizeof(message), "%s:%d:%d: ", filename, line, column);
+	else
+		n = snprintf(message, sizeof(message), "%s: ", filename);
+	if (n < 0 || n >= (int) sizeof(message))
+		n = 0;
+
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message + n, sizeof(message) - n, format, args);
+	va_end(args);
+}
+
+//****************************************************************************
+//
+// * walks over the text a line at a time, without copying anything
+//============================================================================
+struct TextCursor {
+	const char*	p;
+	const char*	end;
+	const char*	lineStart;
+	int			line;
+
+	// anything up to a space is white space (but the end of line counts)
+	void skipSpaces()
+	{
+		while (p < end && *p <= ' ' && *p != '\n')
+			p++;
+	}
+
+	// at the end of the line, or at a comment (which runs to the end of it)
+	bool atLineEnd() const
+	{
+		return p >= end || *p == '\n' || *p == '#';
+	}
+
+	void nextLine()
+	{
+		const char* nl = (const char*) memchr(p, '\n', end - p);
+		p = nl ? nl + 1 : end;
+		lineStart = p;
+		line++;
+	}
+
+	// skip lines with nothing on them - false if the text runs out first
+	bool nextContent()
+	{
+		for (;;) {
+			if (p >= end)
+				return false;
+			skipSpaces();
+			if (!atLineEnd())
+				return true;
+			nextLine();
+		}
+	}
+
+	// the end of the word we're sitting at
+	const char* wordEnd() const
+	{
+		const char* e = p;
+		while (e < end && *e > ' ' && *e != '#')
+			e++;
+		return e;
+	}
+
+	int column() const
+	{
+		return (int) (p - lineStart) + 1;
+	}
+};
+
+//****************************************************************************
+//
+// * from_chars doesn't take a leading +, but strtod (which we used to use)
+//   did
+//============================================================================
+template <class T>
+static bool parseNumber(const char* begin, const char* end, T& value)
+//============================================================================
+{
+	if (begin < end && *begin == '+')
+		begin++;
+	std::from_chars_result r = std::from_chars(begin, end, value);
+	return r.ec == std::errc() && r.ptr == end;
+}
+
+//****************************************************************************
+//
+// * one point, from the line the cursor is on. leaves the cursor at the
+//   end of the line
+//============================================================================
+static bool parsePoint(TextCursor& c, ControlPoint& point,
+							  const char* filename, TrackIOError& error)
+//============================================================================
+{
+	float v[6];
+	int n = 0;
+	while (!c.atLineEnd()) {
+		const char* we = c.wordEnd();
+		if (n == 6) {
+			error.set(filename, c.line, c.column(), "too many numbers for a point (3 or 6)");
+			return false;
+		}
+		if (!parseNumber(c.p, we, v[n])) {
+			error.set(filename, c.line, c.column(), "\"%.*s\" is not a number",
+						 (int) std::min<size_t>(we - c.p, 32), c.p);
+			return false;
+		}
+		n++;
+		c.p = we;
+		c.skipSpaces();
+	}
+	if (n != 3 && n != 6) {
+		error.set(filename, c.line, c.column(), "a point needs 3 or 6 numbers, found %d", n);
+		return false;
+	}
+
+	point.pos = Pnt3f(v[0], v[1], v[2]);
+	point.orient = (n == 6) ? Pnt3f(v[3], v[4], v[5]) : Pnt3f(0, 1, 0);
+	// normalizing something that already is can still move it a little,
+	// so saving and loading again would never quite settle
+	float l = point.orient.x * point.orient.x + point.orient.y * point.orient.y +
+				 point.orient.z * point.orient.z;
+	if (fabsf(l - 1.0f) > UNIT_LENGTH_SLOP)
+		point.orient.normalize();
+	return true;
+}
+
+//****************************************************************************
+//
+// * a piece of the file (whole lines) that gets parsed as one task
+//============================================================================
+struct TextChunk {
+	const char*		begin;
+	const char*		end;
+	int				lines;			// lines in the chunk
+	size_t			nPoints;			// lines with a point on them
+	int				firstLine;		// line number of the first line
+	size_t			firstPoint;		// index of the first point
+	bool				ok;
+	TrackIOError	error;
+};
+
+//****************************************************************************
+//
+// * count the lines of a chunk, and the ones that have something on them
+//============================================================================
+static void countLines(TextChunk& chunk)
+//============================================================================
+{
+	TextCursor c;
+	c.p = chunk.begin;
+	c.end = chunk.end;
+	c.lineStart = c.p;
+	c.line = 0;
+	chunk.nPoints = 0;
+	while (c.p < c.end) {
+		c.skipSpaces();
+		if (!c.atLineEnd())
+			chunk.nPoints++;
+		c.nextLine();
+	}
+	chunk.lines = c.line;
+}
+
+//****************************************************************************
+//
+// * parse the points of a chunk into their place in the list (but not
+//   past the number of points the file says it has)
+//============================================================================
+static void parseChunk(TextChunk& chunk, const char* filename,
+							  ControlPoint* points, size_t npts)
+//============================================================================
+{
+	TextCursor c;
+	c.p = chunk.begin;
+	c.end = chunk.end;
+	c.lineStart = c.p;
+	c.line = chunk.firstLine;
+	chunk.ok = true;
+
+	size_t i = chunk.firstPoint;
+	while (i < npts && c.nextContent()) {
+		if (!parsePoint(c, points[i], filename, chunk.error)) {
+			chunk.ok = false;
+			return;
+		}
+		i++;
+		c.nextLine();
+	}
+}
+
+//****************************************************************************
+//
+// * the first line with anything on it: the number of points. leaves the
+//   cursor at the start of the line after it
+//============================================================================
+static bool parseHeader(TextCursor& c, const char* filename, size_t& npts,
+								TrackIOError& error)
+//============================================================================
+{
+	if (!c.nextContent()) {
+		error.set(filename, 0, 0, "the file is empty");
+		return false;
+	}
+	const char* we = c.wordEnd();
+	unsigned long long n;
+	if (!parseNumber(c.p, we, n)) {
+		error.set(filename, c.line, c.column(), "expected the number of points, found \"%.*s\"",
+					 (int) std::min<size_t>(we - c.p, 32), c.p);
+		return false;
+	}
+	if (n < MIN_TRACK_POINTS) {
+		error.set(filename, c.line, c.column(), "a track needs at least %d points, not %llu",
+					 MIN_TRACK_POINTS, n);
+		return false;
+	}
+	c.p = we;
+	c.skipSpaces();
+	if (!c.atLineEnd()) {
+		error.set(filename, c.line, c.column(), "unexpected text after the number of points");
+		return false;
+	}
+	c.nextLine();
+	// a count that doesn't fit is more than any file holds anyway
+	npts = n > SIZE_MAX ? SIZE_MAX : (size_t) n;
+	return true;
+}
+
+//****************************************************************************
+//
+// * parse the whole lines in [begin, end) onto the end of points, but not
+//   past limit points. line is the number of the first one, and is moved
+//   on past the last.
+//
+//   the text is cut into chunks of whole lines. the chunks count their
+//   points, so every chunk knows where its points go, and then they're
+//   all parsed at once
+//============================================================================
+static bool parseLines(const char* begin, const char* end, int& line, const char* filename,
+							  vector<ControlPoint>& points, size_t limit, TrackIOError& error)
+//============================================================================
+{
+	ThreadPool& pool = ThreadPool::shared();
+	size_t length = end - begin;
+	size_t nChunks = std::min<size_t>(pool.size() * 4, length / PARSE_CHUNK_BYTES + 1);
+
+	vector<TextChunk> chunks(nChunks);
+	const char* p = begin;
+	for (size_t i = 0; i < nChunks; ++i) {
+		chunks[i].begin = p;
+		if (i + 1 == nChunks)
+			p = end;
+		else {
+			p = std::max(p, begin + length * (i + 1) / nChunks);
+			const char* nl = (const char*) memchr(p, '\n', end - p);
+			p = nl ? nl + 1 : end;
+		}
+		chunks[i].end = p;
+	}
+
+	pool.parallelFor(nChunks, 1, [&](size_t b, size_t e) {
+		for (size_t i = b; i < e; ++i)
+			countLines(chunks[i]);
+	});
+
+	size_t total = points.size();
+	for (size_t i = 0; i < nChunks; ++i) {
+		chunks[i].firstPoint = total;
+		chunks[i].firstLine = line;
+		total += chunks[i].nPoints;
+		line += chunks[i].lines;
+	}
+
+	// and parse them, each chunk straight into its place
+	size_t nLoad = std::min(limit, total);
+	points.resize(nLoad);
+	pool.parallelFor(nChunks, 1, [&](size_t b, size_t e) {
+		for (size_t i = b; i < e; ++i)
+			parseChunk(chunks[i], filename, points.data(), nLoad);
+	});
+
+	// the first problem in the file is the one to report
+	for (size_t i = 0; i < nChunks; ++i) {
+		if (chunks[i].firstPoint >= nLoad)
+			break;
+		if (!chunks[i].ok) {
+			error = chunks[i].error;
+			return false;
+		}
+	}
+	return true;
+}
+
+//****************************************************************************
+//
+// * the header is read first, then the rest of the file all at once
+//============================================================================
+bool parseTrackText(const char* text, size_t length, const char* filename,
+						  vector<ControlPoint>& points, TrackIOError& error)
+//============================================================================
+{
+	TRACE_SCOPE("parseTrackText");
+
+	TextCursor c;
+	c.p = text;
+	c.end = text + length;
+	c.lineStart = text;
+	c.line = 1;
+
+	size_t npts;
+	if (!parseHeader(c, filename, npts, error))
+		return false;
+
+	vector<ControlPoint> loaded;
+	int line = c.line;
+	if (!parseLines(c.p, c.end, line, filename, loaded, npts, error))
+		return false;
+	if (loaded.size() < npts) {
+		error.set(filename, line, 1, "expected %llu points, but the file ends after %d",
+					 (unsigned long long) npts, (int) loaded.size());
+		return false;
+	}
+
+	points.swap(loaded);
+	return true;
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+TrackTextReader::
+TrackTextReader()
+	: filename(""), text(0), at(0), end(0), line(0), npts(0), nRead(0), finished(true)
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool TrackTextReader::
+begin(const char* _text, size_t length, const char* _filename, TrackIOError& error)
+//============================================================================
+{
+	filename = _filename;
+	text = _text;
+	end = _text + length;
+	nRead = 0;
+	finished = true;
+
+	TextCursor c;
+	c.p = text;
+	c.end = end;
+	c.lineStart = text;
+	c.line = 1;
+	if (!parseHeader(c, filename, npts, error))
+		return false;
+
+	at = c.p;
+	line = c.line;
+	finished = false;
+	return true;
+}
+
+//****************************************************************************
+//
+// * the piece always ends at the end of a line, so no point is cut in two
+//============================================================================
+bool TrackTextReader::
+next(size_t bytes, vector<ControlPoint>& points, TrackIOError& error)
+//============================================================================
+{
+	if (finished)
+		return true;
+
+	const char* stop = end;
+	if ((size_t) (end - at) > bytes) {
+		const char* nl = (const char*) memchr(at + bytes, '\n', end - (at + bytes));
+		stop = nl ? nl + 1 : end;
+	}
+
+	// the header can say any number of points, so don't let the limit
+	// wrap round past the end of a size_t
+	size_t before = points.size();
+	size_t left = npts - nRead;
+	size_t limit = left > SIZE_MAX - before ? SIZE_MAX : before + left;
+	if (!parseLines(at, stop, line, filename, points, limit, error)) {
+		points.resize(before);
+		finished = true;
+		return false;
+	}
+	nRead += points.size() - before;
+	at = stop;
+
+	if (nRead == npts)
+		finished = true;
+	else if (at == end) {
+		finished = true;
+		error.set(filename, line, 1, "expected %llu points, but the file ends after %d",
+					 (unsigned long long) npts, (int) nRead);
+		return false;
+	}
+	return true;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool TrackTextReader::
+done() const
+//============================================================================
+{
+	return finished;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t TrackTextReader::
+expected() const
+//============================================================================
+{
+	return npts;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+float TrackTextReader::
+progress() const
+//============================================================================
+{
+	if (finished || end == text)
+		return 1.0f;
+	return (float) (at - text) / (float) (end - text);
+}
+
+//****************************************************************************
+//
+// * the binary format. everything is little endian, and every array starts
+//   on an 8 byte boundary:
+//
+//     BinaryTrackHeader
+//     pos.x[n] pos.y[n] pos.z[n] orient.x[n] orient.y[n] orient.z[n]
+//   and if (flags & BINARY_HAS_TABLES):
+//     BinaryTablesHeader
+//     samples[n * (divide+1)] forward[steps] cross[steps]   (3 floats each)
+//     segmentLength[n] sumLength[n]
+//     arcPoints[nArcPoints] (3 floats each) ties[nTies] (int32)
+//============================================================================
+#define BINARY_MAGIC			"TRK\x1a"
+#define BINARY_VERSION		1
+#define BINARY_HAS_TABLES	1
+
+struct BinaryTrackHeader {
+	char			magic[4];
+	uint32_t		version;
+	uint32_t		flags;
+	uint32_t		headerSize;		// sizeof(BinaryTrackHeader)
+	uint64_t		nPoints;
+	uint64_t		pointsHash;		// hashBytes of the points, as ControlPoints
+};
+
+struct BinaryTablesHeader {
+	int32_t		splineType;
+	float			tension;
+	int32_t		divide;
+	float			totalLength;
+	uint64_t		key;				// trackKey of what the tables were built from
+	uint64_t		nArcPoints;
+	uint64_t		nTies;
+};
+
+static_assert(sizeof(Pnt3f) == 3 * sizeof(float), "Pnt3f arrays are written as they are");
+static_assert(sizeof(ControlPoint) == 2 * sizeof(Pnt3f), "the points hash covers the whole array");
+
+//****************************************************************************
+//
+// * we write the bytes as they are in memory, which is only the file
+//   format on a little endian machine
+//============================================================================
+static bool littleEndian()
+//============================================================================
+{
+	uint32_t one = 1;
+	unsigned char first;
+	memcpy(&first, &one, 1);
+	return first == 1;
+}
+
+//****************************************************************************
+//
+// * hands out the arrays of a mapped binary file, making sure each one is
+//   really in there
+//============================================================================
+struct BinaryCursor {
+	const char*	base;
+	size_t		length;
+	size_t		offset;
+
+	bool take(uint64_t count, size_t elemSize, const char*& out)
+	{
+		if (offset > length || count > (length - offset) / elemSize)
+			return false;
+		out = base + offset;
+		offset += (size_t) count * elemSize;
+		offset = (offset + 7) & ~(size_t) 7;
+		return true;
+	}
+
+	template <class T>
+	bool takeArray(uint64_t count, vector<T>& out)
+	{
+		const char* p;
+		if (!take(count, sizeof(T), p))
+			return false;
+		out.resize((size_t) count);
+		if (count)
+			memcpy(out.data(), p, (size_t) count * sizeof(T));
+		return true;
+	}
+};
+
+//****************************************************************************
+//
+// *
+//============================================================================
+static inline float loadFloat(const char* array, size_t i)
+//============================================================================
+{
+	float f;
+	memcpy(&f, array + i * sizeof(float), sizeof(float));
+	return f;
+}
+
+//****************************************************************************
+//
+// * read the compiled tables that follow the points - false if they're
+//   damaged or weren't built from these points
+//============================================================================
+static bool readTables(BinaryCursor& c, const vector<ControlPoint>& points,
+							  TrackSnapshot& compiled)
+//============================================================================
+{
+	const char* p;
+	if (!c.take(1, sizeof(BinaryTablesHeader), p))
+		return false;
+	BinaryTablesHeader th;
+	memcpy(&th, p, sizeof(th));
+
+	if (th.splineType < SPLINE_LINEAR || th.splineType > SPLINE_BSPLINE || th.divide < 1)
+		return false;
+	if (th.key != trackKey(points, th.splineType, th.tension, th.divide))
+		return false;
+
+	std::shared_ptr<CompiledTrack> track(new CompiledTrack);
+	CompiledTrack& ct = *track;
+	ct.points = points;
+	ct.splineType = th.splineType;
+	ct.tension = th.tension;
+	ct.divide = th.divide;
+	ct.totalLength = th.totalLength;
+
+	// in 64 bits: divide comes from the file, and adding one to the
+	// biggest int32 would overflow
+	uint64_t n = points.size();
+	uint64_t nSteps = n * (uint64_t) th.divide;
+	if (!c.takeArray(n * ((uint64_t) th.divide + 1), ct.samples) ||
+		 !c.takeArray(nSteps, ct.forward) ||
+		 !c.takeArray(nSteps, ct.cross) ||
+		 !c.takeArray(n, ct.segmentLength) ||
+		 !c.takeArray(n, ct.sumLength) ||
+		 !c.takeArray(th.nArcPoints, ct.arcPoints) ||
+		 !c.takeArray(th.nTies, ct.ties))
+		return false;
+	for (size_t i = 0; i < ct.ties.size(); ++i)
+		if (ct.ties[i] < 0 || (uint64_t) ct.ties[i] >= nSteps)
+			return false;
+
+	ct.buildMesh();
+	compiled = track;
+	return true;
+}
+
+//****************************************************************************
+//
+// * no parsing - check the header, check every array fits in the file,
+//   and copy them out
+//============================================================================
+bool parseTrackBinary(const char* data, size_t length, const char* filename,
+							 vector<ControlPoint>& points, TrackSnapshot* compiled,
+							 TrackIOError& error)
+//============================================================================
+{
+	TRACE_SCOPE("parseTrackBinary");
+
+	if (compiled)
+		compiled->reset();
+
+	if (!littleEndian()) {
+		error.set(filename, 0, 0, "binary track files need a little endian machine");
+		return false;
+	}
+
+	BinaryTrackHeader h;
+	if (length < sizeof(h)) {
+		error.set(filename, 0, 0, "too short to be a binary track file");
+		return false;
+	}
+	memcpy(&h, data, sizeof(h));
+	if (memcmp(h.magic, BINARY_MAGIC, 4) != 0) {
+		error.set(filename, 0, 0, "not a binary track file");
+		return false;
+	}
+	if (h.version != BINARY_VERSION) {
+		error.set(filename, 0, 0, "binary track file version %u, we read version %d",
+					 h.version, BINARY_VERSION);
+		return false;
+	}
+	if (h.headerSize < sizeof(h) || h.headerSize > length) {
+		error.set(filename, 0, 0, "damaged header");
+		return false;
+	}
+	if (h.nPoints < MIN_TRACK_POINTS) {
+		error.set(filename, 0, 0, "a track needs at least %d points, not %llu",
+					 MIN_TRACK_POINTS, (unsigned long long) h.nPoints);
+		return false;
+	}
+
+	BinaryCursor c;
+	c.base = data;
+	c.length = length;
+	c.offset = (h.headerSize + 7) & ~(size_t) 7;
+
+	const char* arrays[6];
+	for (int k = 0; k < 6; ++k) {
+		if (!c.take(h.nPoints, sizeof(float), arrays[k])) {
+			error.set(filename, 0, 0, "the file is cut short (expected %llu points)",
+						 (unsigned long long) h.nPoints);
+			return false;
+		}
+	}
+
+	size_t n = (size_t) h.nPoints;
+	vector<ControlPoint> loaded(n);
+	for (size_t i = 0; i < n; ++i) {
+		loaded[i].pos = Pnt3f(loadFloat(arrays[0], i), loadFloat(arrays[1], i), loadFloat(arrays[2], i));
+		loaded[i].orient = Pnt3f(loadFloat(arrays[3], i), loadFloat(arrays[4], i), loadFloat(arrays[5], i));
+	}
+	if (hashBytes(loaded.data(), n * sizeof(ControlPoint)) != h.pointsHash) {
+		error.set(filename, 0, 0, "the file is damaged (the points don't match their checksum)");
+		return false;
+	}
+
+	// the tables are only a cache - if they're no good, the track just
+	// gets compiled again
+	if (compiled && (h.flags & BINARY_HAS_TABLES) && !readTables(c, loaded, *compiled))
+		compiled->reset();
+
+	points.swap(loaded);
+	return true;
+}
+
+//****************************************************************************
+//
+// * writes to a FILE, keeping every array 8 byte aligned
+//============================================================================
+struct BinaryWriter {
+	FILE*		fp;
+	uint64_t	offset;
+	bool		ok;
+
+	void write(const void* data, size_t bytes)
+	{
+		if (ok && bytes && fwrite(data, 1, bytes, fp) != bytes)
+			ok = false;
+		offset += bytes;
+	}
+
+	void pad()
+	{
+		static const char zeros[8] = { 0 };
+		write(zeros, (size_t) ((8 - (offset & 7)) & 7));
+	}
+
+	template <class T>
+	void writeArray(const vector<T>& v)
+	{
+		write(v.data(), v.size() * sizeof(T));
+		pad();
+	}
+};
+
+//****************************************************************************
+//
+// *
+//============================================================================
+static bool writeTrackBinary(const char* filename, const vector<ControlPoint>& points,
+									  const CompiledTrack* compiled, TrackIOError& error)
+//============================================================================
+{
+	TRACE_SCOPE("writeTrackBinary");
+
+	if (!littleEndian()) {
+		error.set(filename, 0, 0, "binary track files need a little endian machine");
+		return false;
+	}
+
+	// only keep the tables if they're for exactly these points
+	bool tables = compiled && compiled->points.size() == points.size() &&
+		(points.empty() || !memcmp(compiled->points.data(), points.data(),
+											points.size() * sizeof(ControlPoint)));
+
+	FILE* fp = fopen(filename, "wb");
+	if (!fp) {
+		error.set(filename, 0, 0, "can't open the file for writing");
+		return false;
+	}
+
+	BinaryWriter w;
+	w.fp = fp;
+	w.offset = 0;
+	w.ok = true;
+
+	BinaryTrackHeader h;
+	memcpy(h.magic, BINARY_MAGIC, 4);
+	h.version = BINARY_VERSION;
+	h.flags = tables ? BINARY_HAS_TABLES : 0;
+	h.headerSize = sizeof(h);
+	h.nPoints = points.size();
+	h.pointsHash = hashBytes(points.data(), points.size() * sizeof(ControlPoint));
+	w.write(&h, sizeof(h));
+	w.pad();
+
+	// the points go out one coordinate at a time
+	const size_t BATCH = 16 * 1024;
+	float buf[BATCH];
+	for (int k = 0; k < 6; ++k) {
+		for (size_t i = 0; i < points.size(); i += BATCH) {
+			size_t m = std::min(BATCH, points.size() - i);
+			for (size_t j = 0; j < m; ++j) {
+				const Pnt3f& v = (k < 3) ? points[i + j].pos : points[i + j].orient;
+				buf[j] = (k % 3 == 0) ? v.x : (k % 3 == 1) ? v.y : v.z;
+			}
+			w.write(buf, m * sizeof(float));
+		}
+		w.pad();
+	}
+
+	if (tables) {
+		BinaryTablesHeader th;
+		th.splineType = compiled->splineType;
+		th.tension = compiled->tension;
+		th.divide = compiled->divide;
+		th.totalLength = compiled->totalLength;
+		th.key = trackKey(points, compiled->splineType, compiled->tension, compiled->divide);
+		th.nArcPoints = compiled->arcPoints.size();
+		th.nTies = compiled->ties.size();
+		w.write(&th, sizeof(th));
+		w.pad();
+
+		w.writeArray(compiled->samples);
+		w.writeArray(compiled->forward);
+		w.writeArray(compiled->cross);
+		w.writeArray(compiled->segmentLength);
+		w.writeArray(compiled->sumLength);
+		w.writeArray(compiled->arcPoints);
+		w.writeArray(compiled->ties);
+	}
+
+	if (fclose(fp) != 0)
+		w.ok = false;
+	if (!w.ok) {
+		error.set(filename, 0, 0, "couldn't write the whole file");
+		return false;
+	}
+	return true;
+}
+
+//****************************************************************************
+//
+// * format points as lines of text. to_chars gives the shortest text that
+//   reads back as exactly the same float. out needs MAX_LINE_CHARS per
+//   point; returns how much was used
+//============================================================================
+static size_t formatPoints(const ControlPoint* points, size_t count, char* out)
+//============================================================================
+{
+	char* p = out;
+	char* end = out + count * MAX_LINE_CHARS;
+	for (size_t i = 0; i < count; ++i) {
+		const float v[6] = { points[i].pos.x, points[i].pos.y, points[i].pos.z,
+									points[i].orient.x, points[i].orient.y, points[i].orient.z };
+		for (int k = 0; k < 6; ++k) {
+			p = std::to_chars(p, end, v[k]).ptr;
+			*p++ = (k < 5) ? ' ' : '\n';
+		}
+	}
+	return p - out;
+}
+
+//****************************************************************************
+//
+// * the points are formatted a batch at a time, a chunk per pool thread,
+//   and each batch goes to the file in one write per chunk. the buffers
+//   are reused from batch to batch
+//============================================================================
+static bool writeTrackText(const char* filename, const vector<ControlPoint>& points,
+									TrackIOError& error)
+//============================================================================
+{
+	TRACE_SCOPE("writeTrackText");
+
+	FILE* fp = fopen(filename, "wb");
+	if (!fp) {
+		error.set(filename, 0, 0, "can't open the file for writing");
+		return false;
+	}
+	// we do our own buffering
+	setvbuf(fp, 0, _IONBF, 0);
+
+	ThreadPool& pool = ThreadPool::shared();
+	size_t n = points.size();
+	size_t nChunks = std::min<size_t>(pool.size(), n / WRITE_CHUNK_POINTS + 1);
+	size_t chunkBytes = WRITE_CHUNK_POINTS * MAX_LINE_CHARS;
+	vector<char> buffer(nChunks * chunkBytes);
+	vector<size_t> used(nChunks);
+
+	char count[32];
+	char* ce = std::to_chars(count, count + sizeof(count) - 1, n).ptr;
+	*ce++ = '\n';
+	bool ok = fwrite(count, 1, ce - count, fp) == (size_t) (ce - count);
+
+	for (size_t first = 0; ok && first < n; first += nChunks * WRITE_CHUNK_POINTS) {
+		size_t batch = std::min(nChunks, (n - first + WRITE_CHUNK_POINTS - 1) / WRITE_CHUNK_POINTS);
+		pool.parallelFor(batch, 1, [&](size_t begin, size_t end) {
+			for (size_t k = begin; k < end; ++k) {
+				size_t from = first + k * WRITE_CHUNK_POINTS;
+				size_t m = std::min<size_t>(WRITE_CHUNK_POINTS, n - from);
+				used[k] = formatPoints(&points[from], m, &buffer[k * chunkBytes]);
+			}
+		});
+		for (size_t k = 0; ok && k < batch; ++k)
+			ok = fwrite(&buffer[k * chunkBytes], 1, used[k], fp) == used[k];
+	}
+
+	if (fclose(fp) != 0)
+		ok = false;
+	if (!ok) {
+		error.set(filename, 0, 0, "couldn't write the whole file");
+		return false;
+	}
+	return true;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool replaceFile(const char* from, const char* to)
+//============================================================================
+{
+#ifdef _WIN32
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return rename(from, to) == 0;
+#endif
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool isBinaryTrackFile(const char* filename)
+//============================================================================
+{
+	size_t n = strlen(filename);
+	size_t e = strlen(TRACK_BINARY_EXTENSION);
+	if (n < e)
+		return false;
+	const char* ext = filename + n - e;
+	for (size_t i = 0; i < e; ++i)
+		if (tolower((unsigned char) ext[i]) != TRACK_BINARY_EXTENSION[i])
+			return false;
+	return true;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool readTrackFile(const char* filename, vector<ControlPoint>& points,
+						 TrackIOError& error, TrackSnapshot* compiled, bool copy)
+//============================================================================
+{
+	TRACE_SCOPE("readTrackFile");
+
+	if (compiled)
+		compiled->reset();
+
+	MappedFile file;
+	if (!(copy ? file.read(filename) : file.open(filename))) {
+		error.set(filename, 0, 0, "can't open the file");
+		return false;
+	}
+	if (isBinaryTrackFile(filename))
+		return parseTrackBinary(file.data(), file.size(), filename, points, compiled, error);
+	return parseTrackText(file.data(), file.size(), filename, points, error);
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool writeTrackFile(const char* filename, const vector<ControlPoint>& points,
+						  const CompiledTrack* compiled, TrackIOError& error, bool atomic)
+//============================================================================
+{
+	char temp[1024];
+	const char* target = filename;
+	if (atomic) {
+		// a name cut short would be written, and then moved, somewhere else
+		int n = snprintf(temp, sizeof(temp), "%s.tmp", filename);
+		if (n < 0 || n >= (int) sizeof(temp)) {
+			error.set(filename, 0, 0, "the file name is too long");
+			return false;
+		}
+		target = temp;
+	}
+
+	bool ok = isBinaryTrackFile(filename) ?
+		writeTrackBinary(target, points, compiled, error) :
+		writeTrackText(target, points, error);
+
+	if (atomic) {
+		if (ok && !replaceFile(temp, filename)) {
+			error.set(filename, 0, 0, "couldn't replace the file with the new one");
+			ok = false;
+		}
+		if (!ok)
+			remove(temp);
+	}
+	return ok;
+}
@@ -0,0 +1,345 @@
+/************************************************************************
+     File:        TrackIndex.cpp
+
+     Comment:     Finding places on the compiled track. See TrackIndex.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "TrackIndex.H"
+#include "Utilities/ThreadPool.H"
+#include "Utilities/Trace.H"
+
+//****************************************************************************
+//
+// *
+//============================================================================
+static inline float dot(const Pnt3f& a, const Pnt3f& b)
+//============================================================================
+{
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+//****************************************************************************
+//
+// * the point of the step a-b nearest p: how far through it, and the
+//   squared distance
+//============================================================================
+static float nearestOnStep(const Pnt3f& a, const Pnt3f& b, const Pnt3f& p, float& u)
+//============================================================================
+{
+	Pnt3f d = b - a;
+	float dd = dot(d, d);
+	u = dd > 0 ? dot(p - a, d) / dd : 0;
+	if (u < 0)
+		u = 0;
+	if (u > 1)
+		u = 1;
+	Pnt3f off = a + d * u - p;
+	return dot(off, off);
+}
+
+//****************************************************************************
+//
+// * where the ray and the step a-b come closest: t along the ray, u
+//   through the step, and the squared distance between them
+//============================================================================
+static float rayToStep(const Pnt3f& origin, const Pnt3f& dir, const Pnt3f& a, const Pnt3f& b,
+							  float tMin, float& t, float& u)
+//============================================================================
+{
+	Pnt3f d = b - a;
+	Pnt3f w = origin - a;
+	float rr = dot(dir, dir), rd = dot(dir, d), dd = dot(d, d);
+	float rw = dot(dir, w), dw = dot(d, w);
+	float det = rr * dd - rd * rd;
+
+	// the closest points of the two lines, then pulled back onto the step
+	// (and the part of the ray we look at)
+	u = det > 1e-12f * rr * dd ? (rr * dw - rd * rw) / det : 0;
+	if (u < 0)
+		u = 0;
+	if (u > 1)
+		u = 1;
+	t = (dot(a + d * u - origin, dir)) / rr;
+	if (t < tMin) {
+		t = tMin;
+		nearestOnStep(a, b, origin + dir * t, u);
+	}
+	Pnt3f off = origin + dir * t - (a + d * u);
+	return dot(off, off);
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+TrackIndex::
+TrackIndex()
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const TrackSnapshot& TrackIndex::
+track() const
+//============================================================================
+{
+	return snapshot;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+Bounds TrackIndex::
+pieceBounds(size_t piece) const
+//============================================================================
+{
+	const CompiledTrack& ct = *snapshot;
+	size_t first = piece * TRACK_INDEX_PIECE_STEPS;
+	size_t last = std::min(first + TRACK_INDEX_PIECE_STEPS, ct.numSteps());
+	Bounds b;
+	for (size_t s = first; s < last; ++s) {
+		b.add(ct.stepStart(s));
+		b.add(ct.stepEnd(s));
+	}
+	return b;
+}
+
+//****************************************************************************
+//
+// * a segment's samples are all in one block, so finding the segments an
+//   edit moved is a memcmp each
+//============================================================================
+void TrackIndex::
+update(const TrackSnapshot& track)
+//============================================================================
+{
+	if (track == snapshot)
+		return;
+
+	TRACE_SCOPE("TrackIndex::update");
+
+	TrackSnapshot old = snapshot;
+	snapshot = track;
+	if (!track || !track->numSteps()) {
+		tree.clear();
+		return;
+	}
+
+	size_t nPieces = (track->numSteps() + TRACK_INDEX_PIECE_STEPS - 1) / TRACK_INDEX_PIECE_STEPS;
+	if (!old || old->numSteps() != track->numSteps() || old->divide != track->divide ||
+		 tree.size() != nPieces) {
+		vector<Bounds> boxes(nPieces);
+		ThreadPool::shared().parallelFor(nPieces, 1024, [&](size_t begin, size_t end) {
+			for (size_t p = begin; p < end; ++p)
+				boxes[p] = pieceBounds(p);
+		});
+		tree.build(boxes);
+		return;
+	}
+
+	size_t perSegment = track->divide + 1;
+	size_t lastPiece = (size_t) -1;
+	bool moved = false;
+	for (size_t seg = 0; seg < track->numSegments(); ++seg) {
+		if (!memcmp(&old->samples[seg * perSegment], &track->samples[seg * perSegment],
+						perSegment * sizeof(Pnt3f)))
+			continue;
+		size_t first = seg * track->divide / TRACK_INDEX_PIECE_STEPS;
+		size_t last = ((seg + 1) * track->divide - 1) / TRACK_INDEX_PIECE_STEPS;
+		for (size_t p = std::max(first, lastPiece + 1); p <= last; ++p)
+			tree.setBox(p, pieceBounds(p));
+		lastPiece = last;
+		moved = true;
+	}
+	if (moved)
+		tree.refit();
+}
+
+//****************************************************************************
+//
+// * the distance along the track is the length of the segments before
+//   this one, plus the steps of this one before this step
+//============================================================================
+void TrackIndex::
+fill(size_t step, float u, TrackHit& hit) const
+//============================================================================
+{
+	const CompiledTrack& ct = *snapshot;
+	size_t seg = step / ct.divide;
+
+	double along = seg ? ct.sumLength[seg - 1] : 0;
+	for (size_t s = seg * ct.divide; s < step; ++s) {
+		Pnt3f d = ct.stepEnd(s) - ct.stepStart(s);
+		along += sqrt(dot(d, d));
+	}
+	Pnt3f d = ct.stepEnd(step) - ct.stepStart(step);
+	along += u * sqrt(dot(d, d));
+
+	hit.step = step;
+	hit.u = u;
+	hit.along = (float) along;
+	hit.pos = ct.stepStart(step) + d * u;
+	hit.forward = ct.forward[step];
+	hit.right = ct.cross[step];
+	hit.right.normalize();
+	hit.up = hit.right * hit.forward;
+	hit.up.normalize();
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool TrackIndex::
+nearest(const Pnt3f& p, TrackHit& hit, float maxDistance) const
+//============================================================================
+{
+	if (!snapshot)
+		return false;
+	const CompiledTrack& ct = *snapshot;
+
+	float bestSq = maxDistance < FLT_MAX ? maxDistance * maxDistance : FLT_MAX;
+	size_t bestStep = 0;
+	float bestU = 0;
+	long piece = tree.nearest(p, bestSq, [&](size_t piece, float limit) {
+		size_t first = piece * TRACK_INDEX_PIECE_STEPS;
+		size_t last = std::min(first + TRACK_INDEX_PIECE_STEPS, ct.numSteps());
+		for (size_t s = first; s < last; ++s) {
+			float u;
+			float d = nearestOnStep(ct.stepStart(s), ct.stepEnd(s), p, u);
+			if (d < limit) {
+				limit = d;
+				bestStep = s;
+				bestU = u;
+			}
+		}
+		return limit;
+	});
+	if (piece < 0)
+		return false;
+
+	fill(bestStep, bestU, hit);
+	hit.distance = sqrtf(bestSq);
+	hit.t = 0;
+	return true;
+}
+
+//****************************************************************************
+//
+// * the boxes are padded by the radius, so a ray that passes just outside
+//   a box but within the radius of its track is still looked at
+//============================================================================
+bool TrackIndex::
+raycast(const Pnt3f& origin, const Pnt3f& dir, float radius, TrackHit& hit, float tMin) const
+//============================================================================
+{
+	if (!snapshot)
+		return false;
+	const CompiledTrack& ct = *snapshot;
+
+	float rSq = radius * radius;
+	float tMax = FLT_MAX;
+	size_t bestStep = 0;
+	float bestU = 0, bestSq = 0;
+	long piece = tree.raycast(origin, dir, tMin, tMax, [&](size_t piece, float t0, float limit) {
+		size_t first = piece * TRACK_INDEX_PIECE_STEPS;
+		size_t last = std::min(first + TRACK_INDEX_PIECE_STEPS, ct.numSteps());
+		for (size_t s = first; s < last; ++s) {
+			float t, u;
+			float d = rayToStep(origin, dir, ct.stepStart(s), ct.stepEnd(s), t0, t, u);
+			if (d <= rSq && t < limit) {
+				limit = t;
+				bestStep = s;
+				bestU = u;
+				bestSq = d;
+			}
+		}
+		return limit;
+	}, radius);
+	if (piece < 0)
+		return false;
+
+	fill(bestStep, bestU, hit);
+	hit.distance = sqrtf(bestSq);
+	hit.t = tMax;
+	return true;
+}
+
+//****************************************************************************
+//
+// * the steps that are close enough, in order, are cut into runs of
+//   steps next to each other (the last run carries on into the first if
+//   the track is closed through them); each run gives its nearest step
+//============================================================================
+void TrackIndex::
+within(const Pnt3f& p, float radius, vector<TrackHit>& hits) const
+//============================================================================
+{
+	hits.clear();
+	if (!snapshot)
+		return;
+	const CompiledTrack& ct = *snapshot;
+
+	struct Close {
+		size_t	step;
+		float		u;
+		float		dSq;
+		bool operator<(const Close& c) const { return step < c.step; }
+	};
+	vector<Close> close;
+
+	float rSq = radius * radius;
+	Bounds around(p, p);
+	around.grow(radius);
+	tree.overlap(around, [&](size_t piece) {
+		size_t first = piece * TRACK_INDEX_PIECE_STEPS;
+		size_t last = std::min(first + TRACK_INDEX_PIECE_STEPS, ct.numSteps());
+		for (size_t s = first; s < last; ++s) {
+			Close c;
+			c.step = s;
+			c.dSq = nearestOnStep(ct.stepStart(s), ct.stepEnd(s), p, c.u);
+			if (c.dSq <= rSq)
+				close.push_back(c);
+		}
+	});
+	if (close.empty())
+		return;
+	std::sort(close.begin(), close.end());
+
+	// the best of each run
+	vector<Close> runs;
+	for (size_t i = 0; i < close.size(); ++i) {
+		if (i && close[i].step == close[i - 1].step + 1) {
+			if (close[i].dSq < runs.back().dSq)
+				runs.back() = close[i];
+		} else
+			runs.push_back(close[i]);
+	}
+	if (runs.size() > 1 && close.front().step == 0 && close.back().step == ct.numSteps() - 1) {
+		if (runs.back().dSq < runs.front().dSq)
+			runs.front() = runs.back();
+		runs.pop_back();
+	}
+
+	hits.resize(runs.size());
+	for (size_t i = 0; i < runs.size(); ++i) {
+		fill(runs[i].step, runs[i].u, hits[i]);
+		hits[i].distance = sqrtf(runs[i].dSq);
+		hits[i].t = 0;
+	}
+	std::sort(hits.begin(), hits.end(), [](const TrackHit& a, const TrackHit& b) {
+		return a.along < b.along;
+	});
+}
@@ -0,0 +1,189 @@
+/************************************************************************
+     File:        TrackLoader.cpp
+
+     Comment:     Loads a text track file a piece at a time on a worker
+						thread. See TrackLoader.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#pragma warning(push)
+#pragma warning(disable:4312)
+#pragma warning(disable:4311)
+#include <Fl/Fl.h>
+#pragma warning(pop)
+
+#include "TrackLoader.H"
+#include "Utilities/MappedFile.H"
+#include "Utilities/Trace.H"
+
+//****************************************************************************
+//
+// * binary files are read with a copy, so they're quick whatever the size
+//============================================================================
+bool shouldStreamTrack(const char* filename)
+//============================================================================
+{
+	if (isBinaryTrackFile(filename))
+		return false;
+	MappedFile file;
+	return file.open(filename) && file.size() > STREAM_LOAD_BYTES;
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+TrackLoader::
+TrackLoader(ProgressCallback _progress, void* _progressData)
+	: progressCB(_progress), progressData(_progressData),
+	  cancelled(false), working(false), fraction(0),
+	  finished(true), ok(true)
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// * Destructor
+//============================================================================
+TrackLoader::
+~TrackLoader()
+//============================================================================
+{
+	cancel();
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void TrackLoader::
+start(const char* _filename)
+//============================================================================
+{
+	cancel();
+
+	filename = _filename;
+	cancelled = false;
+	working = true;
+	fraction = 0;
+	fresh.clear();
+	finished = false;
+	ok = true;
+	error = TrackIOError();
+	worker = std::thread(&TrackLoader::run, this);
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void TrackLoader::
+cancel()
+//============================================================================
+{
+	if (worker.joinable()) {
+		cancelled = true;
+		worker.join();
+	}
+	working = false;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool TrackLoader::
+busy() const
+//============================================================================
+{
+	return working;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+float TrackLoader::
+progress() const
+//============================================================================
+{
+	return fraction;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const std::string& TrackLoader::
+file() const
+//============================================================================
+{
+	return filename;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void TrackLoader::
+takePoints(vector<ControlPoint>& points, bool& _finished, bool& _ok, TrackIOError& _error)
+//============================================================================
+{
+	std::lock_guard<std::mutex> guard(lock);
+	points.insert(points.end(), fresh.begin(), fresh.end());
+	fresh.clear();
+	_finished = finished;
+	_ok = ok;
+	if (!ok)
+		_error = error;
+}
+
+//****************************************************************************
+//
+// * the worker: read a piece, hand it over, say so, repeat
+//============================================================================
+void TrackLoader::
+run()
+//============================================================================
+{
+	Trace::setThreadName("TrackLoader");
+	TRACE_SCOPE("TrackLoader");
+
+	MappedFile file;
+	TrackTextReader reader;
+	TrackIOError problem;
+	bool good = true;
+
+	if (!file.open(filename.c_str())) {
+		problem.set(filename.c_str(), 0, 0, "can't open the file");
+		good = false;
+	} else
+		good = reader.begin(file.data(), file.size(), filename.c_str(), problem);
+
+	vector<ControlPoint> piece;
+	while (good && !reader.done() && !cancelled) {
+		piece.clear();
+		good = reader.next(STREAM_PIECE_BYTES, piece, problem);
+		fraction = reader.progress();
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			fresh.insert(fresh.end(), piece.begin(), piece.end());
+		}
+		if (progressCB && !reader.done())
+			Fl::awake(progressCB, progressData);
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		finished = true;
+		ok = good;
+		if (!good)
+			error = problem;
+	}
+	working = false;
+	if (progressCB && !cancelled)
+		Fl::awake(progressCB, progressData);
+}
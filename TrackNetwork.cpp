@@ -0,0 +1,559 @@
+/************************************************************************
+     File:        TrackNetwork.cpp
+
+     Comment:     Track that branches. See TrackNetwork.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include <math.h>
+#include <algorithm>
+#include <functional>
+#include <queue>
+
+#include "TrackNetwork.H"
+#include "Utilities/Trace.H"
+
+// switches closer together than this along the main line are the same one
+#define JUNCTION_MERGE 0.5f
+
+//****************************************************************************
+//
+// * the step of the main line a distance along it is on
+//============================================================================
+static size_t stepAt(const CompiledTrack& main, float d)
+//============================================================================
+{
+	d = fmodf(d, main.totalLength);
+	if (d < 0)
+		d += main.totalLength;
+	size_t seg = main.segmentAt(d);
+	float u = main.segmentFraction(seg, d) * main.divide;
+	int j = (int) u;
+	j = j < 0 ? 0 : j >= main.divide ? main.divide - 1 : j;
+	return seg * main.divide + j;
+}
+
+//****************************************************************************
+//
+// * the point of the main line a distance along it, and the up and right
+//   vectors there, from the step it's on (the steps of a segment are
+//   taken to be the same length)
+//============================================================================
+static void mainSample(const CompiledTrack& main, float d, Pnt3f& pos, Pnt3f& up,
+							  Pnt3f& right)
+//============================================================================
+{
+	float length = main.totalLength;
+	d = fmodf(d, length);
+	if (d < 0)
+		d += length;
+
+	size_t seg = main.segmentAt(d);
+	float u = main.segmentFraction(seg, d) * main.divide;
+	u = u < 0 ? 0 : u > main.divide ? (float) main.divide : u;
+	size_t j = (size_t) u;
+	if (j >= (size_t) main.divide)
+		j = main.divide - 1;
+	size_t step = seg * main.divide + j;
+	const Pnt3f& a = main.stepStart(step);
+	pos = a + (main.stepEnd(step) - a) * (u - j);
+
+	right = main.cross[step];
+	right.normalize();
+	up = right * main.forward[step];
+	up.normalize();
+}
+
+//****************************************************************************
+//
+// * three points between the switches, a quarter of the way apart, moved
+//   over to the side. the curve through them takes the first and last
+//   quarters to move over and back
+//============================================================================
+void parallelSiding(const CompiledTrack& main, float leave, float rejoin, float offset,
+						  Siding& siding)
+//============================================================================
+{
+	siding.leave = leave;
+	siding.rejoin = rejoin;
+	siding.via.clear();
+	if (main.arcPoints.size() < 2 || main.totalLength <= 0)
+		return;
+
+	float span = rejoin - leave;
+	if (span <= 0)
+		span += main.totalLength;
+	for (int k = 1; k <= 3; ++k) {
+		Pnt3f pos, up, right;
+		mainSample(main, leave + span * k / 4, pos, up, right);
+		siding.via.push_back(pos + right * offset);
+	}
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+TrackNetwork::
+TrackNetwork()
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const TrackSnapshot& TrackNetwork::
+mainLine() const
+//============================================================================
+{
+	return main;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t TrackNetwork::
+numJunctions() const
+//============================================================================
+{
+	return junctions.size();
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t TrackNetwork::
+numEdges() const
+//============================================================================
+{
+	return edges.size();
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const NetworkJunction& TrackNetwork::
+junction(size_t i) const
+//============================================================================
+{
+	return junctions[i];
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const NetworkEdge& TrackNetwork::
+edge(size_t i) const
+//============================================================================
+{
+	return edges[i];
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+int TrackNetwork::
+mainEdgeFrom(size_t junction) const
+//============================================================================
+{
+	return junction < junctions.size() && !junctions[junction].out.empty() ?
+		junctions[junction].out[0] : -1;
+}
+
+//****************************************************************************
+//
+// * a point every unit from one distance along the main line to the
+//   other (which is past the end of the track if it wraps round), and
+//   one right at the end
+//============================================================================
+void TrackNetwork::
+addMainEdge(float from, float to, int fromJunction, int toJunction)
+//============================================================================
+{
+	NetworkEdge e;
+	e.from = fromJunction;
+	e.to = toJunction;
+	e.main = true;
+	e.length = to - from;
+
+	size_t n = (size_t) ceilf(e.length) + 1;
+	e.pos.resize(n);
+	e.up.resize(n);
+	e.along.resize(n);
+	for (size_t i = 0; i < n; ++i) {
+		float d = i + 1 < n ? (float) i : e.length;
+		Pnt3f right;
+		mainSample(*main, from + d, e.pos[i], e.up[i], right);
+		e.along[i] = d;
+	}
+
+	junctions[fromJunction].out.push_back((int) edges.size());
+	edges.push_back(e);
+}
+
+//****************************************************************************
+//
+// * a cardinal curve from the switch, through the points of the siding,
+//   to the other switch (or the last point, for a bay). the points before
+//   the first and after the last are on the main line, so the siding
+//   leaves it and joins it going the same way. the up vector goes from
+//   the main line's at one end to the other's
+//============================================================================
+void TrackNetwork::
+addSidingEdge(const Siding& siding, int fromJunction, int toJunction)
+//============================================================================
+{
+	const CompiledTrack& m = *main;
+	vector<Pnt3f> p;
+	Pnt3f start, startUp, end, endUp, up, right;
+
+	// the curve leaves p[1] going p[2] - p[0], so that's put the way the
+	// main line goes there
+	mainSample(m, siding.leave, start, startUp, right);
+	Pnt3f first = siding.via.empty() ? (toJunction >= 0 ? junctions[toJunction].pos : start) : siding.via[0];
+	Pnt3f d = first - start;
+	Pnt3f way = m.forward[stepAt(m, siding.leave)];
+	p.push_back(first - way * (2 * sqrtf(d.x * d.x + d.y * d.y + d.z * d.z)));
+	p.push_back(start);
+	p.insert(p.end(), siding.via.begin(), siding.via.end());
+
+	if (toJunction >= 0) {
+		mainSample(m, siding.rejoin, end, endUp, right);
+		Pnt3f last = p.back();
+		d = end - last;
+		way = m.forward[stepAt(m, siding.rejoin)];
+		p.push_back(end);
+		p.push_back(last + way * (2 * sqrtf(d.x * d.x + d.y * d.y + d.z * d.z)));
+	} else {
+		endUp = startUp;
+		p.push_back(p.back() + (p.back() - p[p.size() - 2]));
+	}
+
+	NetworkEdge e;
+	e.from = fromJunction;
+	e.to = toJunction;
+	e.main = false;
+	e.length = 0;
+	e.pos.push_back(p[1]);
+	e.along.push_back(0);
+	for (size_t k = 1; k + 2 < p.size(); ++k) {
+		Pnt3f chord = p[k + 1] - p[k];
+		int divide = (int) ceilf(sqrtf(chord.x * chord.x + chord.y * chord.y + chord.z * chord.z));
+		if (divide < 1)
+			divide = 1;
+		for (int j = 1; j <= divide; ++j) {
+			Pnt3f q = splinePoint(p[k - 1], p[k], p[k + 1], p[k + 2], (float) j / divide,
+										 SPLINE_CARDINAL, 0.5f);
+			Pnt3f step = q - e.pos.back();
+			e.length += sqrtf(step.x * step.x + step.y * step.y + step.z * step.z);
+			e.pos.push_back(q);
+			e.along.push_back(e.length);
+		}
+	}
+
+	e.up.resize(e.pos.size());
+	for (size_t i = 0; i < e.pos.size(); ++i) {
+		float f = e.length > 0 ? e.along[i] / e.length : 0;
+		e.up[i] = startUp * (1 - f) + endUp * f;
+		e.up[i].normalize();
+	}
+
+	junctions[fromJunction].out.push_back((int) edges.size());
+	edges.push_back(e);
+}
+
+//****************************************************************************
+//
+// * the switches are the places the sidings leave and rejoin, in order
+//   along the main line. the main line is cut at each of them - with
+//   no sidings it's one edge, from a junction at the start all the way
+//   round to it again. the main edges come first, so the first edge out
+//   of each junction is the main line
+//============================================================================
+bool TrackNetwork::
+build(const TrackSnapshot& mainTrack, const vector<Siding>& sidings)
+//============================================================================
+{
+	TRACE_SCOPE("TrackNetwork::build");
+
+	main = mainTrack;
+	junctions.clear();
+	edges.clear();
+	next.clear();
+	if (!main || main->arcPoints.size() < 2 || main->totalLength <= 0)
+		return false;
+
+	float length = main->totalLength;
+	vector<float> at;
+	for (size_t i = 0; i < sidings.size(); ++i) {
+		const Siding& s = sidings[i];
+		if (s.leave < 0 || s.leave > length || s.rejoin > length)
+			return false;
+		at.push_back(fmodf(s.leave, length));
+		if (s.rejoin >= 0)
+			at.push_back(fmodf(s.rejoin, length));
+	}
+	if (at.empty())
+		at.push_back(0);
+	std::sort(at.begin(), at.end());
+
+	for (size_t i = 0; i < at.size(); ++i) {
+		if (!junctions.empty() && at[i] - junctions.back().along < JUNCTION_MERGE)
+			continue;
+		NetworkJunction j;
+		j.along = at[i];
+		Pnt3f up, right;
+		mainSample(*main, j.along, j.pos, up, right);
+		junctions.push_back(j);
+	}
+	if (junctions.size() > 1 && junctions[0].along + length - junctions.back().along < JUNCTION_MERGE)
+		junctions.pop_back();
+
+	// which junction a distance along the main line is at
+	auto junctionAt = [&](float d) {
+		d = fmodf(d, length);
+		size_t best = 0;
+		float bestGap = length;
+		for (size_t i = 0; i < junctions.size(); ++i) {
+			float gap = fabsf(junctions[i].along - d);
+			gap = gap < length - gap ? gap : length - gap;
+			if (gap < bestGap) {
+				bestGap = gap;
+				best = i;
+			}
+		}
+		return (int) best;
+	};
+
+	size_t nj = junctions.size();
+	for (size_t i = 0; i < nj; ++i) {
+		float from = junctions[i].along;
+		float to = i + 1 < nj ? junctions[i + 1].along : junctions[0].along + length;
+		addMainEdge(from, to, (int) i, (int) ((i + 1) % nj));
+	}
+	for (size_t i = 0; i < sidings.size(); ++i)
+		addSidingEdge(sidings[i], junctionAt(sidings[i].leave),
+						  sidings[i].rejoin >= 0 ? junctionAt(sidings[i].rejoin) : -1);
+
+	buildRoutingTable();
+	return true;
+}
+
+//****************************************************************************
+//
+// * from each edge, the shortest way (by length) to every other: a
+//   Dijkstra from the edges that follow it, each carrying which of those
+//   it came from. going from an edge back to itself is the shortest loop
+//   round
+//============================================================================
+void TrackNetwork::
+buildRoutingTable()
+//============================================================================
+{
+	TRACE_SCOPE("TrackNetwork::buildRoutingTable");
+
+	size_t n = edges.size();
+	next.assign(n * n, -1);
+
+	typedef std::pair<float, int> Entry;
+	vector<float> dist(n);
+	vector<int> hop(n);
+	for (size_t from = 0; from < n; ++from) {
+		std::fill(dist.begin(), dist.end(), 1e30f);
+		std::fill(hop.begin(), hop.end(), -1);
+		std::priority_queue<Entry, vector<Entry>, std::greater<Entry> > queue;
+
+		int j = edges[from].to;
+		if (j >= 0) {
+			for (size_t k = 0; k < junctions[j].out.size(); ++k) {
+				int e = junctions[j].out[k];
+				if (edges[e].length < dist[e]) {
+					dist[e] = edges[e].length;
+					hop[e] = e;
+					queue.push(Entry(dist[e], e));
+				}
+			}
+		}
+		while (!queue.empty()) {
+			Entry top = queue.top();
+			queue.pop();
+			int u = top.second;
+			if (top.first > dist[u])
+				continue;
+			int uj = edges[u].to;
+			if (uj < 0)
+				continue;
+			for (size_t k = 0; k < junctions[uj].out.size(); ++k) {
+				int v = junctions[uj].out[k];
+				float d = dist[u] + edges[v].length;
+				if (d < dist[v]) {
+					dist[v] = d;
+					hop[v] = hop[u];
+					queue.push(Entry(d, v));
+				}
+			}
+		}
+		for (size_t to = 0; to < n; ++to)
+			next[from * n + to] = hop[to];
+	}
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void TrackNetwork::
+finishRoute(NetworkRoute& route) const
+//============================================================================
+{
+	route.start.resize(route.edges.size());
+	route.length = 0;
+	for (size_t i = 0; i < route.edges.size(); ++i) {
+		route.start[i] = route.length;
+		route.length += edges[route.edges[i]].length;
+	}
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void TrackNetwork::
+followSwitches(int startEdge, const vector<int>& switches, NetworkRoute& route) const
+//============================================================================
+{
+	route.edges.clear();
+	route.closed = false;
+	if (startEdge < 0 || startEdge >= (int) edges.size()) {
+		finishRoute(route);
+		return;
+	}
+
+	vector<bool> seen(edges.size(), false);
+	int e = startEdge;
+	for (;;) {
+		route.edges.push_back(e);
+		seen[e] = true;
+
+		int j = edges[e].to;
+		if (j < 0 || junctions[j].out.empty())
+			break;
+		int choice = j < (int) switches.size() ? switches[j] : 0;
+		if (choice < 0 || choice >= (int) junctions[j].out.size())
+			choice = 0;
+		int n = junctions[j].out[choice];
+		if (n == startEdge) {
+			route.closed = true;
+			break;
+		}
+		// round a loop that doesn't go back through the start
+		if (seen[n])
+			break;
+		e = n;
+	}
+	finishRoute(route);
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool TrackNetwork::
+routeTo(int fromEdge, int toEdge, NetworkRoute& route) const
+//============================================================================
+{
+	int n = (int) edges.size();
+	route.edges.clear();
+	route.closed = false;
+	if (fromEdge < 0 || fromEdge >= n || toEdge < 0 || toEdge >= n) {
+		finishRoute(route);
+		return false;
+	}
+
+	route.edges.push_back(fromEdge);
+	for (int e = fromEdge; e != toEdge; ) {
+		e = next[e * n + toEdge];
+		if (e < 0 || (int) route.edges.size() > n) {
+			route.edges.clear();
+			finishRoute(route);
+			return false;
+		}
+		route.edges.push_back(e);
+	}
+	int last = route.edges.back();
+	route.closed = edges[last].to >= 0 && edges[last].to == edges[fromEdge].from;
+	finishRoute(route);
+	return true;
+}
+
+//****************************************************************************
+//
+// * which edge, then which points of it, by binary search
+//============================================================================
+void TrackNetwork::
+locate(const NetworkRoute& route, float along, Pnt3f& pos, Pnt3f& forward, Pnt3f& up) const
+//============================================================================
+{
+	if (route.edges.empty() || route.length <= 0)
+		return;
+	if (route.closed) {
+		along = fmodf(along, route.length);
+		if (along < 0)
+			along += route.length;
+	} else
+		along = along < 0 ? 0 : along > route.length ? route.length : along;
+
+	size_t k = std::upper_bound(route.start.begin(), route.start.end(), along) - route.start.begin();
+	k = k ? k - 1 : 0;
+	const NetworkEdge& e = edges[route.edges[k]];
+	float local = along - route.start[k];
+
+	size_t n = e.along.size();
+	size_t i = std::upper_bound(e.along.begin(), e.along.end(), local) - e.along.begin();
+	i = i ? i - 1 : 0;
+	if (i + 1 >= n)
+		i = n >= 2 ? n - 2 : 0;
+	size_t i1 = n >= 2 ? i + 1 : i;
+	float gap = e.along[i1] - e.along[i];
+	float f = gap > 0 ? (local - e.along[i]) / gap : 0;
+
+	pos = e.pos[i] + (e.pos[i1] - e.pos[i]) * f;
+	forward = e.pos[i1] - e.pos[i];
+	forward.normalize();
+	up = e.up[i] + (e.up[i1] - e.up[i]) * f;
+	up.normalize();
+}
+
+//****************************************************************************
+//
+// * the points of the route as the control points of a linear track. an
+//   edge ends where the next one starts, so its last point is left out
+//============================================================================
+TrackSnapshot TrackNetwork::
+compileRoute(const NetworkRoute& route) const
+//============================================================================
+{
+	TRACE_SCOPE("TrackNetwork::compileRoute");
+
+	if (!route.closed || route.edges.empty())
+		return TrackSnapshot();
+
+	vector<ControlPoint> points;
+	for (size_t k = 0; k < route.edges.size(); ++k) {
+		const NetworkEdge& e = edges[route.edges[k]];
+		for (size_t i = 0; i + 1 < e.pos.size(); ++i)
+			points.push_back(ControlPoint(e.pos[i], e.up[i]));
+	}
+	if (points.size() < 2)
+		return TrackSnapshot();
+	return compileTrack(points, SPLINE_LINEAR, 0.5f, 1);
+}
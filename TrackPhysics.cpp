@@ -0,0 +1,216 @@
+/************************************************************************
+     File:        TrackPhysics.cpp
+
+     Comment:     Running trains on the track under gravity. See
+						TrackPhysics.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include <math.h>
+
+#include "TrackPhysics.H"
+#include "Utilities/ThreadPool.H"
+#include "Utilities/Trace.H"
+
+// how many trains a task of advance moves
+#define PHYSICS_GRAIN 1024
+
+//****************************************************************************
+//
+// *
+//============================================================================
+static inline float dot(const Pnt3f& a, const Pnt3f& b)
+//============================================================================
+{
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+PhysicsOptions::
+PhysicsOptions()
+	: gravity(9.8f), friction(0.02f), drag(0.0005f), minSpeed(2),
+	  lift(false), liftStart(0), liftEnd(0.25f), liftSpeed(8)
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+TrackPhysics::
+TrackPhysics()
+	: length(0)
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const TrackSnapshot& TrackPhysics::
+track() const
+//============================================================================
+{
+	return snapshot;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool TrackPhysics::
+ready() const
+//============================================================================
+{
+	return !samples.empty() && length > 0;
+}
+
+//****************************************************************************
+//
+// * the samples are the arcPoints, a unit of length apart, so the
+//   direction at one is from the one before to the one after, and the
+//   curvature is how fast that turns. the track is closed, so the ends
+//   wrap round
+//============================================================================
+void TrackPhysics::
+update(const TrackSnapshot& track)
+//============================================================================
+{
+	if (track == snapshot)
+		return;
+
+	TRACE_SCOPE("TrackPhysics::update");
+
+	snapshot = track;
+	samples.clear();
+	length = 0;
+	if (!track || track->arcPoints.size() < 3 || track->totalLength <= 0)
+		return;
+
+	const vector<Pnt3f>& at = track->arcPoints;
+	size_t n = at.size();
+	length = track->totalLength;
+
+	vector<Pnt3f> along(n);
+	ThreadPool::shared().parallelFor(n, 4096, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			along[i] = at[(i + 1) % n] - at[(i + n - 1) % n];
+			along[i].normalize();
+		}
+	});
+
+	samples.resize(n);
+	ThreadPool::shared().parallelFor(n, 4096, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			Pnt3f curve = (along[(i + 1) % n] - along[(i + n - 1) % n]) * 0.5f;
+			const Pnt3f& t = along[i];
+			// straight down, less the part of it that is along the track
+			Pnt3f down = Pnt3f(0, -1, 0) + t * t.y;
+
+			PhysicsSample& s = samples[i];
+			s.height = at[i].y;
+			s.curveSq = dot(curve, curve);
+			s.curveDown = dot(curve, down);
+			s.downSq = dot(down, down);
+		}
+	});
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const PhysicsSample& TrackPhysics::
+sampleAt(float along) const
+//============================================================================
+{
+	size_t i = (size_t) (along + 0.5f);
+	return samples[i < samples.size() ? i : 0];
+}
+
+//****************************************************************************
+//
+// * in between samples, the height goes in a straight line. the last
+//   sample is less than a unit from the end, and after it the track goes
+//   back to the first
+//============================================================================
+float TrackPhysics::
+heightAt(float along) const
+//============================================================================
+{
+	size_t n = samples.size();
+	size_t i = (size_t) along;
+	if (i >= n - 1) {
+		float gap = length - (n - 1);
+		float f = gap > 0 ? (along - (n - 1)) / gap : 0;
+		if (f < 0)
+			f = 0;
+		if (f > 1)
+			f = 1;
+		return samples[n - 1].height + (samples[0].height - samples[n - 1].height) * f;
+	}
+	float f = along - i;
+	return samples[i].height + (samples[i + 1].height - samples[i].height) * f;
+}
+
+//****************************************************************************
+//
+// * each step: the energy the train has (per unit of mass), less what
+//   friction and drag take over the distance it goes this step, less the
+//   potential energy where it ends up, is its kinetic energy there
+//============================================================================
+void TrackPhysics::
+advance(float* along, float* speed, size_t count, int steps,
+		  const PhysicsOptions& options) const
+//============================================================================
+{
+	if (!ready() || steps <= 0)
+		return;
+
+	float g = options.gravity;
+	float liftStart = options.liftStart * length;
+	float liftEnd = options.liftEnd * length;
+	bool lift = options.lift && liftEnd > liftStart;
+
+	ThreadPool::shared().parallelFor(count, PHYSICS_GRAIN, [&](size_t begin, size_t end) {
+		for (size_t t = begin; t < end; ++t) {
+			float s = along[t];
+			float v = speed[t];
+			if (s < 0 || s >= length)
+				s = fmodf(fmodf(s, length) + length, length);
+			float h = heightAt(s);
+
+			for (int k = 0; k < steps; ++k) {
+				const PhysicsSample& p = sampleAt(s);
+				float vv = v * v;
+				float pushSq = vv * vv * p.curveSq - 2 * vv * g * p.curveDown + g * g * p.downSq;
+				float push = pushSq > 0 ? sqrtf(pushSq) : 0;
+
+				float ds = v * PHYSICS_STEP;
+				float energy = 0.5f * vv + g * h - (options.friction * push + options.drag * vv) * ds;
+
+				s += ds;
+				if (s >= length)
+					s -= length;
+				h = heightAt(s);
+				float kinetic = energy - g * h;
+				v = kinetic > 0 ? sqrtf(2 * kinetic) : 0;
+
+				if (lift && s >= liftStart && s < liftEnd && v < options.liftSpeed)
+					v = options.liftSpeed;
+				if (v < options.minSpeed)
+					v = options.minSpeed;
+			}
+
+			along[t] = s;
+			speed[t] = v;
+		}
+	});
+}
@@ -0,0 +1,271 @@
+/************************************************************************
+     File:        TrackSweep.cpp
+
+     Comment:     Trying a track with every combination of a range of
+						settings. See TrackSweep.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <memory>
+
+#include "TrackSweep.H"
+#include "TrackAnalysis.H"
+#include "Utilities/ThreadPool.H"
+#include "Utilities/Trace.H"
+
+// how far the sweep looks for the track coming close to itself
+#define SWEEP_CLEARANCE_REACH 10.0f
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+SweepRange::
+SweepRange(float only)
+	: first(only), last(only), count(1)
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+SweepRange::
+SweepRange(float first_, float last_, int count_)
+	: first(first_), last(last_), count(count_ > 0 ? count_ : 1)
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+float SweepRange::
+value(int i) const
+//============================================================================
+{
+	if (count < 2)
+		return first;
+	return first + (last - first) * i / (count - 1);
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool parseSweepRange(const char* text, SweepRange& range)
+//============================================================================
+{
+	float first, last;
+	int count;
+	char end;
+	if (sscanf(text, "%f:%f:%d%c", &first, &last, &count, &end) == 3 && count > 0) {
+		range = SweepRange(first, last, count);
+		return true;
+	}
+	if (sscanf(text, "%f%c", &first, &end) == 1) {
+		range = SweepRange(first);
+		return true;
+	}
+	return false;
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+SweepOptions::
+SweepOptions()
+	: splineType(SPLINE_CARDINAL), tension(0.5f), speed(30), cars(0), divide(1000),
+	  physics(false), carSpacing(10)
+//============================================================================
+{
+	clearance.clearance = SWEEP_CLEARANCE_REACH;
+	physicsOptions.lift = true;
+}
+
+//****************************************************************************
+//
+// * how long a lap takes at these speeds, a unit of length apart (the
+//   last one up to the end of the track)
+//============================================================================
+static float lapTime(const vector<float>& profile, float length)
+//============================================================================
+{
+	size_t n = profile.size();
+	double time = 0;
+	for (size_t i = 0; i < n; ++i) {
+		float v = (profile[i] + profile[i + 1 < n ? i + 1 : 0]) / 2;
+		float d = i + 1 < n ? 1 : length - (n - 1);
+		if (v <= 0)
+			return 0;
+		time += d / v;
+	}
+	return (float) time;
+}
+
+//****************************************************************************
+//
+// * across the track only: the lift takes a train up to its speed at
+//   once, which would be a jump in the push along it
+//============================================================================
+static float maxForce(const GForceSeries& series)
+//============================================================================
+{
+	float most = 0;
+	for (size_t i = 0; i < series.size(); ++i)
+		if (series.normal[i] > most)
+			most = series.normal[i];
+	return most;
+}
+
+//****************************************************************************
+//
+// * first the tracks, one for each tension and divide: compiled, checked
+//   for clearance and given a physics table. then each track at each
+//   speed: the profile, the lap time, and the cars one after another,
+//   each analysed with the profile moved round by how far back it is
+//============================================================================
+void runSweep(const vector<ControlPoint>& points, const SweepOptions& options,
+				  vector<SweepResult>& results)
+//============================================================================
+{
+	TRACE_SCOPE("runSweep");
+
+	ThreadPool& pool = ThreadPool::shared();
+	int nTension = options.tension.count;
+	int nDivide = options.divide.count;
+	int nSpeed = options.speed.count;
+	int nCars = options.cars.count;
+	size_t nTracks = (size_t) nTension * nDivide;
+
+	results.resize(nTracks * nSpeed * nCars);
+
+	struct Tried {
+		TrackSnapshot								track;
+		std::unique_ptr<TrackPhysics>			physics;
+		float											minClearance;
+	};
+	vector<Tried> tried(nTracks);
+
+	pool.parallelFor(nTracks, 1, [&](size_t begin, size_t end) {
+		TrackClearance clearance;
+		for (size_t t = begin; t < end; ++t) {
+			float tension = options.tension.value((int) (t / nDivide));
+			int divide = (int) (options.divide.value((int) (t % nDivide)) + 0.5f);
+			Tried& tr = tried[t];
+			tr.track = compileTrack(points, options.splineType, tension, divide > 0 ? divide : 1);
+
+			clearance.update(tr.track, options.clearance);
+			tr.minClearance = options.clearance.clearance;
+			const vector<ClearanceConflict>& conflicts = clearance.conflicts();
+			for (size_t i = 0; i < conflicts.size(); ++i)
+				if (conflicts[i].separation < tr.minClearance)
+					tr.minClearance = conflicts[i].separation;
+
+			if (options.physics) {
+				tr.physics.reset(new TrackPhysics);
+				tr.physics->update(tr.track);
+			}
+		}
+	});
+
+	// the most cars there are behind an engine
+	int mostCars = 0;
+	for (int c = 0; c < nCars; ++c) {
+		int cars = (int) (options.cars.value(c) + 0.5f);
+		if (cars > mostCars)
+			mostCars = cars;
+	}
+
+	pool.parallelFor(nTracks * nSpeed, 1, [&](size_t begin, size_t end) {
+		vector<float> profile, moved, carMax;
+		GForceSeries series;
+		for (size_t ts = begin; ts < end; ++ts) {
+			size_t t = ts / nSpeed;
+			int s = (int) (ts % nSpeed);
+			const Tried& tr = tried[t];
+			float speed = options.speed.value(s);
+			float length = tr.track ? tr.track->totalLength : 0;
+
+			if (options.physics) {
+				PhysicsOptions physics = options.physicsOptions;
+				physics.liftSpeed = speed;
+				physicsSpeedProfile(*tr.physics, physics, profile);
+			} else if (tr.track)
+				steadySpeedProfile(*tr.track, speed, profile);
+			else
+				profile.clear();
+			float lap = profile.empty() ? 0 : lapTime(profile, length);
+
+			// carMax[k]: the most that any of the first k+1 cars (counting
+			// the engine) feels
+			carMax.assign(mostCars + 1, 0.0f);
+			if (lap > 0) {
+				size_t n = profile.size();
+				for (int k = 0; k <= mostCars; ++k) {
+					if (k && !options.physics) {
+						carMax[k] = carMax[0];
+						continue;
+					}
+					size_t back = (size_t) (k * options.carSpacing + 0.5f) % n;
+					moved.resize(n);
+					for (size_t i = 0; i < n; ++i)
+						moved[i] = profile[(i + back) % n];
+					analyseTrack(*tr.track, moved, options.physicsOptions.gravity, series);
+					float most = maxForce(series);
+					carMax[k] = k && carMax[k - 1] > most ? carMax[k - 1] : most;
+				}
+			}
+
+			for (int c = 0; c < nCars; ++c) {
+				SweepResult& r = results[ts * nCars + c];
+				r.tension = tr.track ? tr.track->tension : options.tension.value((int) (t / nDivide));
+				r.divide = tr.track ? tr.track->divide : 0;
+				r.speed = speed;
+				r.cars = (int) (options.cars.value(c) + 0.5f);
+				if (r.cars < 0)
+					r.cars = 0;
+				r.length = length;
+				r.lapTime = lap;
+				r.maxG = carMax[r.cars];
+				r.minClearance = tr.minClearance;
+			}
+		}
+	});
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool writeSweep(const char* filename, const vector<SweepResult>& results, TrackIOError& error)
+//============================================================================
+{
+	TRACE_SCOPE("writeSweep");
+
+	FILE* fp = fopen(filename, "w");
+	if (!fp) {
+		error.set(filename, 0, 0, "can't open the file for writing");
+		return false;
+	}
+
+	bool ok = fprintf(fp, "tension,divide,speed,cars,length,lap_time,max_g,min_clearance\n") > 0;
+	for (size_t i = 0; ok && i < results.size(); ++i) {
+		const SweepResult& r = results[i];
+		ok = fprintf(fp, "%.6g,%d,%.6g,%d,%.6g,%.6g,%.6g,%.6g\n", r.tension, r.divide, r.speed,
+						 r.cars, r.length, r.lapTime, r.maxG, r.minClearance) > 0;
+	}
+
+	if (fclose(fp) != 0)
+		ok = false;
+	if (!ok)
+		error.set(filename, 0, 0, "couldn't write all of the file");
+	return ok;
+}
@@ -0,0 +1,695 @@
+/************************************************************************
+     File:        TrainRecording.cpp
+
+     Comment:     Recording the train every tick, and playing it back.
+						See TrainRecording.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#include "TrainRecording.H"
+#include "Utilities/Trace.H"
+
+// the values of a tick: the distance and the speed, then for each car its
+// position, forward, up and right
+#define FRAME_VALUES 2
+#define CAR_VALUES 12
+
+struct RecordingHeader {
+	char			magic[4];			// "TRR\x1a"
+	uint32_t		version;
+	uint32_t		headerSize;			// sizeof(RecordingHeader)
+	uint32_t		ticksPerSecond;
+	float			positionStep;
+	float			directionStep;
+};
+
+struct RecordBlockHeader {
+	uint32_t		size;					// the bytes after this
+	uint32_t		nibbles;				// in them
+	uint32_t		firstTick;
+	uint32_t		ticks;
+	uint32_t		values;				// a tick
+};
+
+struct RecordIndexEntry {
+	uint64_t		offset;				// of the block's header, from the start of the file
+	uint64_t		firstTick;
+};
+
+struct RecordingFooter {
+	uint64_t		indexOffset;
+	uint64_t		blocks;
+	uint64_t		ticks;
+	char			magic[4];			// "TRI\x1a"
+	uint32_t		version;
+};
+
+//****************************************************************************
+//
+// * to a whole number of steps
+//============================================================================
+static inline int32_t quantize(float value, float step)
+//============================================================================
+{
+	return (int32_t) floorf(value / step + 0.5f);
+}
+
+//****************************************************************************
+//
+// * small differences either way make small numbers: 0, -1, 1, -2, ...
+//   become 0, 1, 2, 3, ... and then go 3 bits to a nibble, the top bit of
+//   each saying another one follows. most of them fit in one nibble. the
+//   nibbles go in low half first, and nibbles counts them
+//============================================================================
+static inline void putNibbles(vector<uint8_t>& out, size_t& nibbles, uint32_t difference)
+//============================================================================
+{
+	uint32_t z = (difference << 1) ^ (uint32_t) ((int32_t) difference >> 31);
+	for (;;) {
+		uint8_t n = (uint8_t) (z & 7);
+		z >>= 3;
+		if (z)
+			n |= 8;
+		if (nibbles & 1)
+			out.back() |= (uint8_t) (n << 4);
+		else
+			out.push_back(n);
+		++nibbles;
+		if (!z)
+			return;
+	}
+}
+
+//****************************************************************************
+//
+// * false if it runs off the end of the count nibbles there are
+//============================================================================
+static inline bool getNibbles(const uint8_t* bytes, size_t count, size_t& at, uint32_t& difference)
+//============================================================================
+{
+	uint32_t z = 0;
+	for (int shift = 0; shift < 33; shift += 3) {
+		if (at >= count)
+			return false;
+		uint8_t n = (bytes[at >> 1] >> ((at & 1) * 4)) & 15;
+		++at;
+		z |= (uint32_t) (n & 7) << shift;
+		if (!(n & 8)) {
+			difference = (z >> 1) ^ (0u - (z & 1));
+			return true;
+		}
+	}
+	return false;
+}
+
+//****************************************************************************
+//
+// * a block header that can be believed: its bytes fit in the room there
+//   is and hold the nibbles it says, it starts where the one before left
+//   off, and it has a whole number of cars. every value of every tick
+//   takes a nibble at least, so there can't be more of them than nibbles
+//   (which also keeps a damaged file from asking for a huge tick)
+//============================================================================
+static bool goodBlock(const RecordBlockHeader& header, uint64_t room, size_t firstTick)
+//============================================================================
+{
+	return header.size <= room &&
+			 ((uint64_t) header.nibbles + 1) / 2 == header.size &&
+			 header.firstTick == firstTick && header.ticks &&
+			 header.values >= FRAME_VALUES && (header.values - FRAME_VALUES) % CAR_VALUES == 0 &&
+			 (uint64_t) header.values * header.ticks <= header.nibbles;
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+TrainRecorder::
+TrainRecorder()
+	: active(false), written(0), ticks(0), blockTick(0), blockTicks(0), blockValues(0),
+	  blockNibbles(0),
+	  quit(false), file(0), failed(false), writing(false),
+	  worker(&TrainRecorder::run, this)
+//============================================================================
+{
+	filename[0] = 0;
+}
+
+//****************************************************************************
+//
+// * Destructor
+//============================================================================
+TrainRecorder::
+~TrainRecorder()
+//============================================================================
+{
+	if (active) {
+		TrackIOError error;
+		stop(error);
+	}
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		quit = true;
+	}
+	wake.notify_one();
+	worker.join();
+}
+
+//****************************************************************************
+//
+// * the header goes to the writer like everything else
+//============================================================================
+bool TrainRecorder::
+start(const char* _filename, TrackIOError& error)
+//============================================================================
+{
+	if (active)
+		stop(error);
+
+	FILE* fp = fopen(_filename, "wb");
+	if (!fp) {
+		error.set(_filename, 0, 0, "can't open the file for writing");
+		return false;
+	}
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		file = fp;
+		failed = false;
+	}
+
+	strncpy(filename, _filename, sizeof(filename) - 1);
+	filename[sizeof(filename) - 1] = 0;
+	active = true;
+	ticks = 0;
+	blockTicks = 0;
+	index.clear();
+
+	RecordingHeader header;
+	memcpy(header.magic, "TRR\x1a", 4);
+	header.version = 1;
+	header.headerSize = sizeof(RecordingHeader);
+	header.ticksPerSecond = RECORD_TICKS_PER_SECOND;
+	header.positionStep = RECORD_POSITION_STEP;
+	header.directionStep = RECORD_DIRECTION_STEP;
+	vector<uint8_t> bytes(sizeof(header));
+	memcpy(bytes.data(), &header, sizeof(header));
+	written = bytes.size();
+	queue(bytes);
+	return true;
+}
+
+//****************************************************************************
+//
+// * the first tick of a block is written as it is; after that each value
+//   is written as how far it is from where it would be if it had changed
+//   by as much as it did last tick
+//============================================================================
+void TrainRecorder::
+record(const TrainFrame& frame)
+//============================================================================
+{
+	if (!active)
+		return;
+
+	size_t n = FRAME_VALUES + CAR_VALUES * frame.cars.size();
+	if (blockTicks && (n != blockValues || blockTicks >= RECORD_KEYFRAME_TICKS))
+		finishBlock();
+
+	values.resize(n);
+	values[0] = quantize(frame.along, RECORD_POSITION_STEP);
+	values[1] = quantize(frame.speed, RECORD_POSITION_STEP);
+	for (size_t k = 0; k < frame.cars.size(); ++k) {
+		const TrainCar& car = frame.cars[k];
+		int32_t* v = &values[FRAME_VALUES + CAR_VALUES * k];
+		v[0] = quantize(car.pos.x, RECORD_POSITION_STEP);
+		v[1] = quantize(car.pos.y, RECORD_POSITION_STEP);
+		v[2] = quantize(car.pos.z, RECORD_POSITION_STEP);
+		v[3] = quantize(car.forward.x, RECORD_DIRECTION_STEP);
+		v[4] = quantize(car.forward.y, RECORD_DIRECTION_STEP);
+		v[5] = quantize(car.forward.z, RECORD_DIRECTION_STEP);
+		v[6] = quantize(car.up.x, RECORD_DIRECTION_STEP);
+		v[7] = quantize(car.up.y, RECORD_DIRECTION_STEP);
+		v[8] = quantize(car.up.z, RECORD_DIRECTION_STEP);
+		v[9] = quantize(car.right.x, RECORD_DIRECTION_STEP);
+		v[10] = quantize(car.right.y, RECORD_DIRECTION_STEP);
+		v[11] = quantize(car.right.z, RECORD_DIRECTION_STEP);
+	}
+
+	if (!blockTicks) {
+		blockTick = ticks;
+		blockValues = n;
+		block.resize(sizeof(RecordBlockHeader));
+		blockNibbles = 0;
+		last = values;
+		delta.assign(n, 0);
+		for (size_t i = 0; i < n; ++i)
+			putNibbles(block, blockNibbles, (uint32_t) values[i]);
+	} else {
+		// in unsigned, so a wild jump wraps instead of overflowing
+		for (size_t i = 0; i < n; ++i) {
+			uint32_t predicted = (uint32_t) last[i] + (uint32_t) delta[i];
+			putNibbles(block, blockNibbles, (uint32_t) values[i] - predicted);
+			delta[i] = (int32_t) ((uint32_t) values[i] - (uint32_t) last[i]);
+			last[i] = values[i];
+		}
+	}
+	++blockTicks;
+	++ticks;
+}
+
+//****************************************************************************
+//
+// * the index and the footer go after the last block, and then the file
+//   is closed once the writer has caught up
+//============================================================================
+bool TrainRecorder::
+stop(TrackIOError& error)
+//============================================================================
+{
+	if (!active)
+		return true;
+	TRACE_SCOPE("TrainRecorder::stop");
+
+	finishBlock();
+
+	RecordingFooter footer;
+	footer.indexOffset = written;
+	footer.blocks = index.size() / sizeof(RecordIndexEntry);
+	footer.ticks = ticks;
+	memcpy(footer.magic, "TRI\x1a", 4);
+	footer.version = 1;
+	vector<uint8_t> bytes(index);
+	bytes.resize(index.size() + sizeof(footer));
+	memcpy(bytes.data() + index.size(), &footer, sizeof(footer));
+	queue(bytes);
+
+	bool ok;
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		drained.wait(guard, [this] { return waiting.empty() && !writing; });
+		ok = !failed;
+		if (fclose(file) != 0)
+			ok = false;
+		file = 0;
+	}
+	active = false;
+
+	if (!ok)
+		error.set(filename, 0, 0, "couldn't write all of the recording");
+	return ok;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool TrainRecorder::
+recording() const
+//============================================================================
+{
+	return active;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t TrainRecorder::
+numTicks() const
+//============================================================================
+{
+	return ticks;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void TrainRecorder::
+finishBlock()
+//============================================================================
+{
+	if (!blockTicks)
+		return;
+
+	RecordBlockHeader header;
+	header.size = (uint32_t) (block.size() - sizeof(header));
+	header.nibbles = (uint32_t) blockNibbles;
+	header.firstTick = (uint32_t) blockTick;
+	header.ticks = (uint32_t) blockTicks;
+	header.values = (uint32_t) blockValues;
+	memcpy(block.data(), &header, sizeof(header));
+
+	RecordIndexEntry entry;
+	entry.offset = written;
+	entry.firstTick = blockTick;
+	size_t at = index.size();
+	index.resize(at + sizeof(entry));
+	memcpy(&index[at], &entry, sizeof(entry));
+
+	written += block.size();
+	blockTicks = 0;
+	queue(block);
+}
+
+//****************************************************************************
+//
+// * bytes is left empty
+//============================================================================
+void TrainRecorder::
+queue(vector<uint8_t>& bytes)
+//============================================================================
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		waiting.push_back(vector<uint8_t>());
+		waiting.back().swap(bytes);
+	}
+	wake.notify_one();
+}
+
+//****************************************************************************
+//
+// * the writer: wait for some bytes, write them, repeat
+//============================================================================
+void TrainRecorder::
+run()
+//============================================================================
+{
+	Trace::setThreadName("TrainRecorder");
+
+	vector<uint8_t> bytes;
+	for (;;) {
+		FILE* fp;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			writing = false;
+			drained.notify_all();
+			wake.wait(guard, [this] { return !waiting.empty() || quit; });
+			if (waiting.empty())
+				return;
+			bytes.swap(waiting.front());
+			waiting.erase(waiting.begin());
+			writing = true;
+			fp = file;
+		}
+
+		TRACE_SCOPE("TrainRecorder::write");
+		if (!fp || fwrite(bytes.data(), 1, bytes.size(), fp) != bytes.size()) {
+			std::lock_guard<std::mutex> guard(lock);
+			failed = true;
+		}
+		bytes.clear();
+	}
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+TrainReplay::
+TrainReplay()
+	: positionStep(RECORD_POSITION_STEP), directionStep(RECORD_DIRECTION_STEP),
+	  ticks(0), block(0), nextTick(0), cursor(0)
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool TrainReplay::
+open(const char* filename, TrackIOError& error)
+//============================================================================
+{
+	TRACE_SCOPE("TrainReplay::open");
+
+	close();
+	if (!file.open(filename)) {
+		error.set(filename, 0, 0, "can't open the file");
+		return false;
+	}
+
+	RecordingHeader header;
+	if (file.size() < sizeof(header)) {
+		error.set(filename, 0, 0, "not a recording");
+		close();
+		return false;
+	}
+	memcpy(&header, file.data(), sizeof(header));
+	if (memcmp(header.magic, "TRR\x1a", 4) != 0 || header.headerSize != sizeof(header) ||
+		 !(header.positionStep > 0) || !(header.directionStep > 0)) {
+		error.set(filename, 0, 0, "not a recording");
+		close();
+		return false;
+	}
+	if (header.version != 1) {
+		error.set(filename, 0, 0, "a recording of version %u, which this can't read",
+					 header.version);
+		close();
+		return false;
+	}
+	positionStep = header.positionStep;
+	directionStep = header.directionStep;
+
+	// a recording that never got stopped has no index, but the blocks
+	// that made it are still good
+	if (!readIndex())
+		findBlocks();
+
+	ticks = 0;
+	for (size_t i = 0; i < blocks.size(); ++i)
+		ticks += blocks[i].ticks;
+	if (!ticks) {
+		error.set(filename, 0, 0, "there's nothing in the recording");
+		close();
+		return false;
+	}
+	block = 0;
+	nextTick = 0;
+	cursor = 0;
+	return true;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void TrainReplay::
+close()
+//============================================================================
+{
+	file.close();
+	blocks.clear();
+	ticks = 0;
+	block = 0;
+	nextTick = 0;
+	cursor = 0;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool TrainReplay::
+isOpen() const
+//============================================================================
+{
+	return ticks > 0;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t TrainReplay::
+numTicks() const
+//============================================================================
+{
+	return ticks;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+float TrainReplay::
+duration() const
+//============================================================================
+{
+	return (float) ticks / RECORD_TICKS_PER_SECOND;
+}
+
+//****************************************************************************
+//
+// * from the block before it, unless the tick is next or is the one just
+//   decoded
+//============================================================================
+bool TrainReplay::
+frameAt(size_t tick, TrainFrame& frame)
+//============================================================================
+{
+	if (tick >= ticks)
+		return false;
+
+	const Block* b = &blocks[block];
+	bool justDone = tick + 1 == nextTick && nextTick > b->firstTick;
+	if (!justDone && (tick < nextTick || tick >= b->firstTick + b->ticks)) {
+		Block key;
+		key.firstTick = tick;
+		block = std::upper_bound(blocks.begin(), blocks.end(), key,
+										 [](const Block& a, const Block& c) { return a.firstTick < c.firstTick; })
+				  - blocks.begin() - 1;
+		b = &blocks[block];
+		nextTick = b->firstTick;
+		cursor = 0;
+	}
+	while (nextTick <= tick) {
+		if (!decodeTick()) {
+			// start again from a keyframe next time
+			nextTick = ticks + 1;
+			return false;
+		}
+	}
+
+	size_t nCars = (b->values - FRAME_VALUES) / CAR_VALUES;
+	frame.along = last[0] * positionStep;
+	frame.speed = last[1] * positionStep;
+	frame.cars.resize(nCars);
+	for (size_t k = 0; k < nCars; ++k) {
+		const int32_t* v = &last[FRAME_VALUES + CAR_VALUES * k];
+		TrainCar& car = frame.cars[k];
+		car.pos = Pnt3f(v[0] * positionStep, v[1] * positionStep, v[2] * positionStep);
+		car.forward = Pnt3f(v[3] * directionStep, v[4] * directionStep, v[5] * directionStep);
+		car.up = Pnt3f(v[6] * directionStep, v[7] * directionStep, v[8] * directionStep);
+		car.right = Pnt3f(v[9] * directionStep, v[10] * directionStep, v[11] * directionStep);
+		car.forward.normalize();
+		car.up.normalize();
+		car.right.normalize();
+		car.engine = (k == 0);
+	}
+	return true;
+}
+
+//****************************************************************************
+//
+// * the footer has to be right at the end, with the index just before it,
+//   and every block the index points at has to be in between
+//============================================================================
+bool TrainReplay::
+readIndex()
+//============================================================================
+{
+	const char* data = file.data();
+	size_t size = file.size();
+	RecordingFooter footer;
+	if (size < sizeof(RecordingHeader) + sizeof(footer))
+		return false;
+	memcpy(&footer, data + size - sizeof(footer), sizeof(footer));
+	if (memcmp(footer.magic, "TRI\x1a", 4) != 0 || footer.version != 1 ||
+		 footer.indexOffset < sizeof(RecordingHeader) || footer.indexOffset > size - sizeof(footer) ||
+		 footer.blocks != (size - sizeof(footer) - footer.indexOffset) / sizeof(RecordIndexEntry))
+		return false;
+
+	blocks.clear();
+	size_t firstTick = 0;
+	for (uint64_t i = 0; i < footer.blocks; ++i) {
+		RecordIndexEntry entry;
+		memcpy(&entry, data + footer.indexOffset + i * sizeof(entry), sizeof(entry));
+		RecordBlockHeader header;
+		if (entry.offset > footer.indexOffset - sizeof(header))
+			break;
+		memcpy(&header, data + entry.offset, sizeof(header));
+		if (entry.firstTick != firstTick ||
+			 !goodBlock(header, footer.indexOffset - entry.offset - sizeof(header), firstTick))
+			break;
+
+		Block b;
+		b.bytes = (const uint8_t*) data + entry.offset + sizeof(header);
+		b.nibbles = header.nibbles;
+		b.firstTick = firstTick;
+		b.ticks = header.ticks;
+		b.values = header.values;
+		blocks.push_back(b);
+		firstTick += header.ticks;
+	}
+	if (blocks.size() != footer.blocks || firstTick != footer.ticks) {
+		blocks.clear();
+		return false;
+	}
+	return true;
+}
+
+//****************************************************************************
+//
+// * one block after another from the start, up to the first that isn't
+//   all there
+//============================================================================
+void TrainReplay::
+findBlocks()
+//============================================================================
+{
+	const char* data = file.data();
+	size_t size = file.size();
+	size_t at = sizeof(RecordingHeader);
+	size_t firstTick = 0;
+
+	blocks.clear();
+	while (size - at >= sizeof(RecordBlockHeader)) {
+		RecordBlockHeader header;
+		memcpy(&header, data + at, sizeof(header));
+		if (!goodBlock(header, size - at - sizeof(header), firstTick))
+			break;
+
+		Block b;
+		b.bytes = (const uint8_t*) data + at + sizeof(header);
+		b.nibbles = header.nibbles;
+		b.firstTick = firstTick;
+		b.ticks = header.ticks;
+		b.values = header.values;
+		blocks.push_back(b);
+		firstTick += header.ticks;
+		at += sizeof(header) + header.size;
+	}
+}
+
+//****************************************************************************
+//
+// * the same prediction as TrainRecorder::record, the other way round
+//============================================================================
+bool TrainReplay::
+decodeTick()
+//============================================================================
+{
+	const Block& b = blocks[block];
+	size_t n = b.values;
+
+	if (nextTick == b.firstTick) {
+		last.resize(n);
+		delta.assign(n, 0);
+		for (size_t i = 0; i < n; ++i) {
+			uint32_t value;
+			if (!getNibbles(b.bytes, b.nibbles, cursor, value))
+				return false;
+			last[i] = (int32_t) value;
+		}
+	} else {
+		for (size_t i = 0; i < n; ++i) {
+			uint32_t difference;
+			if (!getNibbles(b.bytes, b.nibbles, cursor, difference))
+				return false;
+			uint32_t value = (uint32_t) last[i] + (uint32_t) delta[i] + difference;
+			delta[i] = (int32_t) (value - (uint32_t) last[i]);
+			last[i] = (int32_t) value;
+		}
+	}
+	++nextTick;
+	return true;
+}
@@ -31,12 +31,16 @@
 #include <windows.h>
 //#include "GL/gl.h"
 #include <glad/glad.h>
-#include <glm/glm.hpp>
 #include "GL/glu.h"
 
 #include "TrainView.H"
 #include "TrainWindow.H"
+#include "TrackExport.H"
+#include "TrainRecording.H"
 #include "Utilities/3DUtils.H"
+#include "Utilities/Trace.H"
+#include "Utilities/FrameArena.H"
+#include "Utilities/ThreadPool.H"
 
 
 #ifdef EXAMPLE_SOLUTION
@@ -55,6 +59,11 @@ TrainView(int x, int y, int w, int h, const char* l)
 {
 	mode( FL_RGB|FL_ALPHA|FL_DOUBLE | FL_STENCIL );
 
+	// one quadric for all of the cylinders and disks (making a new one
+	// for each every frame leaks)
+	quadric = gluNewQuadric();
+	gforceRails = 0;
+
 	resetArcball();
 }
 
@@ -83,6 +92,8 @@ resetArcball()
 //========================================================================
 int TrainView::handle(int event)
 {
+	TRACE_SCOPE("handle");
+
 	// see if the ArcBall will handle the event - if it does, 
 	// then we're done
 	// note: the arcball only gets the event if we're in world view
@@ -132,7 +143,7 @@ int TrainView::handle(int event)
 				cp->pos.x = (float) rx;
 				cp->pos.y = (float) ry;
 				cp->pos.z = (float) rz;
-				damage(1);
+				tw->trackChanged();
 			}
 			break;
 
@@ -164,6 +175,20 @@ int TrainView::handle(int event)
 
 					return 1;
 				};
+				if (k == 't') {
+					// start / stop recording the scoped timers
+					Trace::setEnabled(!Trace::enabled());
+					printf("Tracing %s\n", Trace::enabled() ? "on" : "off");
+					return 1;
+				}
+				if (k == 'd') {
+					// write what has been recorded so far
+					if (Trace::dump(TRACE_FILE))
+						printf("Wrote trace to %s\n", TRACE_FILE);
+					else
+						printf("Nothing traced yet (press t to start)\n");
+					return 1;
+				}
 				break;
 	}
 
@@ -177,6 +202,17 @@ int TrainView::handle(int event)
 //========================================================================
 void TrainView::draw()
 {
+	TRACE_SCOPE("draw");
+	perf.beginFrame();
+
+	// the track only gets compiled when it changes - show what that cost
+	// on the first frame that uses it
+	TrackSnapshot track = tw->trackStore.current();
+	if (track && track != hudTrack) {
+		perf.addStageNs(PERF_TESSELLATE, track->tessellateNs);
+		perf.addStageNs(PERF_ARC_LENGTH, track->arcLengthNs);
+		hudTrack = track;
+	}
 
 	//*********************************************************************
 	//
@@ -289,7 +325,11 @@ void TrainView::draw()
 
 	setupFloor();
 	//glDisable(GL_LIGHTING);
-	drawFloor(200,200);
+	{
+		PerfStageTimer timer(perf, PERF_FLOOR);
+		drawFloor(200,200);
+	}
+	perf.addDrawCalls(1, 200 * 200 * 4);
 
 	
 
@@ -306,6 +346,7 @@ void TrainView::draw()
 
 	// this time drawing is for shadows (except for top view)
 	if (!tw->topCam->value()) {
+		PerfStageTimer timer(perf, PERF_SHADOWS);
 		setupShadows();
 		drawStuff(true);
 		unsetupShadows();
@@ -330,12 +371,16 @@ void TrainView::draw()
 	glPushMatrix();
 	glTranslatef(-20, 19, 20);
 	glColor3f(1, 1, 1);
-	gluSphere(gluNewQuadric(), 1, 100, 20);
+	gluSphere(quadric, 1, 100, 20);
 	glPopMatrix();
 
-	
-
+	// the overlay goes over everything else
+	if (tw->hudButton->value())
+		perf.draw(w(), h());
+	perf.endFrame();
 
+	// the frame is done - drop all of its scratch memory
+	frameArena.reset();
 }
 
 //************************************************************************
@@ -383,163 +428,13 @@ setProjection()
 		glMatrixMode(GL_MODELVIEW);
 		glLoadIdentity();
 
-		float local_current_length = current_length;
-		int local_start_point = 0;
-
-
-
-		for (int i = 0; i < copy_list_sum_track_length.size(); i++) {
-			if ((int)(local_current_length / copy_list_sum_track_length[i]) >= 1) {
-				//std::cout << "I checked" << std::endl;
-				local_start_point = (i + 1) % (copy_list_sum_track_length.size());
-			}
-
+		TrackSnapshot track = tw->trackStore.current();
+		Pnt3f qt, forward, right, up;
+		if (track && locateCar(*track, 0, qt, forward, right, up)) {
+			Pnt3f this_pos = qt + up * 5.0f;
+			Pnt3f next_pos = qt + forward + up * 5.0f;
+			gluLookAt(this_pos.x, this_pos.y, this_pos.z, next_pos.x, next_pos.y, next_pos.z, up.x, up.y, up.z);
 		}
-
-		if (tw->splineBrowser->value() == 1) {
-			if (tw->arcLength->value()) {
-
-				Pnt3f train_cp_pos_p1 = m_pTrack->points[local_start_point % m_pTrack->points.size()].pos;
-				Pnt3f train_cp_pos_p2 = m_pTrack->points[(local_start_point + 1) % m_pTrack->points.size()].pos;
-
-				Pnt3f train_cp_orient_p1 = m_pTrack->points[local_start_point % m_pTrack->points.size()].orient;
-				Pnt3f train_cp_orient_p2 = m_pTrack->points[(local_start_point + 1) % m_pTrack->points.size()].orient;
-
-				float train_percentage;
-				if (local_start_point == 0) {
-					train_percentage = local_current_length / copy_list_sum_track_length[0];
-				}
-				else {
-					train_percentage = (local_current_length - copy_list_sum_track_length[local_start_point - 1]) / (copy_list_sum_track_length[local_start_point] - copy_list_sum_track_length[local_start_point - 1]);
-				}
-
-				Pnt3f qt0 = train_cp_pos_p2 * train_percentage + train_cp_pos_p1 * (1 - train_percentage);
-				Pnt3f qt1 = train_cp_pos_p2 * (train_percentage + 0.0001) + train_cp_pos_p1 * (1 - train_percentage - 0.0001);
-
-				Pnt3f forward = qt1 - qt0;
-				forward.normalize();
-				Pnt3f orient = train_cp_orient_p2 * (train_percentage)+train_cp_orient_p1 * (1 - train_percentage);
-				orient.normalize();
-
-				Pnt3f right = forward * orient;
-				right.normalize();
-				Pnt3f up = right * forward;
-				up.normalize();
-
-				Pnt3f this_pos = qt0 + up * 5.0f;
-				Pnt3f next_pos = qt1 + up * 5.0f;
-				gluLookAt(this_pos.x, this_pos.y, this_pos.z, next_pos.x, next_pos.y, next_pos.z, up.x, up.y, up.z);
-			}
-			else {
-				//	without arc-length
-				
-				Pnt3f train_cp_pos_p1 = m_pTrack->points[(int)t_time].pos;
-				Pnt3f train_cp_pos_p2 = m_pTrack->points[((int)t_time + 1) % m_pTrack->points.size()].pos;
-
-				Pnt3f train_cp_orient_p1 = m_pTrack->points[(int)t_time].orient;
-				Pnt3f train_cp_orient_p2 = m_pTrack->points[((int)t_time + 1) % m_pTrack->points.size()].orient;
-
-				float train_percentage = t_time - (int)t_time;
-				Pnt3f qt0 = train_cp_pos_p2 * train_percentage + train_cp_pos_p1 * (1 - train_percentage);
-				Pnt3f qt1 = train_cp_pos_p2 * (train_percentage + 0.0001) + train_cp_pos_p1 * (1 - train_percentage - 0.0001);
-
-				Pnt3f forward = qt1 - qt0;
-				forward.normalize();
-				Pnt3f orient = train_cp_orient_p2 * (train_percentage)+train_cp_orient_p1 * (1 - train_percentage);
-				orient.normalize();
-
-				Pnt3f right = forward * orient;
-				right.normalize();
-				Pnt3f up = right * forward;
-				up.normalize();
-				
-				Pnt3f this_pos = qt0 + up * 5.0f;
-				Pnt3f next_pos = qt1 + up * 5.0f;
-				gluLookAt(this_pos.x, this_pos.y, this_pos.z, next_pos.x, next_pos.y, next_pos.z, up.x, up.y, up.z);
-			}
-		}
-
-		if (tw->splineBrowser->value() >= 2) {
-
-			if (tw->arcLength->value()) {
-
-				Pnt3f train_cp_pos_p1 = m_pTrack->points[local_start_point % m_pTrack->points.size()].pos;
-				Pnt3f train_cp_pos_p2 = m_pTrack->points[(local_start_point + 1) % m_pTrack->points.size()].pos;
-				Pnt3f train_cp_pos_p3 = m_pTrack->points[(local_start_point + 2) % m_pTrack->points.size()].pos;
-				Pnt3f train_cp_pos_p4 = m_pTrack->points[(local_start_point + 3) % m_pTrack->points.size()].pos;
-
-
-				Pnt3f train_cp_orient_p1 = m_pTrack->points[local_start_point % m_pTrack->points.size()].orient;
-				Pnt3f train_cp_orient_p2 = m_pTrack->points[(local_start_point + 1) % m_pTrack->points.size()].orient;
-				Pnt3f train_cp_orient_p3 = m_pTrack->points[(local_start_point + 2) % m_pTrack->points.size()].orient;
-				Pnt3f train_cp_orient_p4 = m_pTrack->points[(local_start_point + 3) % m_pTrack->points.size()].orient;
-
-
-
-				float train_percentage;
-				if (local_start_point == 0) {
-					train_percentage = local_current_length / copy_list_sum_track_length[0];
-				}
-				else {
-					if (copy_list_sum_track_length.size() > local_start_point)
-						train_percentage = (local_current_length - copy_list_sum_track_length[local_start_point - 1]) / (copy_list_sum_track_length[local_start_point] - copy_list_sum_track_length[local_start_point - 1]);
-					else {
-						std::cout << "copy: " << copy_list_sum_track_length.size() << " local_start_point " << local_start_point << std::endl;
-						train_percentage = 0;
-					}
-				}
-
-				Pnt3f qt0 = GMT(train_cp_pos_p1, train_cp_pos_p2, train_cp_pos_p3, train_cp_pos_p4, train_percentage, tw->splineBrowser->value());
-				Pnt3f qt1 = GMT(train_cp_pos_p1, train_cp_pos_p2, train_cp_pos_p3, train_cp_pos_p4, train_percentage + 0.0001, tw->splineBrowser->value());
-
-				Pnt3f orient = GMT(train_cp_orient_p1, train_cp_orient_p2, train_cp_orient_p3, train_cp_orient_p4, train_percentage, tw->splineBrowser->value());
-
-				Pnt3f forward = qt1 - qt0;
-
-				forward.normalize();
-				orient.normalize();
-
-				Pnt3f right = forward * orient;
-				right.normalize();
-				Pnt3f up = right * forward;
-				up.normalize();
-
-				Pnt3f this_pos = qt0 + up * 5.0f;
-				Pnt3f next_pos = qt1 + up * 5.0f;
-				gluLookAt(this_pos.x, this_pos.y, this_pos.z, next_pos.x, next_pos.y, next_pos.z, up.x, up.y, up.z);
-			}
-			else {
-				Pnt3f train_cp_pos_p1 = m_pTrack->points[(int)t_time].pos;
-				Pnt3f train_cp_pos_p2 = m_pTrack->points[((int)t_time + 1) % m_pTrack->points.size()].pos;
-				Pnt3f train_cp_pos_p3 = m_pTrack->points[((int)t_time + 2) % m_pTrack->points.size()].pos;
-				Pnt3f train_cp_pos_p4 = m_pTrack->points[((int)t_time + 3) % m_pTrack->points.size()].pos;
-
-				Pnt3f train_cp_orient_p1 = m_pTrack->points[(int)t_time].orient;
-				Pnt3f train_cp_orient_p2 = m_pTrack->points[((int)t_time + 1) % m_pTrack->points.size()].orient;
-				Pnt3f train_cp_orient_p3 = m_pTrack->points[((int)t_time + 2) % m_pTrack->points.size()].orient;
-				Pnt3f train_cp_orient_p4 = m_pTrack->points[((int)t_time + 3) % m_pTrack->points.size()].orient;
-
-				Pnt3f qt0 = GMT(train_cp_pos_p1, train_cp_pos_p2, train_cp_pos_p3, train_cp_pos_p4, t_time - (int)t_time, tw->splineBrowser->value());
-				Pnt3f qt1 = GMT(train_cp_pos_p1, train_cp_pos_p2, train_cp_pos_p3, train_cp_pos_p4, t_time - (int)t_time + 0.0001, tw->splineBrowser->value());
-
-				Pnt3f orient = GMT(train_cp_orient_p1, train_cp_orient_p2, train_cp_orient_p3, train_cp_orient_p4, t_time - (int)t_time, tw->splineBrowser->value());
-
-				Pnt3f forward = qt1 - qt0;
-
-				forward.normalize();
-				orient.normalize();
-
-				Pnt3f right = forward * orient;
-				right.normalize();
-				Pnt3f up = right * forward;
-				up.normalize();
-
-				Pnt3f this_pos = qt0 + up * 5.0f;
-				Pnt3f next_pos = qt1 + up * 5.0f;
-				gluLookAt(this_pos.x, this_pos.y, this_pos.z, next_pos.x, next_pos.y, next_pos.z, up.x, up.y, up.z);
-			}
-		}
-
 	}
 	// Or do the train view or other view here
 	//####################################################################
@@ -566,7 +461,8 @@ setProjection()
 //########################################################################
 //========================================================================
 
-void draw_one_plane(int start_x, int start_y, int end_x, int end_y, int num, int lock_dir, int lock_pos) {
+// returns the number of quads it drew
+int draw_one_plane(int start_x, int start_y, int end_x, int end_y, int num, int lock_dir, int lock_pos) {
 	float push_x = (end_x - start_x) / num;
 	float push_y = (end_y - start_y) / num;
 
@@ -595,16 +491,12 @@ void draw_one_plane(int start_x, int start_y, int end_x, int end_y, int num, int
 			}
 		}
 	}
+	return (lock_dir == 0 || lock_dir == 2) ? num * num : 0;
 }
 
 void TrainView::drawStuff(bool doingShadows)
 {
-	std::vector<float> list_sum_track_length;
-
-	
-
-
-	
+	TRACE_SCOPE(doingShadows ? "drawStuff(shadows)" : "drawStuff");
 
 	// my_scene
 	if (tw->my_scene->value()) {
@@ -630,24 +522,26 @@ void TrainView::drawStuff(bool doingShadows)
 		
 		
 
+		int quads = 0;
 		if (!doingShadows)
 			glColor3f(0.8,0.8,0.8);
-		draw_one_plane(20, 0, 80, 20, 10, 2, -20); //(x,y)
-		draw_one_plane(20, 20, 40, 40, 10, 2, -20);
-		draw_one_plane(60, 20, 80, 40, 10, 2, -20);
-		draw_one_plane(20, 40, 80, 100, 10, 2, -20);
+		quads += draw_one_plane(20, 0, 80, 20, 10, 2, -20); //(x,y)
+		quads += draw_one_plane(20, 20, 40, 40, 10, 2, -20);
+		quads += draw_one_plane(60, 20, 80, 40, 10, 2, -20);
+		quads += draw_one_plane(20, 40, 80, 100, 10, 2, -20);
 
 		
 
-		draw_one_plane(0, -20, 60, -80, 10, 0, 20); //(y,z)
-		draw_one_plane(60, -20, 80, -40, 10, 0, 20);
-		draw_one_plane(60, -60, 80, -80, 10, 0, 20);
-		draw_one_plane(80, -20, 100, -80, 10, 0, 20);
+		quads += draw_one_plane(0, -20, 60, -80, 10, 0, 20); //(y,z)
+		quads += draw_one_plane(60, -20, 80, -40, 10, 0, 20);
+		quads += draw_one_plane(60, -60, 80, -80, 10, 0, 20);
+		quads += draw_one_plane(80, -20, 100, -80, 10, 0, 20);
 
 		if (!doingShadows)
 			glColor3f(0.2, 0.2, 0.2);
-		draw_one_plane(20, 0, 80, 100, 10, 2, -80);
-		draw_one_plane(0, -20, 100, -80, 10, 0, 80);
+		quads += draw_one_plane(20, 0, 80, 100, 10, 2, -80);
+		quads += draw_one_plane(0, -20, 100, -80, 10, 0, 80);
+		perf.addDrawCalls(2 + quads, 4 + quads * 4);
 	
 	}
 	
@@ -656,6 +550,7 @@ void TrainView::drawStuff(bool doingShadows)
 	// don't draw the control points if you're driving 
 	// (otherwise you get sea-sick as you drive through them)
 	if (!tw->trainCam->value()) {
+		PerfStageTimer timer(perf, PERF_DRAW_TRACK);
 		for(size_t i=0; i<m_pTrack->points.size(); ++i) {
 			if (!doingShadows) {
 				if (((int)i) != selectedCube)
@@ -666,7 +561,8 @@ void TrainView::drawStuff(bool doingShadows)
 			}
 			m_pTrack->points[i].draw();
 		}
-		
+		// each point is a box and a pyramid
+		perf.addDrawCalls(2 * (int) m_pTrack->points.size(), 26 * (int) m_pTrack->points.size());
 	}
 
 	// draw the track
@@ -674,183 +570,267 @@ void TrainView::drawStuff(bool doingShadows)
 	// TODO: 
 	// call your own track drawing code
 	//####################################################################
-	float tile_arc_two_cp_length = 0;
-	std::vector<Pnt3f> arc_list_tile_qt;
-
-	float arc_tunnel_two_cp_length = 0;
-	std::vector<Pnt3f> arc_list_tunnel_qt;
-	
-	if (tw->splineBrowser->value() == 1) {	// Linear
-		float total_length = 0;
-		
-
-		for (size_t i = 0; i < m_pTrack->points.size(); ++i) {
-
-			// pos
-			Pnt3f cp_pos_p1 = m_pTrack->points[i].pos;
-			Pnt3f cp_pos_p2 = m_pTrack->points[(i + 1) % m_pTrack->points.size()].pos;
-			// orient
-			Pnt3f cp_orient_p1 = m_pTrack->points[i].orient;
-			Pnt3f cp_orient_p2 = m_pTrack->points[(i + 1) % m_pTrack->points.size()].orient;
-			float percent = 1.0f / DIVIDE_LINE;
-			float t = 0;
-			Pnt3f qt = (1 - t) * cp_pos_p1 + t * cp_pos_p2;
-			
-
-			float two_cp_length = 0;
-			
-
-			for (size_t j = 0; j < DIVIDE_LINE; j++) {
-				Pnt3f qt0 = qt;
-				t += percent;
-				qt = (1 - t) * cp_pos_p1 + t * cp_pos_p2;
-				Pnt3f qt1 = qt;
-				
-				//	get length
-				two_cp_length += std::sqrt((qt1.x - qt0.x) * (qt1.x - qt0.x) + (qt1.y - qt0.y) * (qt1.y - qt0.y) + (qt1.z - qt0.z) * (qt1.z - qt0.z));
-				tile_arc_two_cp_length += std::sqrt((qt1.x - qt0.x) * (qt1.x - qt0.x) + (qt1.y - qt0.y) * (qt1.y - qt0.y) + (qt1.z - qt0.z) * (qt1.z - qt0.z));
-
-				if (!tw->rail_parallel->value()) {
-					glLineWidth(3);
-					glBegin(GL_LINES);
-					if (!doingShadows)
-						glColor3ub(32, 32, 64);
-					glVertex3f(qt0.x, qt0.y, qt0.z);
-					glVertex3f(qt1.x, qt1.y, qt1.z);
-					glEnd();
-				}
-				// cross
-
+	// everything below is drawn from one snapshot of the track, even if
+	// it gets edited while we draw
+	TrackSnapshot track = tw->trackStore.current();
+	if (!track)
+		return;
+	drawCompiledTrack(*track, doingShadows);
+	if (tw->clearanceButton->value() && !doingShadows)
+		drawClearance(track);
 
-				Pnt3f orient_t = (1 - t) * cp_orient_p1 + t * cp_orient_p2;
-				orient_t.normalize();
-				// Pnt3f forward = 
-				Pnt3f forward = (qt1 - qt0);
-				forward.normalize();
-				Pnt3f cross_t = (qt1 - qt0) * orient_t;
-
-				cross_t.normalize();
-				cross_t = cross_t * 2.5f;
-				if (tw->rail_parallel->value()) {
-					glBegin(GL_LINES);
-					if (!doingShadows)
-						glColor3f(1,0,0);
-					glLineWidth(3);
-					glVertex3f(qt0.x + cross_t.x, qt0.y + cross_t.y, qt0.z + cross_t.z);
-					glVertex3f(qt1.x + cross_t.x, qt1.y + cross_t.y, qt1.z + cross_t.z);
-					glVertex3f(qt0.x - cross_t.x, qt0.y - cross_t.y, qt0.z - cross_t.z);
-					glVertex3f(qt1.x - cross_t.x, qt1.y - cross_t.y, qt1.z - cross_t.z);
-					glEnd();
-				}
-
-				
-				if (tile_arc_two_cp_length >= 10) {
-					arc_list_tile_qt.push_back(qt);
-					arc_list_tile_qt.push_back(cross_t);
-					arc_list_tile_qt.push_back(forward);
-					tile_arc_two_cp_length = 0;
+	if (!tw->trainCam->value()) {
+		PerfStageTimer timer(perf, PERF_DRAW_TRAINS);
+		drawTrain(*track, doingShadows, 0, 1);
+		for (int i = 0; i < trainCars(); i++) {
+			drawTrain(*track, doingShadows, (i + 1) * 10, 0);
+		}
+	}
+	drawWorld(doingShadows);
+#ifdef EXAMPLE_SOLUTION
+	drawTrack(this, doingShadows);
+#endif
 
-				}
+	// draw the train
+	//####################################################################
+	// TODO: 
+	//	call your own train drawing code
+	//####################################################################
+#ifdef EXAMPLE_SOLUTION
+	// don't draw the train if you're looking out the front window
+	if (!tw->trainCam->value())
+		drawTrain(this, doingShadows);
+#endif
+	
+}
 
-				arc_list_tunnel_qt.push_back(qt);
-				arc_list_tunnel_qt.push_back(cross_t);
-				arc_list_tunnel_qt.push_back(forward);
-				
 
+//************************************************************************
+//
+// * how thick the mouse ray is (see PickPad): how far apart the points
+//   getMouseLine gives are from the ones it would give pixels to the
+//   side, at both its depths (t = 0 and t = 1)
+//========================================================================
+static PickPad mousePad(float pixels)
+//========================================================================
+{
+	double model[16], proj[16];
+	int viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glGetDoublev(GL_MODELVIEW_MATRIX, model);
+	glGetDoublev(GL_PROJECTION_MATRIX, proj);
+
+	double x = Fl::event_x();
+	double y = viewport[3] - Fl::event_y();
+	float width[2];
+	for (int i = 0; i < 2; ++i) {
+		double depth = i ? .75 : .25;
+		double a[3], b[3];
+		if (!gluUnProject(x, y, depth, model, proj, viewport, &a[0], &a[1], &a[2]) ||
+			 !gluUnProject(x + pixels, y, depth, model, proj, viewport, &b[0], &b[1], &b[2]))
+			return PickPad();
+		Pnt3f d((float) (b[0] - a[0]), (float) (b[1] - a[1]), (float) (b[2] - a[2]));
+		width[i] = sqrtf(d.x * d.x + d.y * d.y + d.z * d.z);
+	}
+	return PickPad(width[0], width[1] - width[0]);
+}
 
-				
+//************************************************************************
+//
+// * the colour of the track for a vertical g-force: blue where the rider
+//   floats out of the seat, green for 1g, through yellow to red at 4g
+//========================================================================
+static void gforceColour(float g, unsigned char rgb[3])
+//========================================================================
+{
+	float r, gr, b;
+	if (g < 1) {
+		float f = g < 0 ? 0 : g;
+		r = 0; gr = f; b = 1 - f;
+	}
+	else if (g < 2.5f) {
+		r = (g - 1) / 1.5f; gr = 1; b = 0;
+	}
+	else {
+		float f = g > 4 ? 1 : (g - 2.5f) / 1.5f;
+		r = 1; gr = 1 - f; b = 0;
+	}
+	rgb[0] = (unsigned char) (r * 255);
+	rgb[1] = (unsigned char) (gr * 255);
+	rgb[2] = (unsigned char) (b * 255);
+}
 
+//************************************************************************
+//
+// * draw the track from a compiled snapshot: the rails, then the ties,
+//   the supports and the tunnel
+//========================================================================
+void TrainView::
+drawCompiledTrack(const CompiledTrack& track, bool doingShadows)
+//========================================================================
+{
+	PerfStageTimer drawTrackTimer(perf, PERF_DRAW_TRACK);
 
+	size_t nSteps = track.numSteps();
+	if (!nSteps)
+		return;
 
+	// the rails - one line down the middle, or two parallel ones. the
+	// vertices were all worked out when the track was compiled
+	const vector<Pnt3f>* rails;
+	if (!tw->rail_parallel->value()) {
+		if (!doingShadows) {
+			if (track.splineType == SPLINE_LINEAR)
+				glColor3ub(32, 32, 64);
+			else
+				glColor3ub(1, 0, 0);
+		}
+		rails = &track.railLines;
+	}
+	else {
+		if (!doingShadows)
+			glColor3f(1, 0, 0);
+		rails = &track.parallelLines;
+	}
+	// or coloured by what the rider feels going over them
+	bool gforces = false;
+	if (!doingShadows && tw->gforceButton->value()) {
+		bool changed = tw->updateAnalysis();
+		const GForceSeries& series = tw->analysis.series();
+		if (series.stepVertical.size() == nSteps) {
+			if (changed || gforceRails != rails || gforceColours.size() != rails->size() * 3) {
+				size_t perStep = rails->size() / nSteps;
+				gforceColours.resize(rails->size() * 3);
+				for (size_t i = 0; i < nSteps; ++i) {
+					unsigned char rgb[3];
+					gforceColour(series.stepVertical[i], rgb);
+					for (size_t k = 0; k < perStep; ++k) {
+						unsigned char* c = &gforceColours[(i * perStep + k) * 3];
+						c[0] = rgb[0];
+						c[1] = rgb[1];
+						c[2] = rgb[2];
+					}
+				}
+				gforceRails = rails;
 			}
-
-			total_length += two_cp_length;
-			list_track_length.push_back(two_cp_length);
-			list_sum_track_length.push_back(total_length);
+			gforces = true;
 		}
+	}
 
-		int length_list_track_length = list_track_length.size();
-		tw->tv_length_list_track_length = length_list_track_length;
-		tw->tv_list_track_length = list_track_length;
-		
-		copy_list_sum_track_length = list_sum_track_length;
-		/*
-		for (int my_i = 0; my_i < length_list_track_length; my_i++) {
-			std::cout << "track " << my_i << "'s length is: " << list_sum_track_length[my_i] << std::endl;
-		}
-		*/
+	glLineWidth(3);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, sizeof(Pnt3f), rails->data());
+	if (gforces) {
+		glEnableClientState(GL_COLOR_ARRAY);
+		glColorPointer(3, GL_UNSIGNED_BYTE, 0, gforceColours.data());
+	}
+	glDrawArrays(GL_LINES, 0, (GLsizei) rails->size());
+	if (gforces)
+		glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	perf.addDrawCalls(1, (int) rails->size());
+
+	if (tw->rail_tile->value()) {
+
+		for (size_t i = 0; i < track.ties.size(); ++i) {
+			perf.addDrawCalls(4, 16);
+			int step = track.ties[i];
+			Pnt3f qt = track.stepEnd(step);
+			Pnt3f right = track.cross[step] * 2;
+			Pnt3f forward = track.forward[step] * 2;
+			Pnt3f up = right * forward;
+			up.normalize();
 
-		for (int my_i = 0; my_i < length_list_track_length; my_i++) {
-			list_track_length.pop_back();
-			list_sum_track_length.pop_back();
+			if (!doingShadows)
+				glColor3f(1, 0, 0);
+
+			//up 
+			glBegin(GL_POLYGON);
+			glNormal3f(up.x, up.y, up.z);
+			glVertex3f(qt.x + forward.x - right.x, qt.y + forward.y - right.y, qt.z + forward.z - right.z);
+			glVertex3f(qt.x + forward.x + right.x, qt.y + forward.y + right.y, qt.z + forward.z + right.z);
+			glVertex3f(qt.x - forward.x + right.x, qt.y - forward.y + right.y, qt.z - forward.z + right.z);
+			glVertex3f(qt.x - forward.x - right.x, qt.y - forward.y - right.y, qt.z - forward.z - right.z);
+			glEnd();
+
+			//down
+			glBegin(GL_POLYGON);
+			glNormal3f(-up.x, -up.y, -up.z);
+			glVertex3f(qt.x + forward.x - right.x - up.x, qt.y + forward.y - right.y - up.y, qt.z + forward.z - right.z - up.z);
+			glVertex3f(qt.x + forward.x + right.x - up.x, qt.y + forward.y + right.y - up.y, qt.z + forward.z + right.z - up.z);
+			glVertex3f(qt.x - forward.x + right.x - up.x, qt.y - forward.y + right.y - up.y, qt.z - forward.z + right.z - up.z);
+			glVertex3f(qt.x - forward.x - right.x - up.x, qt.y - forward.y - right.y - up.y, qt.z - forward.z - right.z - up.z);
+			glEnd();
+
+			//left
+			glBegin(GL_POLYGON);
+			glNormal3f(-up.x, -up.y, -up.z);
+			glVertex3f(qt.x + forward.x + right.x, qt.y + forward.y + right.y, qt.z + forward.z + right.z);
+			glVertex3f(qt.x + forward.x + right.x - up.x, qt.y + forward.y + right.y - up.y, qt.z + forward.z + right.z - up.z);
+			glVertex3f(qt.x - forward.x + right.x - up.x, qt.y - forward.y + right.y - up.y, qt.z - forward.z + right.z - up.z);
+			glVertex3f(qt.x - forward.x + right.x, qt.y - forward.y + right.y, qt.z - forward.z + right.z);
+			glEnd();
+
+			//left
+			glBegin(GL_POLYGON);
+			glNormal3f(-up.x, -up.y, -up.z);
+			glVertex3f(qt.x + forward.x - right.x, qt.y + forward.y - right.y, qt.z + forward.z - right.z);
+			glVertex3f(qt.x + forward.x - right.x - up.x, qt.y + forward.y - right.y - up.y, qt.z + forward.z - right.z - up.z);
+			glVertex3f(qt.x - forward.x - right.x - up.x, qt.y - forward.y - right.y - up.y, qt.z - forward.z - right.z - up.z);
+			glVertex3f(qt.x - forward.x - right.x, qt.y - forward.y - right.y, qt.z - forward.z - right.z);
+			glEnd();
 		}
+	}
 
-		/*
-		for (int i = 0; i < copy_list_sum_track_length.size(); i++) {
-			std::cout << "track " << i << "'s length is: " << copy_list_sum_track_length[i] << std::endl;
-		}
-		*/
-		int length_arc_list_tile_qt = arc_list_tile_qt.size();
-		int length_arc_list_tunnel_qt = (int)(arc_list_tunnel_qt.size() * tw->tunnel_length->value());
-
-		// draw tile
-		if (tw->rail_tile->value()) {
-			
-			for (int i = 0; i < length_arc_list_tile_qt; i += 3) {
-				Pnt3f qt = arc_list_tile_qt[i];
-				Pnt3f right = arc_list_tile_qt[i + 1] * 2;
-				Pnt3f forward = arc_list_tile_qt[i + 2] * 2;
-				Pnt3f up = right * forward;
-				up.normalize();
+	if (tw->rail_support->value()) {
 
+		// a support under every other tie
+		for (size_t i = 0; i < track.ties.size(); i += 2) {
+			perf.addDrawCalls(1, tw->rail_parallel->value() ? 4 : 2);
+			int step = track.ties[i];
+			Pnt3f qt = track.stepEnd(step);
+			Pnt3f right = track.cross[step];
+			Pnt3f forward = track.forward[step] * 2;
+			Pnt3f up = right * forward;
+			up.normalize();
+
+			if (!tw->rail_parallel->value()) {
+				// up
 				if (!doingShadows)
 					glColor3f(1, 0, 0);
-				
-				// up
-				glBegin(GL_POLYGON);
-				glNormal3f(up.x, up.y, up.z);
-				glVertex3f(qt.x + forward.x - right.x, qt.y + forward.y - right.y, qt.z + forward.z - right.z);
-				glVertex3f(qt.x + forward.x + right.x, qt.y + forward.y + right.y, qt.z + forward.z + right.z);
-				glVertex3f(qt.x - forward.x + right.x, qt.y - forward.y + right.y, qt.z - forward.z + right.z);
-				glVertex3f(qt.x - forward.x - right.x, qt.y - forward.y - right.y, qt.z - forward.z - right.z);
-				glEnd();
-
-				//down
-				glBegin(GL_POLYGON);
-				glNormal3f(-up.x, -up.y, -up.z);
-				glVertex3f(qt.x + forward.x - right.x - up.x, qt.y + forward.y - right.y - up.y, qt.z + forward.z - right.z - up.z);
-				glVertex3f(qt.x + forward.x + right.x - up.x, qt.y + forward.y + right.y - up.y, qt.z + forward.z + right.z - up.z);
-				glVertex3f(qt.x - forward.x + right.x - up.x, qt.y - forward.y + right.y - up.y, qt.z - forward.z + right.z - up.z);
-				glVertex3f(qt.x - forward.x - right.x - up.x, qt.y - forward.y - right.y - up.y, qt.z - forward.z - right.z - up.z);
+				glBegin(GL_LINES);
+				glLineWidth(200);
+				glVertex3f(qt.x, qt.y, qt.z);
+				glVertex3f(qt.x, 0, qt.z);
 				glEnd();
+			}
+			else {
+				if (!doingShadows)
+					glColor3f(1, 0, 0);
+				glBegin(GL_LINES);
+				glLineWidth(200);
+				glVertex3f(qt.x + right.x, qt.y + right.y, qt.z + right.z);
+				glVertex3f(qt.x + right.x, 0, qt.z + right.z);
 
-				//left
-				glBegin(GL_POLYGON);
-				glNormal3f(-up.x, -up.y, -up.z);
-				glVertex3f(qt.x + forward.x + right.x, qt.y + forward.y + right.y, qt.z + forward.z + right.z);
-				glVertex3f(qt.x + forward.x + right.x - up.x, qt.y + forward.y + right.y - up.y, qt.z + forward.z + right.z - up.z);
-				glVertex3f(qt.x - forward.x + right.x - up.x, qt.y - forward.y + right.y - up.y, qt.z - forward.z + right.z - up.z);
-				glVertex3f(qt.x - forward.x + right.x, qt.y - forward.y + right.y, qt.z - forward.z + right.z);
+				glVertex3f(qt.x - right.x, qt.y - right.y, qt.z - right.z);
+				glVertex3f(qt.x - right.x, 0, qt.z - right.z);
 				glEnd();
+			}
 
-				//left
-				glBegin(GL_POLYGON);
-				glNormal3f(-up.x, -up.y, -up.z);
-				glVertex3f(qt.x + forward.x - right.x, qt.y + forward.y - right.y, qt.z + forward.z - right.z);
-				glVertex3f(qt.x + forward.x - right.x - up.x, qt.y + forward.y - right.y - up.y, qt.z + forward.z - right.z - up.z);
-				glVertex3f(qt.x - forward.x - right.x - up.x, qt.y - forward.y - right.y - up.y, qt.z - forward.z - right.z - up.z);
-				glVertex3f(qt.x - forward.x - right.x, qt.y - forward.y - right.y, qt.z - forward.z - right.z);
-				glEnd();
 
-			}
 		}
+	}
 
-		if (tw->rail_tunnel->value()) {
 
-			for (int i = 0; i < length_arc_list_tunnel_qt; i += 3) {
-				Pnt3f qt = arc_list_tunnel_qt[i];
-				Pnt3f right = arc_list_tunnel_qt[i + 1] * 3;
-				Pnt3f forward = arc_list_tunnel_qt[i + 2] * 3;
+	if (tw->rail_tunnel->value()) {
+		// the tunnel covers the first part of the track
+		size_t tunnel_steps = (size_t) (nSteps * tw->tunnel_length->value());
+		if (tunnel_steps > 0) {
+			for (size_t step = 0; step < tunnel_steps; ++step) {
+				perf.addDrawCalls(9, 36);
+				Pnt3f qt = track.stepStart(step);
+				Pnt3f right = track.cross[step] * 3;
+				Pnt3f forward = track.forward[step] * 3;
 				Pnt3f up = right * forward;
 
 				forward.normalize();
@@ -890,15 +870,17 @@ void TrainView::drawStuff(bool doingShadows)
 
 				// top inside
 				glBegin(GL_POLYGON);
-				glVertex3f(qt.x + up.x + right.x * 1.2, qt.y + up.y  + right.y * 1.2, qt.z + up.z  + right.z * 1.2);
-				glVertex3f(qt.x + up.x  - right.x * 1.2, qt.y + up.y  - right.y * 1.2, qt.z + up.z  - right.z * 1.2);
-				glVertex3f(qt.x + up.x  - right.x * 1.2 + forward.x, qt.y + up.y  - right.y * 1.2 + forward.y, qt.z + up.z  - right.z * 1.2 + forward.z);
-				glVertex3f(qt.x + up.x  + right.x * 1.2 + forward.x, qt.y + up.y  + right.y * 1.2 + forward.y, qt.z + up.z  + right.z * 1.2 + forward.z);
+				glVertex3f(qt.x + up.x + right.x * 1.2, qt.y + up.y + right.y * 1.2, qt.z + up.z + right.z * 1.2);
+				glVertex3f(qt.x + up.x - right.x * 1.2, qt.y + up.y - right.y * 1.2, qt.z + up.z - right.z * 1.2);
+				glVertex3f(qt.x + up.x - right.x * 1.2 + forward.x, qt.y + up.y - right.y * 1.2 + forward.y, qt.z + up.z - right.z * 1.2 + forward.z);
+				glVertex3f(qt.x + up.x + right.x * 1.2 + forward.x, qt.y + up.y + right.y * 1.2 + forward.y, qt.z + up.z + right.z * 1.2 + forward.z);
 				glEnd();
 
 
 
 
+				// top inside
+
 				//right outside
 				glBegin(GL_POLYGON);
 				glNormal3f(-up.x, -up.y, -up.z);
@@ -911,10 +893,10 @@ void TrainView::drawStuff(bool doingShadows)
 				//right inside
 				glBegin(GL_POLYGON);
 				glNormal3f(-up.x, -up.y, -up.z);
-				glVertex3f(qt.x + right.x , qt.y + right.y , qt.z + right.z );
-				glVertex3f(qt.x + right.x  + up.x, qt.y + right.y  + up.y, qt.z + right.z  + up.z);
-				glVertex3f(qt.x + right.x  + up.x + forward.x, qt.y + right.y  + up.y + forward.y, qt.z + right.z  + up.z + forward.z);
-				glVertex3f(qt.x + right.x  + forward.x, qt.y + right.y  + forward.y, qt.z + right.z  + forward.z);
+				glVertex3f(qt.x + right.x, qt.y + right.y, qt.z + right.z);
+				glVertex3f(qt.x + right.x + up.x, qt.y + right.y + up.y, qt.z + right.z + up.z);
+				glVertex3f(qt.x + right.x + up.x + forward.x, qt.y + right.y + up.y + forward.y, qt.z + right.z + up.z + forward.z);
+				glVertex3f(qt.x + right.x + forward.x, qt.y + right.y + forward.y, qt.z + right.z + forward.z);
 				glEnd();
 
 				//left
@@ -938,418 +920,300 @@ void TrainView::drawStuff(bool doingShadows)
 				//left inside
 				glBegin(GL_POLYGON);
 				glNormal3f(-up.x, -up.y, -up.z);
-				glVertex3f(qt.x - right.x , qt.y - right.y , qt.z - right.z );
-				glVertex3f(qt.x - right.x  + up.x, qt.y - right.y  + up.y, qt.z - right.z  + up.z);
-				glVertex3f(qt.x - right.x  + up.x + forward.x, qt.y - right.y  + up.y + forward.y, qt.z - right.z  + up.z + forward.z);
-				glVertex3f(qt.x - right.x  + forward.x, qt.y - right.y  + forward.y, qt.z - right.z  + forward.z);
+				glVertex3f(qt.x - right.x, qt.y - right.y, qt.z - right.z);
+				glVertex3f(qt.x - right.x + up.x, qt.y - right.y + up.y, qt.z - right.z + up.z);
+				glVertex3f(qt.x - right.x + up.x + forward.x, qt.y - right.y + up.y + forward.y, qt.z - right.z + up.z + forward.z);
+				glVertex3f(qt.x - right.x + forward.x, qt.y - right.y + forward.y, qt.z - right.z + forward.z);
 				glEnd();
 			}
 		}
-
-		if (tw->rail_support->value()) {
-
-			for (int i = 0; i < length_arc_list_tile_qt; i += 6) {
-				Pnt3f qt = arc_list_tile_qt[i];
-				Pnt3f right = arc_list_tile_qt[i + 1];
-				Pnt3f forward = arc_list_tile_qt[i + 2] * 2;
-				Pnt3f up = right * forward;
-				up.normalize();
-
-				if (!tw->rail_parallel->value()) {
-					// up
-					if (!doingShadows)
-						glColor3f(1, 0, 0);
-					glBegin(GL_LINES);
-					glLineWidth(200);
-					glVertex3f(qt.x, qt.y, qt.z);
-					glVertex3f(qt.x, 0, qt.z);
-					glEnd();
-				}
-				else {
-					if (!doingShadows)
-						glColor3f(1, 0, 0);
-					glBegin(GL_LINES);
-					glLineWidth(200);
-					glVertex3f(qt.x + right.x, qt.y + right.y, qt.z + right.z);
-					glVertex3f(qt.x + right.x, 0, qt.z + right.z);
-
-					glVertex3f(qt.x - right.x, qt.y - right.y, qt.z - right.z);
-					glVertex3f(qt.x - right.x, 0, qt.z - right.z);
-					glEnd();
-				}
-
-
-			}
-		}
-		
 	}
+}
 
-	else if (tw->splineBrowser->value() >= 2) { //
-		float total_length = 0;
-		for (size_t i = 0; i < m_pTrack->points.size(); ++i) {
-			// pos
-			Pnt3f cp_pos_p1 = m_pTrack->points[i].pos;
-			Pnt3f cp_pos_p2 = m_pTrack->points[(i + 1) % m_pTrack->points.size()].pos;
-			Pnt3f cp_pos_p3 = m_pTrack->points[(i + 2) % m_pTrack->points.size()].pos;
-			Pnt3f cp_pos_p4 = m_pTrack->points[(i + 3) % m_pTrack->points.size()].pos;
-			// orient
-			Pnt3f cp_orient_p1 = m_pTrack->points[i].orient;
-			Pnt3f cp_orient_p2 = m_pTrack->points[(i + 1) % m_pTrack->points.size()].orient;
-			Pnt3f cp_orient_p3 = m_pTrack->points[(i + 2) % m_pTrack->points.size()].orient;
-			Pnt3f cp_orient_p4 = m_pTrack->points[(i + 3) % m_pTrack->points.size()].orient;
-
-			float percent = 1.0f / DIVIDE_LINE;
-			float t = 0;
-			Pnt3f qt = GMT(cp_pos_p1, cp_pos_p2, cp_pos_p3, cp_pos_p4, t, tw->splineBrowser->value());
-
-			float two_cp_length = 0;
-			float arc_two_cp_length = 0;
-
-			for (size_t j = 0; j < DIVIDE_LINE; j++) {
-				Pnt3f qt0 = qt;
-				t += percent;
-				qt = GMT(cp_pos_p1, cp_pos_p2, cp_pos_p3, cp_pos_p4, t, tw->splineBrowser->value());
-				Pnt3f qt1 = qt;
-
-				two_cp_length += std::sqrt((qt1.x - qt0.x) * (qt1.x - qt0.x) + (qt1.y - qt0.y) * (qt1.y - qt0.y) + (qt1.z - qt0.z) * (qt1.z - qt0.z));
-				
-				arc_two_cp_length += std::sqrt((qt1.x - qt0.x) * (qt1.x - qt0.x) + (qt1.y - qt0.y) * (qt1.y - qt0.y) + (qt1.z - qt0.z) * (qt1.z - qt0.z));
-				tile_arc_two_cp_length += std::sqrt((qt1.x - qt0.x) * (qt1.x - qt0.x) + (qt1.y - qt0.y) * (qt1.y - qt0.y) + (qt1.z - qt0.z) * (qt1.z - qt0.z));
-
-				
-
-				if (arc_two_cp_length >= 1) {
-					list_qt.push_back(qt);
-					arc_two_cp_length = 0;
-				}
-
-
-
-
-				if (!tw->rail_parallel->value()) {
-					glLineWidth(3);
-					glBegin(GL_LINES);
-					if (!doingShadows)
-						glColor3ub(1, 0, 0);
-					glVertex3f(qt0.x, qt0.y, qt0.z);
-					glVertex3f(qt1.x, qt1.y, qt1.z);
-					glEnd();
-				}
-
-				Pnt3f orient_t = GMT(cp_orient_p1, cp_orient_p2, cp_orient_p3, cp_orient_p4, t, tw->splineBrowser->value());
-				orient_t.normalize();
-				Pnt3f forward = qt1 - qt0;
-				forward.normalize();
-
-				Pnt3f cross_t = (qt1 - qt0) * orient_t;
-
-				cross_t.normalize();
-				cross_t = cross_t * 2.5f;
-				if (tw->rail_parallel->value()) {
-					if (!doingShadows)
-						glColor3f(1, 0, 0);
-					glBegin(GL_LINES);
-					glLineWidth(3);
-					glVertex3f(qt0.x + cross_t.x, qt0.y + cross_t.y, qt0.z + cross_t.z);
-					glVertex3f(qt1.x + cross_t.x, qt1.y + cross_t.y, qt1.z + cross_t.z);
-					glVertex3f(qt0.x - cross_t.x, qt0.y - cross_t.y, qt0.z - cross_t.z);
-					glVertex3f(qt1.x - cross_t.x, qt1.y - cross_t.y, qt1.z - cross_t.z);
-					glEnd();
-				}
-
-				if (tile_arc_two_cp_length >= 10) {
-					arc_list_tile_qt.push_back(qt);
-					arc_list_tile_qt.push_back(cross_t);
-					arc_list_tile_qt.push_back(forward);
-					tile_arc_two_cp_length = 0;
-
-				}
-
-				arc_list_tunnel_qt.push_back(qt0);
-				arc_list_tunnel_qt.push_back(cross_t);
-				arc_list_tunnel_qt.push_back(forward);
-
-			}
-			
-			total_length += two_cp_length;
-			list_track_length.push_back(two_cp_length);
-			list_sum_track_length.push_back(total_length);
-			
-		}
-		
-		int length_list_track_length = list_track_length.size();
-		tw->tv_length_list_track_length = length_list_track_length;
-		tw->tv_list_track_length = list_track_length;
-
-		copy_list_sum_track_length = list_sum_track_length;
-		int length_list_qt = list_qt.size();
-		//std::cout << length_list_qt << std::endl;
-		copy_list_qt = list_qt;
-
-		for (int my_i = 0; my_i < length_list_track_length; my_i++) {
-			list_track_length.pop_back();
-			list_sum_track_length.pop_back();
-		}
-		for (int my_i = 0; my_i < length_list_qt; my_i++) {
-			list_qt.pop_back();
-		}
-
+//************************************************************************
+//
+// * where the train is on a compiled track, and which way it faces.
+//   with arc length on, length is how far along the track it is;
+//   otherwise the train goes by t_time (whole segments per unit)
+//   returns false if there's no track to be on
+//========================================================================
+bool TrainView::
+locateTrain(const CompiledTrack& track, float length,
+				Pnt3f& qt, Pnt3f& forward, Pnt3f& right, Pnt3f& up)
+//========================================================================
+{
+	size_t npts = track.points.size();
+	if (npts < 2 || track.totalLength <= 0)
+		return false;
+
+	size_t seg;
+	float u;
+	if (tw->arcLength->value()) {
+		seg = track.segmentAt(length);
+		u = track.segmentFraction(seg, length);
+	}
+	else {
+		seg = ((size_t) t_time) % npts;
+		u = t_time - (int) t_time;
+	}
 
-		int length_arc_list_tile_qt = arc_list_tile_qt.size();
-		if (tw->rail_tile->value()) {
+	Pnt3f qt1;
+	if (tw->arcLength->value() && track.splineType != SPLINE_LINEAR && track.arcPoints.size() >= 2) {
+		// the cubic curves move along the evenly spaced points
+		size_t i = (size_t) length;
+		if (i + 1 >= track.arcPoints.size())
+			i = 0;
+		qt = track.arcPoints[i];
+		qt1 = track.arcPoints[i + 1];
+	}
+	else {
+		qt = track.pointAt(seg, u);
+		qt1 = track.pointAt(seg, u + 0.0001f);
+	}
+	Pnt3f orient = track.orientAt(seg, u);
 
-			for (int i = 0; i < length_arc_list_tile_qt; i += 3) {
-				Pnt3f qt = arc_list_tile_qt[i];
-				Pnt3f right = arc_list_tile_qt[i + 1] * 2;
-				Pnt3f forward = arc_list_tile_qt[i + 2] * 2;
-				Pnt3f up = right * forward;
-				up.normalize();
+	forward = qt1 - qt;
+	forward.normalize();
+	orient.normalize();
 
-				if (!doingShadows)
-					glColor3f(1, 0, 0);
+	right = forward * orient;
+	right.normalize();
+	up = right * forward;
+	up.normalize();
+	return true;
+}
 
-				//up 
-				glBegin(GL_POLYGON);
-				glNormal3f(up.x, up.y, up.z);
-				glVertex3f(qt.x + forward.x - right.x, qt.y + forward.y - right.y, qt.z + forward.z - right.z);
-				glVertex3f(qt.x + forward.x + right.x, qt.y + forward.y + right.y, qt.z + forward.z + right.z);
-				glVertex3f(qt.x - forward.x + right.x, qt.y - forward.y + right.y, qt.z - forward.z + right.z);
-				glVertex3f(qt.x - forward.x - right.x, qt.y - forward.y - right.y, qt.z - forward.z - right.z);
-				glEnd();
+//************************************************************************
+//
+// * the recording has a car every WORLD_CAR_SPACING, as placeTrain put
+//   them when it was made
+//========================================================================
+bool TrainView::
+locateCar(const CompiledTrack& track, float backward,
+			 Pnt3f& qt, Pnt3f& forward, Pnt3f& right, Pnt3f& up)
+//========================================================================
+{
+	if (replayFrame) {
+		size_t k = (size_t) (backward / WORLD_CAR_SPACING + 0.5f);
+		if (k >= replayFrame->cars.size())
+			return false;
+		const TrainCar& car = replayFrame->cars[k];
+		qt = car.pos;
+		forward = car.forward;
+		right = car.right;
+		up = car.up;
+		return true;
+	}
 
-				//down
-				glBegin(GL_POLYGON);
-				glNormal3f(-up.x, -up.y, -up.z);
-				glVertex3f(qt.x + forward.x - right.x - up.x, qt.y + forward.y - right.y - up.y, qt.z + forward.z - right.z - up.z);
-				glVertex3f(qt.x + forward.x + right.x - up.x, qt.y + forward.y + right.y - up.y, qt.z + forward.z + right.z - up.z);
-				glVertex3f(qt.x - forward.x + right.x - up.x, qt.y - forward.y + right.y - up.y, qt.z - forward.z + right.z - up.z);
-				glVertex3f(qt.x - forward.x - right.x - up.x, qt.y - forward.y - right.y - up.y, qt.z - forward.z - right.z - up.z);
-				glEnd();
+	float length = current_length - backward;
+	if (length < 0)
+		length += track.totalLength;
+	return locateTrain(track, length, qt, forward, right, up);
+}
 
-				//left
-				glBegin(GL_POLYGON);
-				glNormal3f(-up.x, -up.y, -up.z);
-				glVertex3f(qt.x + forward.x + right.x, qt.y + forward.y + right.y, qt.z + forward.z + right.z);
-				glVertex3f(qt.x + forward.x + right.x - up.x, qt.y + forward.y + right.y - up.y, qt.z + forward.z + right.z - up.z);
-				glVertex3f(qt.x - forward.x + right.x - up.x, qt.y - forward.y + right.y - up.y, qt.z - forward.z + right.z - up.z);
-				glVertex3f(qt.x - forward.x + right.x, qt.y - forward.y + right.y, qt.z - forward.z + right.z);
-				glEnd();
+//************************************************************************
+//
+// *
+//========================================================================
+int TrainView::
+trainCars() const
+//========================================================================
+{
+	if (replayFrame)
+		return replayFrame->cars.empty() ? 0 : (int) replayFrame->cars.size() - 1;
+	return num_cars;
+}
 
-				//left
-				glBegin(GL_POLYGON);
-				glNormal3f(-up.x, -up.y, -up.z);
-				glVertex3f(qt.x + forward.x - right.x, qt.y + forward.y - right.y, qt.z + forward.z - right.z);
-				glVertex3f(qt.x + forward.x - right.x - up.x, qt.y + forward.y - right.y - up.y, qt.z + forward.z - right.z - up.z);
-				glVertex3f(qt.x - forward.x - right.x - up.x, qt.y - forward.y - right.y - up.y, qt.z - forward.z - right.z - up.z);
-				glVertex3f(qt.x - forward.x - right.x, qt.y - forward.y - right.y, qt.z - forward.z - right.z);
-				glEnd();
+//************************************************************************
+//
+// * check the track against itself (only when it or the tunnel changed),
+//   and mark the stretches that are too close and where they are
+//   closest. they're drawn over everything, so they show through
+//   whatever is in the way
+//========================================================================
+void TrainView::
+drawClearance(const TrackSnapshot& track)
+//========================================================================
+{
+	ClearanceOptions options;
+	if (tw->rail_tunnel->value())
+		options.tunnelLength = (float) tw->tunnel_length->value();
+	clearance.update(track, options);
+
+	const vector<ClearanceConflict>& conflicts = clearance.conflicts();
+	if (conflicts.empty() || track->arcPoints.empty())
+		return;
+
+	glPushAttrib(GL_ENABLE_BIT | GL_LINE_BIT);
+	glDisable(GL_LIGHTING);
+	glDisable(GL_DEPTH_TEST);
+	glLineWidth(6);
+
+	// arcPoints[i] is i units along the track
+	int nArc = (int) track->arcPoints.size();
+	glColor3f(1, 1, 0);
+	for (size_t i = 0; i < conflicts.size(); ++i) {
+		const ClearanceConflict& c = conflicts[i];
+		float stretch[2][2] = { { c.aStart, c.aEnd }, { c.bStart, c.bEnd } };
+		for (int k = 0; k < 2; ++k) {
+			int first = (int) stretch[k][0];
+			int last = (int) ceilf(stretch[k][1]);
+			// a stretch that runs past the start of the track
+			if (last < first)
+				last += nArc;
+			glBegin(GL_LINE_STRIP);
+			for (int a = first; a <= last; ++a) {
+				const Pnt3f& p = track->arcPoints[a % nArc];
+				glVertex3f(p.x, p.y, p.z);
 			}
+			glEnd();
+			perf.addDrawCalls(1, last - first + 1);
 		}
+	}
 
-		if (tw->rail_support->value()) {
-
-			for (int i = 0; i < length_arc_list_tile_qt; i += 6) {
-				Pnt3f qt = arc_list_tile_qt[i];
-				Pnt3f right = arc_list_tile_qt[i + 1];
-				Pnt3f forward = arc_list_tile_qt[i + 2] * 2;
-				Pnt3f up = right * forward;
-				up.normalize();
-
-				if (!tw->rail_parallel->value()) {
-					// up
-					if (!doingShadows)
-						glColor3f(1, 0, 0);
-					glBegin(GL_LINES);
-					glLineWidth(200);
-					glVertex3f(qt.x, qt.y, qt.z);
-					glVertex3f(qt.x, 0, qt.z);
-					glEnd();
-				}
-				else {
-					if (!doingShadows)
-						glColor3f(1, 0, 0);
-					glBegin(GL_LINES);
-					glLineWidth(200);
-					glVertex3f(qt.x + right.x, qt.y + right.y, qt.z + right.z);
-					glVertex3f(qt.x + right.x, 0, qt.z + right.z);
-
-					glVertex3f(qt.x - right.x, qt.y - right.y, qt.z - right.z);
-					glVertex3f(qt.x - right.x, 0, qt.z - right.z);
-					glEnd();
-				}
-
+	glLineWidth(2);
+	glColor3f(1, 0, 1);
+	glBegin(GL_LINES);
+	for (size_t i = 0; i < conflicts.size(); ++i) {
+		glVertex3f(conflicts[i].aPos.x, conflicts[i].aPos.y, conflicts[i].aPos.z);
+		glVertex3f(conflicts[i].bPos.x, conflicts[i].bPos.y, conflicts[i].bPos.z);
+	}
+	glEnd();
+	perf.addDrawCalls(1, 2 * (int) conflicts.size());
 
-			}
-		}
+	glPopAttrib();
+}
 
-		int length_arc_list_tunnel_qt = (int)(arc_list_tunnel_qt.size() * tw->tunnel_length->value());
-		//std::cout << "tunnel length: " << length_arc_list_tunnel_qt << std::endl;
-		if (tw->rail_tunnel->value()) {
-			//std::cout << "draw_tunnel" << std::endl;
+//************************************************************************
+//
+// * the rest of the world: the rails of the other tracks, then all of
+//   its trains. a car is a plain box, the size of the cube on the engine,
+//   and the boxes all go in one array (from the frame's scratch memory),
+//   so hundreds of trains are still one draw call
+//========================================================================
+void TrainView::
+drawWorld(bool doingShadows)
+//========================================================================
+{
+	const TrainWorld& world = tw->world;
+	PerfStageTimer timer(perf, PERF_DRAW_TRAINS);
 
-			if (length_arc_list_tunnel_qt > 0) {
-				for (int i = 0; i < length_arc_list_tunnel_qt; i += 3) {
-					Pnt3f qt = arc_list_tunnel_qt[i];
-					Pnt3f right = arc_list_tunnel_qt[i + 1] * 3;
-					Pnt3f forward = arc_list_tunnel_qt[i + 2] * 3;
-					Pnt3f up = right * forward;
+	glEnableClientState(GL_VERTEX_ARRAY);
 
-					forward.normalize();
-					forward = forward * 0.1;
+	// the first track is the one being edited, which is already drawn -
+	// unless it's the way round by the siding
+	glLineWidth(3);
+	if (!doingShadows)
+		glColor3f(1, 0, 0);
+	TrackSnapshot edited = tw->trackStore.current();
+	for (size_t t = 0; t < world.numTracks(); ++t) {
+		const TrackSnapshot& track = world.track(t);
+		if (!track || track->railLines.empty() || (t == 0 && track == edited))
+			continue;
+		const Pnt3f& o = world.origin(t);
+		glPushMatrix();
+		glTranslatef(o.x, o.y, o.z);
+		glVertexPointer(3, GL_FLOAT, sizeof(Pnt3f), track->railLines.data());
+		glDrawArrays(GL_LINES, 0, (GLsizei) track->railLines.size());
+		glPopMatrix();
+		perf.addDrawCalls(1, (int) track->railLines.size());
+	}
 
-					up.normalize();
-					up = up * 10;
+	size_t nCars = world.numCars();
+	if (!nCars) {
+		glDisableClientState(GL_VERTEX_ARRAY);
+		return;
+	}
 
-					if (!doingShadows) {
-						glColor3f(0.5, 0.5, 0.1);
-					}
+	ArenaVector<TrainCar> cars(nCars, TrainCar(), ArenaAllocator<TrainCar>(frameArena));
+	world.placeCars(cars.data(), WORLD_CAR_SPACING);
+
+	// each box is 6 faces of 4 corners (anticlockwise from outside): along
+	// forward, up and right, out from the middle of the car
+	static const float corner[6][4][3] = {
+		{ { 1, 1, 1 }, { 1, -1, 1 }, { 1, -1, -1 }, { 1, 1, -1 } },
+		{ { -1, 1, -1 }, { -1, -1, -1 }, { -1, -1, 1 }, { -1, 1, 1 } },
+		{ { -1, 1, -1 }, { -1, 1, 1 }, { 1, 1, 1 }, { 1, 1, -1 } },
+		{ { -1, -1, 1 }, { -1, -1, -1 }, { 1, -1, -1 }, { 1, -1, 1 } },
+		{ { -1, 1, 1 }, { -1, -1, 1 }, { 1, -1, 1 }, { 1, 1, 1 } },
+		{ { 1, 1, -1 }, { 1, -1, -1 }, { -1, -1, -1 }, { -1, 1, -1 } },
+	};
+	static const float faceNormal[6][3] = {
+		{ 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 },
+	};
 
-					//right
-					glBegin(GL_POLYGON);
-					glNormal3f(-up.x, -up.y, -up.z);
-					glVertex3f(qt.x + right.x, qt.y + right.y, qt.z + right.z);
-					glVertex3f(qt.x + right.x + up.x, qt.y + right.y + up.y, qt.z + right.z + up.z);
-					glVertex3f(qt.x + right.x * 1.2 + up.x, qt.y + right.y * 1.2 + up.y, qt.z + right.z * 1.2 + up.z);
-					glVertex3f(qt.x + right.x * 1.2, qt.y + right.y * 1.2, qt.z + right.z * 1.2);
-					glEnd();
-
-					// top 
-					glBegin(GL_POLYGON);
-					glVertex3f(qt.x + up.x - right.x * 1.2, qt.y + up.y - right.y * 1.2, qt.z + up.z - right.z * 1.2);
-					glVertex3f(qt.x + up.x + right.x * 1.2, qt.y + up.y + right.y * 1.2, qt.z + up.z + right.z * 1.2);
-					glVertex3f(qt.x + up.x * 1.1 + right.x * 1.2, qt.y + up.y * 1.1 + right.y * 1.2, qt.z + up.z * 1.1 + right.z * 1.2);
-					glVertex3f(qt.x + up.x * 1.1 - right.x * 1.2, qt.y + up.y * 1.1 - right.y * 1.2, qt.z + up.z * 1.1 - right.z * 1.2);
-					glEnd();
-
-					// top outside
-					glBegin(GL_POLYGON);
-					glVertex3f(qt.x + up.x * 1.1 + right.x * 1.2, qt.y + up.y * 1.1 + right.y * 1.2, qt.z + up.z * 1.1 + right.z * 1.2);
-					glVertex3f(qt.x + up.x * 1.1 - right.x * 1.2, qt.y + up.y * 1.1 - right.y * 1.2, qt.z + up.z * 1.1 - right.z * 1.2);
-					glVertex3f(qt.x + up.x * 1.1 - right.x * 1.2 + forward.x, qt.y + up.y * 1.1 - right.y * 1.2 + forward.y, qt.z + up.z * 1.1 - right.z * 1.2 + forward.z);
-					glVertex3f(qt.x + up.x * 1.1 + right.x * 1.2 + forward.x, qt.y + up.y * 1.1 + right.y * 1.2 + forward.y, qt.z + up.z * 1.1 + right.z * 1.2 + forward.z);
-					glEnd();
-
-					// top inside
-					glBegin(GL_POLYGON);
-					glVertex3f(qt.x + up.x + right.x * 1.2, qt.y + up.y + right.y * 1.2, qt.z + up.z + right.z * 1.2);
-					glVertex3f(qt.x + up.x - right.x * 1.2, qt.y + up.y - right.y * 1.2, qt.z + up.z - right.z * 1.2);
-					glVertex3f(qt.x + up.x - right.x * 1.2 + forward.x, qt.y + up.y - right.y * 1.2 + forward.y, qt.z + up.z - right.z * 1.2 + forward.z);
-					glVertex3f(qt.x + up.x + right.x * 1.2 + forward.x, qt.y + up.y + right.y * 1.2 + forward.y, qt.z + up.z + right.z * 1.2 + forward.z);
-					glEnd();
-
-
-
-
-					// top inside
-
-					//right outside
-					glBegin(GL_POLYGON);
-					glNormal3f(-up.x, -up.y, -up.z);
-					glVertex3f(qt.x + right.x * 1.2, qt.y + right.y * 1.2, qt.z + right.z * 1.2);
-					glVertex3f(qt.x + right.x * 1.2 + up.x, qt.y + right.y * 1.2 + up.y, qt.z + right.z * 1.2 + up.z);
-					glVertex3f(qt.x + right.x * 1.2 + up.x + forward.x, qt.y + right.y * 1.2 + up.y + forward.y, qt.z + right.z * 1.2 + up.z + forward.z);
-					glVertex3f(qt.x + right.x * 1.2 + forward.x, qt.y + right.y * 1.2 + forward.y, qt.z + right.z * 1.2 + forward.z);
-					glEnd();
-
-					//right inside
-					glBegin(GL_POLYGON);
-					glNormal3f(-up.x, -up.y, -up.z);
-					glVertex3f(qt.x + right.x, qt.y + right.y, qt.z + right.z);
-					glVertex3f(qt.x + right.x + up.x, qt.y + right.y + up.y, qt.z + right.z + up.z);
-					glVertex3f(qt.x + right.x + up.x + forward.x, qt.y + right.y + up.y + forward.y, qt.z + right.z + up.z + forward.z);
-					glVertex3f(qt.x + right.x + forward.x, qt.y + right.y + forward.y, qt.z + right.z + forward.z);
-					glEnd();
-
-					//left
-					glBegin(GL_POLYGON);
-					glNormal3f(-up.x, -up.y, -up.z);
-					glVertex3f(qt.x - right.x, qt.y - right.y, qt.z - right.z);
-					glVertex3f(qt.x - right.x + up.x, qt.y - right.y + up.y, qt.z - right.z + up.z);
-					glVertex3f(qt.x - right.x * 1.2 + up.x, qt.y - right.y * 1.2 + up.y, qt.z - right.z * 1.2 + up.z);
-					glVertex3f(qt.x - right.x * 1.2, qt.y - right.y * 1.2, qt.z - right.z * 1.2);
-					glEnd();
-
-					//left outside
-					glBegin(GL_POLYGON);
-					glNormal3f(-up.x, -up.y, -up.z);
-					glVertex3f(qt.x - right.x * 1.2, qt.y - right.y * 1.2, qt.z - right.z * 1.2);
-					glVertex3f(qt.x - right.x * 1.2 + up.x, qt.y - right.y * 1.2 + up.y, qt.z - right.z * 1.2 + up.z);
-					glVertex3f(qt.x - right.x * 1.2 + up.x + forward.x, qt.y - right.y * 1.2 + up.y + forward.y, qt.z - right.z * 1.2 + up.z + forward.z);
-					glVertex3f(qt.x - right.x * 1.2 + forward.x, qt.y - right.y * 1.2 + forward.y, qt.z - right.z * 1.2 + forward.z);
-					glEnd();
-
-					//left inside
-					glBegin(GL_POLYGON);
-					glNormal3f(-up.x, -up.y, -up.z);
-					glVertex3f(qt.x - right.x, qt.y - right.y, qt.z - right.z);
-					glVertex3f(qt.x - right.x + up.x, qt.y - right.y + up.y, qt.z - right.z + up.z);
-					glVertex3f(qt.x - right.x + up.x + forward.x, qt.y - right.y + up.y + forward.y, qt.z - right.z + up.z + forward.z);
-					glVertex3f(qt.x - right.x + forward.x, qt.y - right.y + forward.y, qt.z - right.z + forward.z);
-					glEnd();
+	size_t nVerts = nCars * 24;
+	ArenaVector<float> verts(nVerts * 3, 0.0f, ArenaAllocator<float>(frameArena));
+	ArenaVector<float> normals(nVerts * 3, 0.0f, ArenaAllocator<float>(frameArena));
+	ArenaVector<unsigned char> colours(nVerts * 3, 0, ArenaAllocator<unsigned char>(frameArena));
+
+	ThreadPool::shared().parallelFor(nCars, 512, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			const TrainCar& car = cars[i];
+			// the cube on the engine is 5 on a side, sitting 5 above the track
+			Pnt3f f = car.forward * 2.5f;
+			Pnt3f u = car.up * 2.5f;
+			Pnt3f r = car.right * 2.5f;
+			Pnt3f middle = car.pos + car.up * 7.5f;
+			unsigned char rgb[3] = { 128, 0, 128 };
+			if (!car.engine)
+				rgb[0] = rgb[1] = rgb[2] = 77;
+
+			float* v = &verts[i * 72];
+			float* n = &normals[i * 72];
+			unsigned char* c = &colours[i * 72];
+			for (int face = 0; face < 6; ++face) {
+				const float* fn = faceNormal[face];
+				float nx = car.forward.x * fn[0] + car.up.x * fn[1] + car.right.x * fn[2];
+				float ny = car.forward.y * fn[0] + car.up.y * fn[1] + car.right.y * fn[2];
+				float nz = car.forward.z * fn[0] + car.up.z * fn[1] + car.right.z * fn[2];
+				for (int k = 0; k < 4; ++k, v += 3, n += 3, c += 3) {
+					const float* a = corner[face][k];
+					v[0] = middle.x + f.x * a[0] + u.x * a[1] + r.x * a[2];
+					v[1] = middle.y + f.y * a[0] + u.y * a[1] + r.y * a[2];
+					v[2] = middle.z + f.z * a[0] + u.z * a[1] + r.z * a[2];
+					n[0] = nx;
+					n[1] = ny;
+					n[2] = nz;
+					c[0] = rgb[0];
+					c[1] = rgb[1];
+					c[2] = rgb[2];
 				}
 			}
 		}
+	});
+
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 0, verts.data());
+	glNormalPointer(GL_FLOAT, 0, normals.data());
+	if (!doingShadows) {
+		glEnableClientState(GL_COLOR_ARRAY);
+		glColorPointer(3, GL_UNSIGNED_BYTE, 0, colours.data());
 	}
-
-	if (!tw->trainCam->value()) {
-		drawTrain(doingShadows, 0, 1);
-		for (int i = 0; i < num_cars; i++) {
-			drawTrain(doingShadows, (i + 1) * 10, 0);
-		}
-	}
-#ifdef EXAMPLE_SOLUTION
-	drawTrack(this, doingShadows);
-#endif
-
-	// draw the train
-	//####################################################################
-	// TODO: 
-	//	call your own train drawing code
-	//####################################################################
-#ifdef EXAMPLE_SOLUTION
-	// don't draw the train if you're looking out the front window
-	if (!tw->trainCam->value())
-		drawTrain(this, doingShadows);
-#endif
-	
+	glDrawArrays(GL_QUADS, 0, (GLsizei) nVerts);
+	if (!doingShadows)
+		glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	perf.addDrawCalls(1, (int) nVerts);
 }
 
-
-Pnt3f TrainView::GMT(const Pnt3f& pt0, const Pnt3f& pt1, const Pnt3f& pt2, const Pnt3f& pt3, double t, int type) {
-	glm::mat4x4 M;
-	switch (type) {
-	case 2: {
-		float s = tw->tension->value();
-		M = {
-			-s, 2*s, -s, 0,
-			2-s, s-3, 0, 1,
-			s-2, 3-2*s, s, 0,
-			s, -s, 0, 0
-		};
-	}break;
-	case 3: {
-		M = {
-			-1, 3, -3, 1,
-			3, -6, 0, 4,
-			-3, 3, 3, 1,
-			1, 0, 0, 0
-		};
-		M /= 6.0f;
-	}break;
+//************************************************************************
+//
+// * the engine and the cars behind it, where drawStuff draws them
+//========================================================================
+void TrainView::
+placeTrain(const CompiledTrack& track, std::vector<TrainCar>& cars)
+//========================================================================
+{
+	cars.clear();
+	for (int i = 0; i <= trainCars(); i++) {
+		TrainCar car;
+		if (!locateCar(track, i * 10.0f, car.pos, car.forward, car.right, car.up))
+			return;
+		car.engine = (i == 0);
+		cars.push_back(car);
 	}
-
-	M = glm::transpose(M);
-	glm::mat4x4 G = {
-		{pt0.x, pt0.y, pt0.z, 1.0f},
-		{pt1.x, pt1.y, pt1.z, 1.0f},
-		{pt2.x, pt2.y, pt2.z, 1.0f},
-		{pt3.x, pt3.y, pt3.z, 1.0f}
-	};
-
-	glm::vec4 T = { t * t * t, t * t, t, 1.0f };
-	glm::vec4 result = G * M * T;
-	return Pnt3f(result[0], result[1], result[2]);
-
 }
 
 float points[][3] = {
@@ -1384,186 +1248,66 @@ void TrainView::drawCube(bool doingShadows) {
 	}
 }
 
-void TrainView::drawTrain(bool doingShadows, float backward_distance, bool head) {
+//************************************************************************
+//
+// * a loaded car model, fitted to the car's box: as wide and as long as
+//   it can be without changing its shape, centred, and sitting on the
+//   bottom. its arrays go straight from the mapped file to GL
+//========================================================================
+void TrainView::
+drawCarModel(const CarModel& model, bool doingShadows)
+//========================================================================
+{
+	const Pnt3f& lo = model.boundsMin();
+	const Pnt3f& hi = model.boundsMax();
+	Pnt3f extent = hi - lo;
+	float size = extent.x;
+	if (extent.y > size)
+		size = extent.y;
+	if (extent.z > size)
+		size = extent.z;
+	if (size <= 0)
+		return;
+
+	glPushMatrix();
+	glPushAttrib(GL_ENABLE_BIT);
+	// the scaling would change the length of the normals
+	glEnable(GL_NORMALIZE);
+	glTranslatef(0.5f, 0, 0.5f);
+	glScalef(1 / size, 1 / size, 1 / size);
+	glTranslatef(-(lo.x + hi.x) / 2, -lo.y, -(lo.z + hi.z) / 2);
+
+	const CarVertex* v = model.vertices();
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glVertexPointer(3, GL_FLOAT, sizeof(CarVertex), &v->pos);
+	glNormalPointer(GL_FLOAT, sizeof(CarVertex), &v->normal);
+	glDrawElements(GL_TRIANGLES, (GLsizei) model.numIndices(),
+						model.indexSize() == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT,
+						model.indices());
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	perf.addDrawCalls(1, (int) model.numIndices());
+
+	glPopAttrib();
+	glPopMatrix();
+}
+
+void TrainView::drawTrain(const CompiledTrack& track, bool doingShadows, float backward_distance, bool head) {
+	TRACE_SCOPE("drawTrain");
+
 	Pnt3f qt;
 	Pnt3f forward;
 	Pnt3f right;
 	Pnt3f up;
-	// set start_point for arc-length
-	
-	float local_current_length = current_length - backward_distance;
-
-	int local_start_point = 0;
-	
-	if (local_current_length < 0) {
-		local_current_length += copy_list_qt.size() - 1;
-	}
-	if (!head) {
-		//std::cout << "passenger" << local_current_length << std::endl;
-	}
-
-	
-	for (int i = 0; i < copy_list_sum_track_length.size(); i++) {
-		if ((int)(local_current_length / copy_list_sum_track_length[i]) >= 1) {
-			//std::cout << "I checked" << std::endl;
-			local_start_point = (i + 1) % (copy_list_sum_track_length.size());
-		}
-
-	}
-
-	//std::cout << "this start point" << local_start_point << std::endl;
-	//std::cout << "local_current_length: " << local_current_length << " total_length: " << copy_list_sum_track_length[3] << "size: " << copy_list_sum_track_length.size() <<  std::endl;
-	//std::cout << copy_list_sum_track_length[0] << " " << copy_list_sum_track_length[1] << " " << copy_list_sum_track_length[2] << " " << copy_list_sum_track_length[3] << std::endl;
-
-	
-	if (tw->splineBrowser->value() == 1) {
-
-		if (tw->arcLength->value()) {
-
-			Pnt3f train_cp_pos_p1 = m_pTrack->points[local_start_point % m_pTrack->points.size()].pos;
-			Pnt3f train_cp_pos_p2 = m_pTrack->points[(local_start_point + 1) % m_pTrack->points.size()].pos;
-
-			Pnt3f train_cp_orient_p1 = m_pTrack->points[local_start_point % m_pTrack->points.size()].orient;
-			Pnt3f train_cp_orient_p2 = m_pTrack->points[(local_start_point + 1) % m_pTrack->points.size()].orient;
-
-			float train_percentage;
-			if (local_start_point == 0) {
-				train_percentage = local_current_length / copy_list_sum_track_length[0];
-			}
-			else {
-				train_percentage = (local_current_length - copy_list_sum_track_length[local_start_point - 1]) / (copy_list_sum_track_length[local_start_point] - copy_list_sum_track_length[local_start_point - 1]);
-			}
-
-			qt = train_cp_pos_p2 * train_percentage + train_cp_pos_p1 * (1 - train_percentage);
-			Pnt3f qt1 = train_cp_pos_p2 * (train_percentage + 0.0001) + train_cp_pos_p1 * (1 - train_percentage - 0.0001);
-
-			forward = qt1 - qt;
-			forward.normalize();
-			Pnt3f orient = train_cp_orient_p2 * (train_percentage)+train_cp_orient_p1 * (1 - train_percentage);
-			orient.normalize();
-
-			right = forward * orient;
-			right.normalize();
-			up = right * forward;
-			up.normalize();
-		}
-		else {
-			//	without arc-length
-			Pnt3f train_cp_pos_p1 = m_pTrack->points[(int)t_time].pos;
-			Pnt3f train_cp_pos_p2 = m_pTrack->points[((int)t_time + 1) % m_pTrack->points.size()].pos;
-
-			Pnt3f train_cp_orient_p1 = m_pTrack->points[(int)t_time].orient;
-			Pnt3f train_cp_orient_p2 = m_pTrack->points[((int)t_time + 1) % m_pTrack->points.size()].orient;
-
-			float train_percentage = t_time - (int)t_time;
-			qt = train_cp_pos_p2 * train_percentage + train_cp_pos_p1 * (1 - train_percentage);
-			Pnt3f qt1 = train_cp_pos_p2 * (train_percentage + 0.0001) + train_cp_pos_p1 * (1 - train_percentage - 0.0001);
-
-			forward = qt1 - qt;
-			forward.normalize();
-			Pnt3f orient = train_cp_orient_p2 * (train_percentage) + train_cp_orient_p1 * (1- train_percentage);
-			orient.normalize();
-
-			right = forward * orient;
-			right.normalize();
-			up = right * forward;
-			up.normalize();
-			
-		}
-	}
-
-	if (tw->splineBrowser->value() >= 2) {
-
-		if (tw->arcLength->value()) {
-			
-			
-			Pnt3f train_cp_pos_p1 = m_pTrack->points[local_start_point % m_pTrack->points.size()].pos;
-			Pnt3f train_cp_pos_p2 = m_pTrack->points[(local_start_point + 1) % m_pTrack->points.size()].pos;
-			Pnt3f train_cp_pos_p3 = m_pTrack->points[(local_start_point + 2) % m_pTrack->points.size()].pos;
-			Pnt3f train_cp_pos_p4 = m_pTrack->points[(local_start_point + 3) % m_pTrack->points.size()].pos;
-
-			
-			Pnt3f train_cp_orient_p1 = m_pTrack->points[local_start_point % m_pTrack->points.size()].orient;
-			Pnt3f train_cp_orient_p2 = m_pTrack->points[(local_start_point + 1) % m_pTrack->points.size()].orient;
-			Pnt3f train_cp_orient_p3 = m_pTrack->points[(local_start_point + 2) % m_pTrack->points.size()].orient;
-			Pnt3f train_cp_orient_p4 = m_pTrack->points[(local_start_point + 3) % m_pTrack->points.size()].orient;
-			
-		
-			
-			double train_percentage;
-			if (local_start_point == 0) {
-				train_percentage = local_current_length / copy_list_sum_track_length[0];
-			}
-			else {
-				if (copy_list_sum_track_length.size() > local_start_point) {
-					train_percentage = ((local_current_length - copy_list_sum_track_length[local_start_point - 1]) / (copy_list_sum_track_length[local_start_point] - copy_list_sum_track_length[local_start_point - 1]));
-					//std::cout << "here" << std::endl;
-					//std::cout << "train: " << train_percentage << std::endl;
-				}
-				else {
-					std::cout << "copy: " << copy_list_sum_track_length.size()  << " local_start_point " << local_start_point << std::endl;
-					train_percentage = 0;
-				}
-			}
-
-			
-			Pnt3f qt1;
-
-			if (local_current_length < copy_list_qt.size() - 1) {
-				qt = copy_list_qt[local_current_length];
-				qt1 = copy_list_qt[local_current_length + 1];
-			}
-			else {
-				//std::cout << local_current_length << std::endl;
-				if (head)
-					current_length = 0;
-				qt = copy_list_qt[0];
-				qt1 = copy_list_qt[1];
-			}
-
-
-			Pnt3f orient = GMT(train_cp_orient_p1, train_cp_orient_p2, train_cp_orient_p3, train_cp_orient_p4, train_percentage, tw->splineBrowser->value());
 
-			forward = qt1 - qt;
-
-			forward.normalize();
-			orient.normalize();
-
-			right = forward * orient;
-			right.normalize();
-			up = right * forward;
-			up.normalize();
-			
-			
-		}
-		else {
-			Pnt3f train_cp_pos_p1 = m_pTrack->points[(int)t_time].pos;
-			Pnt3f train_cp_pos_p2 = m_pTrack->points[((int)t_time + 1) % m_pTrack->points.size()].pos;
-			Pnt3f train_cp_pos_p3 = m_pTrack->points[((int)t_time + 2) % m_pTrack->points.size()].pos;
-			Pnt3f train_cp_pos_p4 = m_pTrack->points[((int)t_time + 3) % m_pTrack->points.size()].pos;
-
-			Pnt3f train_cp_orient_p1 = m_pTrack->points[(int)t_time].orient;
-			Pnt3f train_cp_orient_p2 = m_pTrack->points[((int)t_time + 1) % m_pTrack->points.size()].orient;
-			Pnt3f train_cp_orient_p3 = m_pTrack->points[((int)t_time + 2) % m_pTrack->points.size()].orient;
-			Pnt3f train_cp_orient_p4 = m_pTrack->points[((int)t_time + 3) % m_pTrack->points.size()].orient;
-
-			qt = GMT(train_cp_pos_p1, train_cp_pos_p2, train_cp_pos_p3, train_cp_pos_p4, t_time - (int)t_time, tw->splineBrowser->value());
-			Pnt3f qt1 = GMT(train_cp_pos_p1, train_cp_pos_p2, train_cp_pos_p3, train_cp_pos_p4, t_time - (int)t_time + 0.0001, tw->splineBrowser->value());
-
-			Pnt3f orient = GMT(train_cp_orient_p1, train_cp_orient_p2, train_cp_orient_p3, train_cp_orient_p4, t_time - (int)t_time, tw->splineBrowser->value());
-
-			forward = qt1 - qt;
-
-			forward.normalize();
-			orient.normalize();
-
-			right = forward * orient;
-			right.normalize();
-			up = right * forward;
-			up.normalize();
+	// the cars are behind the engine - wrapping around the end of the track
+	float local_current_length = current_length - backward_distance;
+	if (local_current_length < 0)
+		local_current_length += track.totalLength;
 
-		}
-	}
+	if (!locateCar(track, backward_distance, qt, forward, right, up))
+		return;
 
 	float rotation[16] = {
 	forward.x, forward.y, forward.z, 0.0,
@@ -1610,6 +1354,26 @@ void TrainView::drawTrain(bool doingShadows, float backward_distance, bool head)
 	glMultMatrixf(rotation);
 	glScalef(5.0f, 5.0f, 5.0f);
 	glTranslatef(-0.5f, 1, -0.5f);
+
+	// a loaded model takes the place of the whole car, wheels and all;
+	// while it's still loading, the car is just a cube
+	const CarModel* model = head ? tw->engineModel.get() : tw->carModel.get();
+	bool loading = head ? tw->engineModelLoading : tw->carModelLoading;
+	if (model || loading) {
+		if (model) {
+			if (!doingShadows) {
+				if (head)
+					glColor3f(0.5, 0, 0.5);
+				else
+					glColor3f(0.3f, 0.3f, 0.3f);
+			}
+			drawCarModel(*model, doingShadows);
+		} else
+			drawCube(doingShadows);
+		glPopMatrix();
+		return;
+	}
+
 	if (head) {
 		drawCube(doingShadows);
 	}
@@ -1620,10 +1384,10 @@ void TrainView::drawTrain(bool doingShadows, float backward_distance, bool head)
 	if (head) {
 		if (!doingShadows)
 			glColor3f(0.5, 0, 0);
-		gluCylinder(gluNewQuadric(), 0.5, 0.5, 2, 50, 1);
+		gluCylinder(quadric, 0.5, 0.5, 2, 50, 1);
 		if (!doingShadows)
 			glColor3f(0.5, 0, 0.5);
-		gluDisk(gluNewQuadric(), 0.0, 0.5, 64, 1);
+		gluDisk(quadric, 0.0, 0.5, 64, 1);
 	}
 
 	//back splash
@@ -1683,7 +1447,7 @@ void TrainView::drawTrain(bool doingShadows, float backward_distance, bool head)
 	if (head) {
 		if (!doingShadows)
 			glColor3f(1, 1, 0);
-		gluDisk(gluNewQuadric(), 0.0, 0.5, 64, 1);
+		gluDisk(quadric, 0.0, 0.5, 64, 1);
 	}
 
 
@@ -1713,8 +1477,8 @@ void TrainView::drawTrain(bool doingShadows, float backward_distance, bool head)
 	
 	glTranslatef(0,0,-0.7);
 	glMultMatrixf(rotation_wheel_z);
-	gluCylinder(gluNewQuadric(), 0.3, 0.3, 0.5, 50, 1);
-	gluDisk(gluNewQuadric(), 0.0, 0.3, 64, 1);
+	gluCylinder(quadric, 0.3, 0.3, 0.5, 50, 1);
+	gluDisk(quadric, 0.0, 0.3, 64, 1);
 
 
 	glTranslatef(0, 0, -0.05);
@@ -1738,8 +1502,8 @@ void TrainView::drawTrain(bool doingShadows, float backward_distance, bool head)
 
 	glTranslatef(1, 0, -0.7);
 	glMultMatrixf(rotation_wheel_z);
-	gluCylinder(gluNewQuadric(), 0.3, 0.3, 0.5, 50, 1);
-	gluDisk(gluNewQuadric(), 0.0, 0.3, 64, 1);
+	gluCylinder(quadric, 0.3, 0.3, 0.5, 50, 1);
+	gluDisk(quadric, 0.0, 0.3, 64, 1);
 
 
 	glTranslatef(0, 0, -0.05);
@@ -1762,9 +1526,9 @@ void TrainView::drawTrain(bool doingShadows, float backward_distance, bool head)
 
 	glTranslatef(0, 0, 0.2);
 	glMultMatrixf(rotation_wheel_z);
-	gluCylinder(gluNewQuadric(), 0.3, 0.3, 0.5, 50, 1);
+	gluCylinder(quadric, 0.3, 0.3, 0.5, 50, 1);
 	glTranslatef(0, 0, 0.5);
-	gluDisk(gluNewQuadric(), 0.0, 0.3, 64, 1);
+	gluDisk(quadric, 0.0, 0.3, 64, 1);
 
 	glTranslatef(0, 0, 0.05);
 	glBegin(GL_LINES);
@@ -1790,9 +1554,9 @@ void TrainView::drawTrain(bool doingShadows, float backward_distance, bool head)
 
 	glTranslatef(1, 0, 0.2);
 	glMultMatrixf(rotation_wheel_z);
-	gluCylinder(gluNewQuadric(), 0.3, 0.3, 0.5, 50, 1);
+	gluCylinder(quadric, 0.3, 0.3, 0.5, 50, 1);
 	glTranslatef(0, 0, 0.5);
-	gluDisk(gluNewQuadric(), 0.0, 0.3, 64, 1);
+	gluDisk(quadric, 0.0, 0.3, 64, 1);
 
 
 	glTranslatef(0, 0, 0.05);
@@ -1805,7 +1569,12 @@ void TrainView::drawTrain(bool doingShadows, float backward_distance, bool head)
 	glEnd();
 	glPopMatrix();
 
-
+	// what we just sent: the splash quads, then four wheels that are a
+	// cylinder strip, a disk fan and a spoke line each - the head also has
+	// the cube, the boiler and its two end disks
+	perf.addDrawCalls(6 + 4 * 3, 6 * 4 + 4 * (102 + 66 + 2));
+	if (head)
+		perf.addDrawCalls(6 + 3, 6 * 4 + 102 + 66 + 66);
 
 	/*
 	glBegin(GL_QUADS); //front
@@ -1919,7 +1688,8 @@ drawPlane(float* qt) {
 //
 // * this tries to see which control point is under the mouse
 //	  (for when the mouse is clicked)
-//		it uses OpenGL picking - which is always a trick
+//		the mouse ray is tested against the points (and the cars) on the
+//		CPU - see Picking.H - and the nearest thing it hits is picked
 //########################################################################
 // TODO: 
 //		if you want to pick things other than control points, or you
@@ -1930,51 +1700,72 @@ void TrainView::
 doPick()
 //========================================================================
 {
-	// since we'll need to do some GL stuff so we make this window as 
-	// active window
-	make_current();		
+	TRACE_SCOPE("doPick");
 
-	// where is the mouse?
-	int mx = Fl::event_x(); 
-	int my = Fl::event_y();
+	// getMouseLine unprojects with the current matrices, so put the view
+	// back the way it's drawn
+	make_current();
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	setProjection();
 
-	// get the viewport - most reliable way to turn mouse coords into GL coords
-	int viewport[4];
-	glGetIntegerv(GL_VIEWPORT, viewport);
+	double r1x, r1y, r1z, r2x, r2y, r2z;
+	if (!getMouseLine(r1x, r1y, r1z, r2x, r2y, r2z)) {
+		selectedCube = -1;
+		return;
+	}
+	Pnt3f origin((float) r1x, (float) r1y, (float) r1z);
+	Pnt3f dir = Pnt3f((float) r2x, (float) r2y, (float) r2z) - origin;
 
-	// Set up the pick matrix on the stack - remember, FlTk is
-	// upside down!
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity ();
-	gluPickMatrix((double)mx, (double)(viewport[3]-my), 
-						5, 5, viewport);
+	// shift click moves the train instead
+	if (Fl::event_state() & FL_SHIFT) {
+		placeTrainAtMouse(origin, dir);
+		return;
+	}
 
-	// now set up the projection
-	setProjection();
+	// a few pixels off still counts, as it did with GL_SELECT
+	PickPad pad = mousePad(PICK_PIXELS);
+
+	PickHit hit;
+	pointPicker.pick(m_pTrack->points, origin, dir, hit, pad);
 
-	// now draw the objects - but really only see what we hit
-	GLuint buf[100];
-	glSelectBuffer(100,buf);
-	glRenderMode(GL_SELECT);
-	glInitNames();
-	glPushName(0);
-
-	// draw the cubes, loading the names as we go
-	for(size_t i=0; i<m_pTrack->points.size(); ++i) {
-		glLoadName((GLuint) (i+1));
-		m_pTrack->points[i].draw();
+	// the cars are in the way of what's behind them (unless we're riding
+	// in the train, when they aren't drawn)
+	TrackSnapshot track = tw->trackStore.current();
+	if (track && !tw->trainCam->value()) {
+		vector<TrainCar> cars;
+		placeTrain(*track, cars);
+		pickCar(cars, origin, dir, hit, pad);
 	}
 
-	// go back to drawing mode, and see how picking did
-	int hits = glRenderMode(GL_RENDER);
-	if (hits) {
-		// warning; this just grabs the first object hit - if there
-		// are multiple objects, you really want to pick the closest
-		// one - see the OpenGL manual 
-		// remember: we load names that are one more than the index
-		selectedCube = buf[3]-1;
-	} else // nothing hit, nothing selected
+	if (hit.kind == PICK_POINT)
+		selectedCube = hit.index;
+	else // nothing hit (or not a point), nothing selected
 		selectedCube = -1;
 
 	printf("Selected Cube %d\n",selectedCube);
+}
+
+//************************************************************************
+//
+// * the train goes to the place on the track nearest where the mouse ray
+//   passes over it (within TRACK_PICK_RADIUS of the middle rail)
+//========================================================================
+bool TrainView::
+placeTrainAtMouse(const Pnt3f& origin, const Pnt3f& dir)
+//========================================================================
+{
+	TrackSnapshot track = tw->trackStore.current();
+	trackIndex.update(track);
+
+	TrackHit hit;
+	if (!track || !trackIndex.raycast(origin, dir, TRACK_PICK_RADIUS, hit, PICK_NEAR_T))
+		return false;
+
+	// the train is either so far along the track, or so many segments
+	// along it, depending on arc length
+	current_length = hit.along;
+	t_time = (hit.step + hit.u) / (float) track->divide;
+	damage(1);
+	return true;
 }
\ No newline at end of file
@@ -27,7 +27,9 @@
 
 #include <FL/fl.h>
 #include <FL/Fl_Box.h>
+#include <Fl/fl_ask.h>
 #include<iostream>
+#include <string.h>
 
 // for using the real time clock
 #include <time.h>
@@ -35,6 +37,8 @@
 #include "TrainWindow.H"
 #include "TrainView.H"
 #include "CallBacks.H"
+#include "TrackIO.H"
+#include "Utilities/Trace.H"
 
 
 
@@ -44,7 +48,13 @@
 //========================================================================
 TrainWindow::
 TrainWindow(const int x, const int y) 
-	: Fl_Double_Window(x,y,800,600,"Train and Roller Coaster")
+	: Fl_Double_Window(x,y,800,600,"Train and Roller Coaster"),
+	  compiler(trackStore, (TrackCompiler::ReadyCallback) trackReadyCB, this),
+	  trackWatcher((FileWatcher::ChangedCallback) trackFileWatchCB, this),
+	  loader((TrackLoader::ProgressCallback) trackStreamCB, this),
+	  streaming(false), streamShown(false),
+	  engineModelLoading(false), carModelLoading(false), trackLoadSerial(0),
+	  physicsTime(0), replayTick(0)
 //========================================================================
 {
 	// make all of the widgets
@@ -107,7 +117,7 @@ TrainWindow(const int x, const int y)
 		// TODO: make sure these choices are the same as what the code supports
 		splineBrowser = new Fl_Browser(605,pty,120,75,"Spline Type");
 		splineBrowser->type(2);		// select
-		splineBrowser->callback((Fl_Callback*)damageCB,this);
+		splineBrowser->callback((Fl_Callback*)trackChangedCB,this);
 		splineBrowser->add("Linear");
 		splineBrowser->add("Cardinal Cubic");
 		splineBrowser->add("Cubic B-Spline");
@@ -147,14 +157,27 @@ TrainWindow(const int x, const int y)
 		tension->value(0.5);
 		tension->align(FL_ALIGN_LEFT);
 		tension->type(FL_HORIZONTAL);
+		tension->callback((Fl_Callback*)trackChangedCB,this);
 
-		pty += 50;
+		// how long the blocks are, with Blocks on
+		pty += 25;
+		blockLength = new Fl_Value_Slider(655, pty, 140, 20, "block");
+		blockLength->range(20, 400);
+		blockLength->step(10);
+		blockLength->value(100);
+		blockLength->align(FL_ALIGN_LEFT);
+		blockLength->type(FL_HORIZONTAL);
+
+		pty += 25;
 		Fl_Button* button_add_num_car = new Fl_Button(605, pty, 50, 20, "+ car");
 		button_add_num_car->callback((Fl_Callback*)button_add_num_carCB, this);
 
 		Fl_Button* button_minus_num_car = new Fl_Button(665, pty, 50, 20, "- car");
 		button_minus_num_car->callback((Fl_Callback*)button_minus_num_carCB, this);
 
+		physicsButton = new Fl_Button(725, pty, 70, 20, "Physics");
+		togglify(physicsButton, 0);
+
 		pty += 30;
 		rail_parallel = new Fl_Button(605, pty, 65, 20, "Parallel");
 		togglify(rail_parallel, 0);
@@ -162,7 +185,8 @@ TrainWindow(const int x, const int y)
 		rail_tile = new Fl_Button(675, pty, 30, 20, "Tile");
 		togglify(rail_tile, 0);
 
-		
+		gforceButton = new Fl_Button(710, pty, 40, 20, "Gs");
+		togglify(gforceButton, 0);
 		
 		rail_support = new Fl_Button(755, pty, 30, 20, "Sup");
 		togglify(rail_support, 0);
@@ -173,6 +197,8 @@ TrainWindow(const int x, const int y)
 
 		rail_tunnel = new Fl_Button(675, pty, 65, 20, "tunnel");
 		togglify(rail_tunnel, 0);
+		liftButton = new Fl_Button(745, pty, 50, 20, "Lift");
+		togglify(liftButton, 0);
 		
 		pty += 30;
 		tunnel_length = new Fl_Value_Slider(655, pty, 140, 20, "tunnel");
@@ -181,6 +207,53 @@ TrainWindow(const int x, const int y)
 		tunnel_length->align(FL_ALIGN_LEFT);
 		tunnel_length->type(FL_HORIZONTAL);
 
+		pty += 30;
+		hudButton = new Fl_Button(605, pty, 65, 20, "HUD");
+		togglify(hudButton, 0);
+		Fl_Button* exportb = new Fl_Button(675, pty, 65, 20, "Export");
+		exportb->callback((Fl_Callback*) exportCB, this);
+		clearanceButton = new Fl_Button(745, pty, 50, 20, "Check");
+		togglify(clearanceButton, 0);
+
+		// only shown while a big track is loading
+		pty += 30;
+		loadProgress = new Fl_Progress(605, pty, 125, 20);
+		loadProgress->minimum(0);
+		loadProgress->maximum(1);
+		loadProgress->selection_color(FL_BLUE);
+		loadProgress->hide();
+		cancelLoadButton = new Fl_Button(735, pty, 60, 20, "Cancel");
+		cancelLoadButton->callback((Fl_Callback*)cancelLoadCB, this);
+		cancelLoadButton->hide();
+
+		// more trains on this track, and more copies of it
+		pty += 30;
+		Fl_Button* addTrain = new Fl_Button(605, pty, 55, 20, "+ train");
+		addTrain->callback((Fl_Callback*)addTrainCB, this);
+		Fl_Button* addCoaster = new Fl_Button(665, pty, 70, 20, "+ coaster");
+		addCoaster->callback((Fl_Callback*)addCoasterCB, this);
+		Fl_Button* clearWorld = new Fl_Button(740, pty, 55, 20, "Clear");
+		clearWorld->callback((Fl_Callback*)clearWorldCB, this);
+
+		pty += 30;
+		signalButton = new Fl_Button(605, pty, 65, 20, "Blocks");
+		togglify(signalButton, 0);
+		sidingButton = new Fl_Button(675, pty, 65, 20, "Siding");
+		togglify(sidingButton, 0);
+		recordButton = new Fl_Button(745, pty, 50, 20, "Rec");
+		togglify(recordButton, 0);
+		recordButton->callback((Fl_Callback*)recordCB, this);
+
+		// playing a recording back, and seeking in it
+		pty += 30;
+		replayButton = new Fl_Button(605, pty, 55, 20, "Replay");
+		togglify(replayButton, 0);
+		replayButton->callback((Fl_Callback*)replayCB, this);
+		replaySlider = new Fl_Value_Slider(665, pty, 130, 20);
+		replaySlider->type(FL_HORIZONTAL);
+		replaySlider->range(0, 0);
+		replaySlider->callback((Fl_Callback*)replaySeekCB, this);
+
 
 		
 
@@ -200,6 +273,13 @@ TrainWindow(const int x, const int y)
 
 	// set up callback on idle
 	Fl::add_idle((void (*)(void*))runButtonCB,this);
+
+	// the car models can take a while (cooking one takes seconds), so
+	// they come in on the asset loader while the first frames go up
+	loadCarModel(ENGINE_MODEL_FILE, engineModel, engineModelLoading);
+	loadCarModel(CAR_MODEL_FILE, carModel, carModelLoading);
+
+	trackChanged();
 }
 
 //************************************************************************
@@ -229,6 +309,363 @@ damageMe()
 	trainView->damage(1);
 }
 
+//************************************************************************
+//
+// * the track was edited - have it compiled again. until the new version
+//   is ready, everything keeps using the old one
+//========================================================================
+void TrainWindow::
+trackChanged(bool useCache)
+//========================================================================
+{
+	compiler.request(m_Track.points, splineBrowser->value(),
+		(float) tension->value(), trainView->DIVIDE_LINE, useCache);
+	damageMe();
+}
+
+//************************************************************************
+//
+// * a track was loaded. skip compiling it if the file had it compiled
+//   already - unless the compiler is still working on an older request,
+//   which would replace this when it finished
+//========================================================================
+void TrainWindow::
+trackLoaded(const TrackSnapshot& compiled)
+//========================================================================
+{
+	if (compiled && !compiler.busy() &&
+		 compiled->splineType == splineBrowser->value() &&
+		 compiled->tension == (float) tension->value() &&
+		 compiled->divide == trainView->DIVIDE_LINE) {
+		trackStore.publish(compiled);
+		damageMe();
+	} else
+		trackChanged(true);
+}
+
+//************************************************************************
+//
+// * only the points that differ are copied over, and if none do (the file
+//   was just touched, or it was our own save) nothing gets compiled. if
+//   it doesn't read, it's probably still being written, and we'll hear
+//   about it again. the editor may still be writing it, so it's read, not
+//   mapped
+//========================================================================
+void TrainWindow::
+reloadTrack()
+//========================================================================
+{
+	const std::string& file = trackWatcher.file();
+	if (file.empty())
+		return;
+
+	vector<ControlPoint> points;
+	TrackIOError error;
+	if (!readTrackFile(file.c_str(), points, error, 0, true))
+		return;
+
+	size_t changed = 0;
+	if (points.size() == m_Track.points.size()) {
+		for (size_t i = 0; i < points.size(); ++i) {
+			if (memcmp(&points[i], &m_Track.points[i], sizeof(ControlPoint))) {
+				m_Track.points[i] = points[i];
+				changed++;
+			}
+		}
+	} else {
+		m_Track.points.swap(points);
+		changed = m_Track.points.size();
+	}
+	if (changed)
+		trackChanged();
+}
+
+//************************************************************************
+//
+// *
+//========================================================================
+void TrainWindow::
+streamTrack(const char* filename)
+//========================================================================
+{
+	if (streaming)
+		cancelStream();
+	trackWatcher.stop();
+	trackLoadSerial++;
+
+	streamBackup = m_Track.points;
+	streamPending.clear();
+	streamShown = false;
+	streaming = true;
+	loader.start(filename);
+
+	loadProgress->value(0);
+	loadProgress->show();
+	cancelLoadButton->show();
+}
+
+//************************************************************************
+//
+// * the old track stays up until there's enough of the new one to draw;
+//   after that the new points go straight onto the track, and it gets
+//   compiled again (only the new segments are tessellated)
+//========================================================================
+bool TrainWindow::
+streamProgress(TrackIOError& error)
+//========================================================================
+{
+	// a wake up from before a cancel
+	if (!streaming)
+		return true;
+
+	bool finished, ok;
+	loader.takePoints(streamPending, finished, ok, error);
+	loadProgress->value(loader.progress());
+
+	if (finished && !ok) {
+		cancelStream();
+		return false;
+	}
+
+	bool grew = false;
+	if (streamShown || streamPending.size() >= MIN_TRACK_POINTS) {
+		if (!streamShown) {
+			m_Track.points.clear();
+			m_Track.trainU = 0;
+			streamShown = true;
+		}
+		m_Track.points.insert(m_Track.points.end(), streamPending.begin(), streamPending.end());
+		grew = !streamPending.empty();
+		streamPending.clear();
+	}
+
+	if (finished) {
+		streaming = false;
+		streamBackup.clear();
+		loadProgress->hide();
+		cancelLoadButton->hide();
+		trackChanged(true);
+		trackWatcher.watch(loader.file().c_str());
+	} else if (grew)
+		trackChanged();
+	return true;
+}
+
+//************************************************************************
+//
+// *
+//========================================================================
+void TrainWindow::
+cancelStream()
+//========================================================================
+{
+	if (!streaming)
+		return;
+	loader.cancel();
+	streaming = false;
+
+	if (streamShown) {
+		m_Track.points.swap(streamBackup);
+		trackChanged();
+	}
+	streamBackup.clear();
+	streamPending.clear();
+	streamShown = false;
+
+	loadProgress->hide();
+	cancelLoadButton->hide();
+	damageMe();
+}
+
+//************************************************************************
+//
+// * the points are read on the loader; the track is only touched here, on
+//   the UI thread, once they're all in
+//========================================================================
+void TrainWindow::
+loadTrack(const char* filename)
+//========================================================================
+{
+	cancelStream();
+
+	struct Loaded {
+		vector<ControlPoint>	points;
+		TrackSnapshot			compiled;
+	};
+	std::shared_ptr<Loaded> loaded = std::make_shared<Loaded>();
+	std::string file = filename;
+	unsigned serial = ++trackLoadSerial;
+
+	assets.request(ASSET_PRIORITY_TRACK, "loadTrack",
+		[loaded, file](TrackIOError& error) {
+			return readTrackFile(file.c_str(), loaded->points, error, &loaded->compiled);
+		},
+		[this, loaded, file, serial](bool ok, const TrackIOError& error) {
+			// another load (or a stream) was started since
+			if (serial != trackLoadSerial)
+				return;
+			if (!ok) {
+				fl_alert("Can't load the track\n%s", error.message);
+				return;
+			}
+			m_Track.points.swap(loaded->points);
+			m_Track.trainU = 0;
+			trackLoaded(loaded->compiled);
+			trackWatcher.watch(file.c_str());
+		});
+}
+
+//************************************************************************
+//
+// * a model that isn't there isn't a problem - the built-in car is drawn
+//========================================================================
+void TrainWindow::
+loadCarModel(const char* filename, std::shared_ptr<const CarModel>& model, bool& loading)
+//========================================================================
+{
+	std::shared_ptr<CarModel> loaded = std::make_shared<CarModel>();
+	std::string file = filename;
+	loading = true;
+
+	assets.request(ASSET_PRIORITY_MODEL, "loadCarModel",
+		[loaded, file](TrackIOError& error) {
+			return loaded->load(file.c_str(), error);
+		},
+		[this, loaded, &model, &loading](bool ok, const TrackIOError&) {
+			loading = false;
+			if (ok)
+				model = loaded;
+			damageMe();
+		});
+}
+
+//************************************************************************
+//
+// * without physics, the train goes speed / 2 a tick, 30 ticks a second
+//========================================================================
+bool TrainWindow::
+updateAnalysis()
+//========================================================================
+{
+	TrackSnapshot track = trackStore.current();
+	PhysicsOptions options;
+	options.lift = liftButton->value() != 0;
+
+	if (physicsButton->value() && arcLength->value()) {
+		physics.update(track);
+		return analysis.update(track, &physics, options, 0);
+	}
+	return analysis.update(track, 0, options, (float) speed->value() * 15);
+}
+
+//************************************************************************
+//
+// *
+//========================================================================
+void TrainWindow::
+syncWorld()
+//========================================================================
+{
+	TrackSnapshot track = trackStore.current();
+
+	// the siding runs beside the track from 40% to 60% of the way round.
+	// the switch where it leaves (the first) is set to take it, and the
+	// way round starts after the other one
+	if (sidingButton->value() && track && track->totalLength > 0) {
+		if (network.mainLine() != track) {
+			float length = track->totalLength;
+			vector<Siding> sidings(1);
+			parallelSiding(*track, 0.4f * length, 0.6f * length, SIDING_OFFSET, sidings[0]);
+			sidingRoute.reset();
+			if (network.build(track, sidings) && network.numJunctions() == 2) {
+				vector<int> switches(2, 0);
+				switches[0] = 1;
+				NetworkRoute route;
+				network.followSwitches(network.mainEdgeFrom(1), switches, route);
+				sidingRoute = network.compileRoute(route);
+			}
+		}
+		if (sidingRoute)
+			track = sidingRoute;
+	}
+
+	if (!world.numTracks())
+		world.addTrack(track, Pnt3f(0, 0, 0));
+	else
+		world.setTrack(0, track);
+}
+
+//************************************************************************
+//
+// * the cars as placeTrain puts them, and the speed the train is going:
+//   from the physics, or speed / 2 a tick, 30 ticks a second
+//========================================================================
+void TrainWindow::
+recordTick()
+//========================================================================
+{
+	TrackSnapshot track = trackStore.current();
+	if (!recorder.recording() || !track)
+		return;
+
+	recordFrame.along = trainView->current_length;
+	if (physicsButton->value() && arcLength->value() && physics.ready())
+		recordFrame.speed = trainView->current_speed;
+	else
+		recordFrame.speed = (float) speed->value() * 15;
+	trainView->placeTrain(*track, recordFrame.cars);
+	recorder.record(recordFrame);
+}
+
+//************************************************************************
+//
+// *
+//========================================================================
+bool TrainWindow::
+startReplay(const char* filename, TrackIOError& error)
+//========================================================================
+{
+	if (!replay.open(filename, error))
+		return false;
+	replaySlider->range(0, replay.duration());
+	showReplayTick(0);
+	return true;
+}
+
+//************************************************************************
+//
+// *
+//========================================================================
+void TrainWindow::
+stopReplay()
+//========================================================================
+{
+	replay.close();
+	trainView->replayFrame = 0;
+	replaySlider->range(0, 0);
+	replaySlider->value(0);
+	damageMe();
+}
+
+//************************************************************************
+//
+// * the train is left where the recording has it, so it carries on from
+//   there when the replay stops
+//========================================================================
+void TrainWindow::
+showReplayTick(size_t tick)
+//========================================================================
+{
+	if (!replay.frameAt(tick, replayFrame))
+		return;
+	replayTick = tick;
+	trainView->replayFrame = &replayFrame;
+	trainView->current_length = replayFrame.along;
+	trainView->current_speed = replayFrame.speed;
+	replaySlider->value((double) tick / RECORD_TICKS_PER_SECOND);
+	damageMe();
+}
+
 //************************************************************************
 //
 // * This will get called (approximately) 30 times per second
@@ -238,25 +675,60 @@ void TrainWindow::
 advanceTrain(float dir)
 //========================================================================
 {
+	TRACE_SCOPE("advanceTrain");
+
 	//#####################################################################
 	// TODO: make this work for your train
 	//#####################################################################
 	dir = 1.0f;
+
+	// a recording that's playing back moves the train instead, and
+	// nothing gets simulated
+	if (replay.isOpen()) {
+		showReplayTick(replayTick + 1 < replay.numTicks() ? replayTick + 1 : 0);
+		return;
+	}
+
+	// the rest of the world goes by the same clock as the train: speed / 2
+	// a tick is 30 units a second
+	bool usePhysics = physicsButton->value() && arcLength->value();
+	PhysicsOptions options;
+	options.lift = liftButton->value() != 0;
+	SignalOptions signals;
+	signals.blockLength = (float) blockLength->value();
+	syncWorld();
+	world.advance((float) speed->value() / 2 / 30, 30, usePhysics ? &options : 0,
+					  signalButton->value() ? &signals : 0);
+
+	// with physics, the speed comes from the track - the speed slider
+	// sets how fast the clock goes instead (2 is real time; this gets
+	// called 30 times a second)
+	if (usePhysics) {
+		physics.update(trackStore.current());
+		if (physics.ready()) {
+			physicsTime += (float) speed->value() / 2 / 30;
+			int steps = (int) (physicsTime / PHYSICS_STEP);
+			physicsTime -= steps * PHYSICS_STEP;
+
+			physics.advance(&trainView->current_length, &trainView->current_speed, 1, steps,
+								 options);
+			recordTick();
+			return;
+		}
+	}
+
 	trainView->t_time += (dir / m_Track.points.size() / (trainView->DIVIDE_LINE / 40)) * speed->value();
 	trainView->current_length += 1.0f * speed->value() / 2;
-	float total_length = 0;
-	// std::cout << "list size: " << tv_length_list_track_length << std::endl;
-	for (int i = 0; i < tv_length_list_track_length; i++) {
-		total_length += tv_list_track_length[i];
-	}
-	// std::cout << "total_length: " << total_length << std::endl;
-	if (trainView->current_length > total_length) {
+	TrackSnapshot track = trackStore.current();
+	float total_length = track ? track->totalLength : 0;
+	if (trainView->current_length >= total_length) {
 		trainView->current_length = 0;
 	}
 	// std::cout << "current_length: " << trainView->current_length << std::endl;
 
 	if (trainView->t_time > trainView->m_pTrack->points.size())
 		trainView->t_time -= trainView->m_pTrack->points.size();
+	recordTick();
 
 #ifdef EXAMPLE_SOLUTION
 	// note - we give a little bit more example code here than normal,
@@ -0,0 +1,429 @@
+/************************************************************************
+     File:        TrainWorld.cpp
+
+     Comment:     The tracks of the park and the trains running on them.
+						See TrainWorld.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include <math.h>
+#include <algorithm>
+
+#include "TrainWorld.H"
+#include "TrackExport.H"
+#include "Utilities/ThreadPool.H"
+#include "Utilities/Trace.H"
+
+// how many trains a task of advance or placeCars takes
+#define WORLD_GRAIN 256
+
+// the most blocks a track is cut into, however full of trains it is
+#define MAX_BLOCKS 1000000
+
+// how far a train can go when nothing is in its way
+#define NO_STOP 1e30f
+
+//****************************************************************************
+//
+// * how far on from here, going forward round a track of this length
+//============================================================================
+static inline float ahead(float from, float to, float length)
+//============================================================================
+{
+	float d = fmodf(to - from, length);
+	return d < 0 ? d + length : d;
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+SignalOptions::
+SignalOptions()
+	: blockLength(100), braking(20), margin(1)
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+TrainWorld::
+TrainWorld()
+	: pending(0)
+//============================================================================
+{
+	firstCar.push_back(0);
+}
+
+//****************************************************************************
+//
+// * a copy of a snapshot that's already down shares its physics table
+//============================================================================
+size_t TrainWorld::
+addTrack(const TrackSnapshot& track, const Pnt3f& origin)
+//============================================================================
+{
+	Track t;
+	t.track = track;
+	t.origin = origin;
+	for (size_t i = 0; i < tracks.size() && !t.physics; ++i)
+		if (track && tracks[i].track == track)
+			t.physics = tracks[i].physics;
+	if (!t.physics)
+		t.physics = std::make_shared<TrackPhysics>();
+	tracks.push_back(t);
+	return tracks.size() - 1;
+}
+
+//****************************************************************************
+//
+// * it gets a table of its own, since the old one may be shared with
+//   copies of what it was
+//============================================================================
+void TrainWorld::
+setTrack(size_t id, const TrackSnapshot& track)
+//============================================================================
+{
+	if (id >= tracks.size() || tracks[id].track == track)
+		return;
+	tracks[id].track = track;
+	tracks[id].physics = std::make_shared<TrackPhysics>();
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t TrainWorld::
+numTracks() const
+//============================================================================
+{
+	return tracks.size();
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const TrackSnapshot& TrainWorld::
+track(size_t id) const
+//============================================================================
+{
+	return tracks[id].track;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const Pnt3f& TrainWorld::
+origin(size_t id) const
+//============================================================================
+{
+	return tracks[id].origin;
+}
+
+//****************************************************************************
+//
+// * after the last train on its track, so they stay in track order
+//============================================================================
+size_t TrainWorld::
+addTrain(size_t track, float along_, int cars_)
+//============================================================================
+{
+	size_t i = std::upper_bound(trackId.begin(), trackId.end(), (uint32_t) track) - trackId.begin();
+	if (cars_ < 0)
+		cars_ = 0;
+	along.insert(along.begin() + i, along_);
+	speed.insert(speed.begin() + i, 0.0f);
+	cars.insert(cars.begin() + i, cars_);
+	trackId.insert(trackId.begin() + i, (uint32_t) track);
+
+	firstCar.resize(cars.size() + 1);
+	for (size_t t = i; t < cars.size(); ++t)
+		firstCar[t + 1] = firstCar[t] + 1 + cars[t];
+	return i;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t TrainWorld::
+numTrains() const
+//============================================================================
+{
+	return along.size();
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t TrainWorld::
+numCars() const
+//============================================================================
+{
+	return firstCar.back();
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void TrainWorld::
+clear()
+//============================================================================
+{
+	tracks.clear();
+	along.clear();
+	speed.clear();
+	cars.clear();
+	trackId.clear();
+	firstCar.assign(1, 0);
+	pending = 0;
+}
+
+//****************************************************************************
+//
+// * each track's trains (which are all together) are sorted by how far
+//   along they are, and each looks at the next one round: where its tail
+//   is, and which block that's in. if the tail is in this train's block
+//   it stops behind it; if it's in the next block it stops at the end of
+//   this one
+//============================================================================
+void TrainWorld::
+checkSignals(const SignalOptions& signals)
+//============================================================================
+{
+	TRACE_SCOPE("TrainWorld::checkSignals");
+
+	size_t n = along.size();
+	order.resize(n);
+	stopIn.assign(n, NO_STOP);
+
+	ThreadPool::shared().parallelFor(tracks.size(), 16, [&](size_t begin, size_t end) {
+		for (size_t t = begin; t < end; ++t) {
+			size_t first = std::lower_bound(trackId.begin(), trackId.end(), (uint32_t) t) - trackId.begin();
+			size_t last = std::upper_bound(trackId.begin() + first, trackId.end(), (uint32_t) t) - trackId.begin();
+			const TrackSnapshot& track = tracks[t].track;
+			if (last - first < 2 || !track || track->totalLength <= 0)
+				continue;
+
+			// one block more than there are trains, at least, or they can
+			// fill every block and none of them can move. and a train that
+			// is waiting is less than a block (and the margin) behind the
+			// tail of the next one, so with the blocks shorter than the
+			// room between the trains shared out, they can't all be
+			// waiting - one of them is always free to go
+			float length = track->totalLength;
+			int nTrains = (int) (last - first);
+			int nBlocks = (int) (length / signals.blockLength);
+			if (nBlocks < nTrains + 1)
+				nBlocks = nTrains + 1;
+			float room = length;
+			for (size_t i = first; i < last; ++i)
+				room -= cars[i] * WORLD_CAR_SPACING + WORLD_CAR_LENGTH + signals.margin;
+			if (room > 0) {
+				float need = length * nTrains / room + 1;
+				if (nBlocks < need)
+					nBlocks = need < MAX_BLOCKS ? (int) need : MAX_BLOCKS;
+			}
+			float block = length / nBlocks;
+
+			for (size_t i = first; i < last; ++i)
+				order[i] = (uint32_t) i;
+			std::sort(order.begin() + first, order.begin() + last,
+						 [&](uint32_t a, uint32_t b) { return along[a] < along[b]; });
+
+			for (size_t k = first; k < last; ++k) {
+				uint32_t i = order[k];
+				uint32_t next = order[k + 1 < last ? k + 1 : first];
+
+				float nose = along[i] + WORLD_CAR_LENGTH / 2;
+				float tail = along[next] - cars[next] * WORLD_CAR_SPACING - WORLD_CAR_LENGTH / 2;
+				float toTail = ahead(nose, tail, length);
+				float toHead = ahead(nose, along[next] + WORLD_CAR_LENGTH / 2, length);
+
+				float head = fmodf(nose, length);
+				int inBlock = (int) (head / block);
+				float toBlockEnd = (inBlock + 1) * block - head;
+
+				float stop;
+				if (toHead < toTail)
+					stop = 0;							// already running into it
+				else if (toTail < toBlockEnd)
+					stop = toTail - signals.margin;	// in the same block
+				else if (toTail < toBlockEnd + block)
+					stop = toBlockEnd - signals.margin;	// in the next block
+				else
+					continue;
+				stopIn[i] = stop > 0 ? stop : 0;
+			}
+		}
+	});
+}
+
+//****************************************************************************
+//
+// * the physics tables are brought up to date first (copies of a track
+//   share one, so it's only built once). then each task goes through its
+//   trains a run at a time - the trains on one track are next to each
+//   other - so a whole run goes to the physics in one call.
+//   with signals, a train that has to stop goes no faster than it can
+//   brake from in the distance it has, and is held where it has to stop
+//============================================================================
+void TrainWorld::
+advance(float seconds, float steadySpeed, const PhysicsOptions* physics,
+		  const SignalOptions* signals)
+//============================================================================
+{
+	TRACE_SCOPE("TrainWorld::advance");
+
+	int steps = 0;
+	if (physics) {
+		for (size_t i = 0; i < tracks.size(); ++i)
+			tracks[i].physics->update(tracks[i].track);
+		pending += seconds;
+		steps = (int) (pending / PHYSICS_STEP);
+		pending -= steps * PHYSICS_STEP;
+	}
+
+	if (signals) {
+		checkSignals(*signals);
+		before.resize(along.size());
+	}
+
+	ThreadPool::shared().parallelFor(along.size(), WORLD_GRAIN, [&](size_t begin, size_t end) {
+		size_t run = begin;
+		while (run < end) {
+			uint32_t id = trackId[run];
+			size_t runEnd = run + 1;
+			while (runEnd < end && trackId[runEnd] == id)
+				++runEnd;
+
+			const Track& t = tracks[id];
+			float length = t.track ? t.track->totalLength : 0;
+			bool usePhysics = physics && t.physics->ready();
+			if (!usePhysics && length <= 0) {
+				run = runEnd;
+				continue;
+			}
+
+			if (signals) {
+				for (size_t i = run; i < runEnd; ++i) {
+					before[i] = along[i];
+					if (stopIn[i] < NO_STOP) {
+						float limit = sqrtf(2 * signals->braking * stopIn[i]);
+						if (speed[i] > limit)
+							speed[i] = limit;
+					}
+				}
+			}
+
+			if (usePhysics)
+				t.physics->advance(&along[run], &speed[run], runEnd - run, steps, *physics);
+			else {
+				for (size_t i = run; i < runEnd; ++i) {
+					float v = steadySpeed;
+					if (signals && stopIn[i] < NO_STOP) {
+						float limit = sqrtf(2 * signals->braking * stopIn[i]);
+						if (v > limit)
+							v = limit;
+					}
+					float s = along[i] + v * seconds;
+					if (s < 0 || s >= length)
+						s = fmodf(fmodf(s, length) + length, length);
+					along[i] = s;
+					speed[i] = v;
+				}
+			}
+
+			// hold back anything that went past where it had to stop
+			if (signals) {
+				for (size_t i = run; i < runEnd; ++i) {
+					if (stopIn[i] >= NO_STOP)
+						continue;
+					float went = ahead(before[i], along[i], length);
+					if (went > stopIn[i]) {
+						along[i] = fmodf(before[i] + stopIn[i], length);
+						speed[i] = 0;
+					}
+				}
+			}
+			run = runEnd;
+		}
+	});
+}
+
+//****************************************************************************
+//
+// * a car is between two arcPoints, facing from the one to the next, and
+//   tilted by the cross vector of the step it's on - the same frame the
+//   track is drawn with
+//============================================================================
+void TrainWorld::
+placeCars(TrainCar* out, float spacing) const
+//============================================================================
+{
+	TRACE_SCOPE("TrainWorld::placeCars");
+
+	ThreadPool::shared().parallelFor(along.size(), WORLD_GRAIN, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			const Track& t = tracks[trackId[i]];
+			TrainCar* car = out + firstCar[i];
+			int nCars = cars[i] + 1;
+
+			const CompiledTrack* track = t.track.get();
+			size_t nArc = track ? track->arcPoints.size() : 0;
+			if (nArc < 2 || track->totalLength <= 0) {
+				// nowhere to be - put them all at the origin
+				for (int k = 0; k < nCars; ++k) {
+					car[k].pos = t.origin;
+					car[k].forward = Pnt3f(1, 0, 0);
+					car[k].up = Pnt3f(0, 1, 0);
+					car[k].right = Pnt3f(0, 0, 1);
+					car[k].engine = (k == 0);
+				}
+				continue;
+			}
+
+			float length = track->totalLength;
+			for (int k = 0; k < nCars; ++k) {
+				float s = along[i] - k * spacing;
+				if (s < 0 || s >= length)
+					s = fmodf(fmodf(s, length) + length, length);
+
+				size_t a = (size_t) s;
+				if (a >= nArc)
+					a = nArc - 1;
+				size_t b = (a + 1 < nArc) ? a + 1 : 0;
+				const Pnt3f& p = track->arcPoints[a];
+				const Pnt3f& q = track->arcPoints[b];
+				float f = s - a;
+
+				Pnt3f forward = q - p;
+				forward.normalize();
+
+				size_t seg = track->segmentAt(s);
+				float u = track->segmentFraction(seg, s);
+				size_t step = seg * track->divide +
+								  (size_t) (std::min(std::max(u, 0.0f), 0.999f) * track->divide);
+				Pnt3f right = track->cross[step];
+				right.normalize();
+				Pnt3f up = right * forward;
+				up.normalize();
+
+				car[k].pos = p + (q - p) * f + t.origin;
+				car[k].forward = forward;
+				car[k].right = right;
+				car[k].up = up;
+				car[k].engine = (k == 0);
+			}
+		}
+	});
+}
@@ -0,0 +1,186 @@
+/************************************************************************
+     File:        BoxTree.cpp
+
+     Comment:     A bounding volume hierarchy. See BoxTree.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include <algorithm>
+
+#include "BoxTree.H"
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+BoxTree::
+BoxTree()
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void BoxTree::
+build(const vector<Bounds>& _boxes)
+//============================================================================
+{
+	boxes = _boxes;
+	nodes.clear();
+	parents.clear();
+	dirty.clear();
+	items.resize(boxes.size());
+	leaves.resize(boxes.size());
+	if (boxes.empty())
+		return;
+
+	vector<Pnt3f> centres(boxes.size());
+	for (size_t i = 0; i < boxes.size(); ++i) {
+		items[i] = (uint32_t) i;
+		centres[i] = boxes[i].centre();
+	}
+
+	// a balanced tree has just under 2n / BOX_TREE_LEAF_SIZE nodes
+	nodes.reserve(2 * (boxes.size() / BOX_TREE_LEAF_SIZE + 1));
+	nodes.resize(1);
+	parents.resize(1);
+	buildNode(0, 0, 0, (uint32_t) boxes.size(), centres);
+}
+
+//****************************************************************************
+//
+// * split the items of a node at the median of their centres, along the
+//   side their centres are most spread out on
+//============================================================================
+void BoxTree::
+buildNode(uint32_t node, uint32_t parent, uint32_t begin, uint32_t end,
+			 const vector<Pnt3f>& centres)
+//============================================================================
+{
+	Bounds box, spread;
+	for (uint32_t i = begin; i < end; ++i) {
+		box.add(boxes[items[i]]);
+		spread.add(centres[items[i]]);
+	}
+	nodes[node].box = box;
+	parents[node] = parent;
+
+	if (end - begin <= BOX_TREE_LEAF_SIZE) {
+		nodes[node].first = begin;
+		nodes[node].count = end - begin;
+		for (uint32_t i = begin; i < end; ++i)
+			leaves[items[i]] = node;
+		return;
+	}
+
+	Pnt3f size = spread.hi - spread.lo;
+	int axis = (size.x >= size.y && size.x >= size.z) ? 0 : (size.y >= size.z) ? 1 : 2;
+	uint32_t mid = begin + (end - begin) / 2;
+	std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end,
+		[&centres, axis](uint32_t a, uint32_t b) {
+			const Pnt3f& ca = centres[a];
+			const Pnt3f& cb = centres[b];
+			return axis == 0 ? ca.x < cb.x : axis == 1 ? ca.y < cb.y : ca.z < cb.z;
+		});
+
+	uint32_t left = (uint32_t) nodes.size();
+	nodes.resize(nodes.size() + 2);
+	parents.resize(nodes.size());
+	nodes[node].first = left;
+	nodes[node].count = 0;
+	buildNode(left, node, begin, mid, centres);
+	buildNode(left + 1, node, mid, end, centres);
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void BoxTree::
+clear()
+//============================================================================
+{
+	nodes.clear();
+	parents.clear();
+	items.clear();
+	boxes.clear();
+	leaves.clear();
+	dirty.clear();
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t BoxTree::
+size() const
+//============================================================================
+{
+	return boxes.size();
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const Bounds& BoxTree::
+box(size_t item) const
+//============================================================================
+{
+	return boxes[item];
+}
+
+//****************************************************************************
+//
+// * the root's box (an empty one if there's nothing in the tree)
+//============================================================================
+Bounds BoxTree::
+bounds() const
+//============================================================================
+{
+	return nodes.empty() ? Bounds() : nodes[0].box;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void BoxTree::
+setBox(size_t item, const Bounds& box)
+//============================================================================
+{
+	boxes[item] = box;
+	dirty.push_back(leaves[item]);
+}
+
+//****************************************************************************
+//
+// * each changed leaf gets its box again from its items, and then every
+//   node above it from its children. a node above several changed leaves
+//   is just done more than once
+//============================================================================
+void BoxTree::
+refit()
+//============================================================================
+{
+	for (size_t d = 0; d < dirty.size(); ++d) {
+		uint32_t n = dirty[d];
+		Node& leaf = nodes[n];
+		Bounds box;
+		for (uint32_t i = leaf.first; i < leaf.first + leaf.count; ++i)
+			box.add(boxes[items[i]]);
+		leaf.box = box;
+
+		while (n != 0) {
+			n = parents[n];
+			Node& node = nodes[n];
+			node.box = nodes[node.first].box;
+			node.box.add(nodes[node.first + 1].box);
+		}
+	}
+	dirty.clear();
+}
@@ -0,0 +1,336 @@
+/************************************************************************
+     File:        FileWatcher.cpp
+
+     Comment:     Watches one file for changes. See FileWatcher.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include <string.h>
+
+#include "FileWatcher.H"
+#include "Trace.H"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+FileWatcher::
+FileWatcher(ChangedCallback _changed, void* _changedData)
+	: changed(_changed), changedData(_changedData)
+#ifdef _WIN32
+	, dirHandle(INVALID_HANDLE_VALUE), event(0), quitEvent(0), overlapped(0)
+#else
+	, inotifyFd(-1)
+#endif
+//============================================================================
+{
+#ifndef _WIN32
+	quitPipe[0] = quitPipe[1] = -1;
+#endif
+}
+
+//****************************************************************************
+//
+// * Destructor
+//============================================================================
+FileWatcher::
+~FileWatcher()
+//============================================================================
+{
+	stop();
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool FileWatcher::
+watch(const char* filename)
+//============================================================================
+{
+	stop();
+
+	path = filename;
+	size_t slash = path.find_last_of("/\\");
+	std::string dir = (slash == std::string::npos) ? "." : path.substr(0, slash + 1);
+	name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+
+	if (!openWatch(dir)) {
+		closeWatch();
+		path.clear();
+		name.clear();
+		return false;
+	}
+	worker = std::thread(&FileWatcher::run, this);
+	return true;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const std::string& FileWatcher::
+file() const
+//============================================================================
+{
+	return path;
+}
+
+//****************************************************************************
+//
+// * the worker: remember that the file changed, and say so once it has
+//   settled down
+//============================================================================
+void FileWatcher::
+run()
+//============================================================================
+{
+	Trace::setThreadName("FileWatcher");
+
+	bool pending = false;
+	for (;;) {
+		WaitResult r = waitForChange(pending ? FILE_WATCH_SETTLE_MS : -1);
+		if (r == WAIT_QUIT)
+			return;
+		if (r == WAIT_CHANGED)
+			pending = true;
+		else if (r == WAIT_TIMEOUT && pending) {
+			pending = false;
+			if (changed)
+				changed(changedData);
+		}
+	}
+}
+
+#ifdef _WIN32
+//****************************************************************************
+//
+// * start an overlapped read of the directory's changes
+//============================================================================
+static bool readChanges(HANDLE dir, char* buffer, DWORD size, OVERLAPPED* ov)
+//============================================================================
+{
+	return ReadDirectoryChangesW(dir, buffer, size, FALSE,
+										  FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME,
+										  0, ov, 0) != 0;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool FileWatcher::
+openWatch(const std::string& dir)
+//============================================================================
+{
+	dirHandle = CreateFileA(dir.c_str(), FILE_LIST_DIRECTORY,
+									FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+									OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, 0);
+	if (dirHandle == INVALID_HANDLE_VALUE)
+		return false;
+	event = CreateEventA(0, TRUE, FALSE, 0);
+	quitEvent = CreateEventA(0, TRUE, FALSE, 0);
+	if (!event || !quitEvent)
+		return false;
+
+	OVERLAPPED* ov = new OVERLAPPED;
+	memset(ov, 0, sizeof(*ov));
+	ov->hEvent = event;
+	overlapped = ov;
+	return readChanges(dirHandle, buffer, sizeof(buffer), ov);
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+FileWatcher::WaitResult FileWatcher::
+waitForChange(int timeoutMs)
+//============================================================================
+{
+	OVERLAPPED* ov = (OVERLAPPED*) overlapped;
+	HANDLE handles[2] = { quitEvent, event };
+	DWORD r = WaitForMultipleObjects(2, handles, FALSE,
+												timeoutMs < 0 ? INFINITE : (DWORD) timeoutMs);
+	if (r == WAIT_OBJECT_0)
+		return WAIT_QUIT;
+	if (r != WAIT_OBJECT_0 + 1)
+		return WAIT_TIMEOUT;
+
+	DWORD bytes = 0;
+	bool ours = false;
+	if (GetOverlappedResult(dirHandle, ov, &bytes, FALSE) && bytes) {
+		wchar_t wname[MAX_PATH];
+		int wlen = MultiByteToWideChar(CP_ACP, 0, name.c_str(), -1, wname, MAX_PATH) - 1;
+		const char* p = (const char*) buffer;
+		for (;;) {
+			const FILE_NOTIFY_INFORMATION* info = (const FILE_NOTIFY_INFORMATION*) p;
+			if (wlen > 0 && info->FileNameLength / sizeof(wchar_t) == (DWORD) wlen &&
+				 !_wcsnicmp(info->FileName, wname, wlen))
+				ours = true;
+			if (!info->NextEntryOffset)
+				break;
+			p += info->NextEntryOffset;
+		}
+	} else if (!bytes) {
+		// the buffer overflowed - we don't know what changed, so it
+		// might have been us
+		ours = true;
+	}
+
+	ResetEvent(event);
+	if (!readChanges(dirHandle, buffer, sizeof(buffer), ov))
+		return WAIT_QUIT;
+	return ours ? WAIT_CHANGED : WAIT_OTHER;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void FileWatcher::
+closeWatch()
+//============================================================================
+{
+	if (dirHandle != INVALID_HANDLE_VALUE) {
+		CancelIo(dirHandle);
+		if (overlapped) {
+			DWORD bytes;
+			GetOverlappedResult(dirHandle, (OVERLAPPED*) overlapped, &bytes, TRUE);
+		}
+		CloseHandle(dirHandle);
+	}
+	if (event)
+		CloseHandle(event);
+	if (quitEvent)
+		CloseHandle(quitEvent);
+	delete (OVERLAPPED*) overlapped;
+	dirHandle = INVALID_HANDLE_VALUE;
+	event = 0;
+	quitEvent = 0;
+	overlapped = 0;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void FileWatcher::
+stop()
+//============================================================================
+{
+	if (worker.joinable()) {
+		SetEvent(quitEvent);
+		worker.join();
+	}
+	closeWatch();
+	path.clear();
+	name.clear();
+}
+#else
+//****************************************************************************
+//
+// *
+//============================================================================
+bool FileWatcher::
+openWatch(const std::string& dir)
+//============================================================================
+{
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotifyFd < 0)
+		return false;
+	// written in place, or renamed over
+	if (inotify_add_watch(inotifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+		return false;
+	if (pipe(quitPipe) != 0) {
+		quitPipe[0] = quitPipe[1] = -1;
+		return false;
+	}
+	return true;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+FileWatcher::WaitResult FileWatcher::
+waitForChange(int timeoutMs)
+//============================================================================
+{
+	struct pollfd fds[2];
+	fds[0].fd = quitPipe[0];
+	fds[0].events = POLLIN;
+	fds[1].fd = inotifyFd;
+	fds[1].events = POLLIN;
+	int r = poll(fds, 2, timeoutMs);
+	if (r < 0)
+		return (errno == EINTR) ? WAIT_TIMEOUT : WAIT_QUIT;
+	if (fds[0].revents)
+		return WAIT_QUIT;
+	if (!r)
+		return WAIT_TIMEOUT;
+
+	// events come in whole, and each one is followed by its name
+	bool ours = false;
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t bytes;
+	while ((bytes = read(inotifyFd, buffer, sizeof(buffer))) > 0) {
+		for (char* p = buffer; p < buffer + bytes; ) {
+			const struct inotify_event* ev = (const struct inotify_event*) p;
+			if ((ev->mask & IN_Q_OVERFLOW) || (ev->len && name == ev->name))
+				ours = true;
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+	return ours ? WAIT_CHANGED : WAIT_OTHER;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void FileWatcher::
+closeWatch()
+//============================================================================
+{
+	if (inotifyFd >= 0)
+		close(inotifyFd);
+	if (quitPipe[0] >= 0)
+		close(quitPipe[0]);
+	if (quitPipe[1] >= 0)
+		close(quitPipe[1]);
+	inotifyFd = -1;
+	quitPipe[0] = quitPipe[1] = -1;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void FileWatcher::
+stop()
+//============================================================================
+{
+	if (worker.joinable()) {
+		char quit = 0;
+		if (write(quitPipe[1], &quit, 1) != 1) {}
+		worker.join();
+	}
+	closeWatch();
+	path.clear();
+	name.clear();
+}
+#endif
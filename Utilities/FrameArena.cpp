@@ -0,0 +1,132 @@
+/************************************************************************
+     File:        FrameArena.cpp
+
+     Comment:     A bump allocator for scratch data that only lives for
+						one frame. See FrameArena.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include "FrameArena.H"
+
+#include <stdlib.h>
+#include <new>
+
+// every overflow block starts with a link to the previous one
+struct ArenaOverflow {
+	void* next;
+};
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+FrameArena::
+FrameArena(size_t initialBytes)
+	: block(0), size(initialBytes), top(0), overflow(0), overflowBytes(0)
+//============================================================================
+{
+	block = (char*) malloc(size);
+	if (!block)
+		throw std::bad_alloc();
+}
+
+//****************************************************************************
+//
+// * Destructor
+//============================================================================
+FrameArena::
+~FrameArena()
+//============================================================================
+{
+	freeOverflow();
+	free(block);
+}
+
+//****************************************************************************
+//
+// * the arena is full - get this one from the heap and remember how much
+//   we were short so reset can grow the arena
+//============================================================================
+void* FrameArena::
+allocateOverflow(size_t bytes, size_t align)
+//============================================================================
+{
+	size_t header = (sizeof(ArenaOverflow) + align - 1) & ~(align - 1);
+	char* p = (char*) malloc(header + bytes + align);
+	if (!p)
+		throw std::bad_alloc();
+
+	((ArenaOverflow*) p)->next = overflow;
+	overflow = p;
+	overflowBytes += bytes + align;
+
+	size_t start = ((size_t) (p + header) + align - 1) & ~(align - 1);
+	return (void*) start;
+}
+
+//****************************************************************************
+//
+// * forget everything. if we overflowed this frame, make the arena big
+//   enough for the whole frame, so next time we won't
+//============================================================================
+void FrameArena::
+reset()
+//============================================================================
+{
+	if (overflow) {
+		freeOverflow();
+
+		size_t want = top + overflowBytes;
+		size_t newSize = size * 2;
+		while (newSize < want)
+			newSize *= 2;
+
+		char* bigger = (char*) malloc(newSize);
+		if (bigger) {
+			free(block);
+			block = bigger;
+			size = newSize;
+		}
+		overflowBytes = 0;
+	}
+	top = 0;
+}
+
+//****************************************************************************
+//
+// * give the overflow blocks back to the heap
+//============================================================================
+void FrameArena::
+freeOverflow()
+//============================================================================
+{
+	while (overflow) {
+		void* next = ((ArenaOverflow*) overflow)->next;
+		free(overflow);
+		overflow = next;
+	}
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t FrameArena::
+used() const
+//============================================================================
+{
+	return top + overflowBytes;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t FrameArena::
+capacity() const
+//============================================================================
+{
+	return size;
+}
@@ -0,0 +1,245 @@
+/************************************************************************
+     File:        MappedFile.cpp
+
+     Comment:     A whole file mapped read-only into memory. See
+						MappedFile.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include <stdio.h>
+
+#include "MappedFile.H"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// what an empty file "maps" to
+static const char emptyFile[1] = { 0 };
+
+// read reads this much at a time
+#define READ_CHUNK (64 * 1024)
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+MappedFile::
+MappedFile()
+	: bytes(0), length(0), opened(false)
+#ifdef _WIN32
+	, file(INVALID_HANDLE_VALUE), mapping(0)
+#endif
+//============================================================================
+{
+}
+
+//****************************************************************************
+//
+// * Destructor
+//============================================================================
+MappedFile::
+~MappedFile()
+//============================================================================
+{
+	close();
+}
+
+#ifdef _WIN32
+//****************************************************************************
+//
+// *
+//============================================================================
+bool MappedFile::
+open(const char* filename)
+//============================================================================
+{
+	close();
+
+	file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0,
+							 OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize)) {
+		close();
+		return false;
+	}
+	length = (size_t) fileSize.QuadPart;
+	opened = true;
+
+	if (!length) {
+		bytes = emptyFile;
+		return true;
+	}
+
+	mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+	if (!mapping) {
+		close();
+		return false;
+	}
+	bytes = (const char*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!bytes) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void MappedFile::
+close()
+//============================================================================
+{
+	if (bytes && bytes != emptyFile && copy.empty())
+		UnmapViewOfFile(bytes);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	bytes = 0;
+	length = 0;
+	copy.clear();
+	mapping = 0;
+	file = INVALID_HANDLE_VALUE;
+	opened = false;
+}
+#else
+//****************************************************************************
+//
+// *
+//============================================================================
+bool MappedFile::
+open(const char* filename)
+//============================================================================
+{
+	close();
+
+	int fd = ::open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		::close(fd);
+		return false;
+	}
+	length = (size_t) st.st_size;
+
+	if (!length) {
+		bytes = emptyFile;
+	} else {
+		void* p = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			::close(fd);
+			length = 0;
+			return false;
+		}
+		madvise(p, length, MADV_SEQUENTIAL);
+		bytes = (const char*) p;
+	}
+
+	// the mapping stays good after the descriptor is closed
+	::close(fd);
+	opened = true;
+	return true;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void MappedFile::
+close()
+//============================================================================
+{
+	if (bytes && bytes != emptyFile && copy.empty())
+		munmap((void*) bytes, length);
+	bytes = 0;
+	length = 0;
+	copy.clear();
+	opened = false;
+}
+#endif
+
+//****************************************************************************
+//
+// * a chunk at a time until there's no more, so it doesn't matter if the
+//   file gets longer or shorter while it's being read - we just get what
+//   was there
+//============================================================================
+bool MappedFile::
+read(const char* filename)
+//============================================================================
+{
+	close();
+
+	FILE* fp = fopen(filename, "rb");
+	if (!fp)
+		return false;
+
+	size_t got = 0;
+	for (;;) {
+		copy.resize(got + READ_CHUNK);
+		size_t n = fread(&copy[got], 1, READ_CHUNK, fp);
+		got += n;
+		if (n < READ_CHUNK)
+			break;
+	}
+	bool ok = !ferror(fp);
+	fclose(fp);
+	if (!ok) {
+		copy.clear();
+		return false;
+	}
+
+	copy.resize(got);
+	length = got;
+	bytes = got ? &copy[0] : emptyFile;
+	opened = true;
+	return true;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+bool MappedFile::
+isOpen() const
+//============================================================================
+{
+	return opened;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+const char* MappedFile::
+data() const
+//============================================================================
+{
+	return bytes;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+size_t MappedFile::
+size() const
+//============================================================================
+{
+	return length;
+}
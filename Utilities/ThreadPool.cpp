@@ -0,0 +1,204 @@
+/************************************************************************
+     File:        ThreadPool.cpp
+
+     Comment:     A small work-stealing pool. See ThreadPool.H
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include "ThreadPool.H"
+#include "Trace.H"
+
+#include <stdio.h>
+
+// which queue belongs to the calling thread (0 if it isn't a worker)
+static thread_local const ThreadPool* myPool = 0;
+static thread_local size_t myQueue = 0;
+
+//****************************************************************************
+//
+// * Constructor
+//============================================================================
+ThreadPool::
+ThreadPool(unsigned nThreads)
+	: queued(0), nextQueue(0), quit(false)
+//============================================================================
+{
+	if (!nThreads) {
+		unsigned cores = std::thread::hardware_concurrency();
+		nThreads = (cores > 1) ? cores - 1 : 1;
+	}
+
+	for (unsigned i = 0; i <= nThreads; ++i)
+		queues.push_back(new Queue);
+	for (unsigned i = 0; i < nThreads; ++i)
+		threads.push_back(std::thread(&ThreadPool::workerLoop, this, (size_t) i + 1));
+}
+
+//****************************************************************************
+//
+// * Destructor
+//============================================================================
+ThreadPool::
+~ThreadPool()
+//============================================================================
+{
+	{
+		std::lock_guard<std::mutex> guard(sleepLock);
+		quit = true;
+	}
+	sleep.notify_all();
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+	for (size_t i = 0; i < queues.size(); ++i)
+		delete queues[i];
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+ThreadPool& ThreadPool::
+shared()
+//============================================================================
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+unsigned ThreadPool::
+size() const
+//============================================================================
+{
+	return (unsigned) threads.size() + 1;
+}
+
+//****************************************************************************
+//
+// * deal out the chunks, then help out until they are all done
+//============================================================================
+void ThreadPool::
+parallelFor(size_t count, size_t grain, const Body& body)
+//============================================================================
+{
+	if (!count)
+		return;
+	if (grain < 1)
+		grain = 1;
+
+	size_t nChunks = (count + grain - 1) / grain;
+	if (nChunks == 1) {
+		body(0, count);
+		return;
+	}
+
+	std::atomic<size_t> remaining(nChunks);
+	size_t nQueues = queues.size();
+	size_t q = nextQueue.fetch_add(1, std::memory_order_relaxed);
+	// counted before they're pushed: a worker can take one (and count it
+	// off) the moment it's in a queue, and queued mustn't go below 0. too
+	// high for a moment only means a worker looks and finds nothing
+	queued.fetch_add(nChunks);
+	for (size_t begin = 0; begin < count; begin += grain, ++q) {
+		Task task;
+		task.body = &body;
+		task.begin = begin;
+		task.end = (begin + grain < count) ? begin + grain : count;
+		task.remaining = &remaining;
+
+		Queue& queue = *queues[q % nQueues];
+		std::lock_guard<std::mutex> guard(queue.lock);
+		queue.tasks.push_back(task);
+	}
+	{
+		// so a worker can't miss the wake up between checking and sleeping
+		std::lock_guard<std::mutex> guard(sleepLock);
+	}
+	sleep.notify_all();
+
+	size_t self = (myPool == this) ? myQueue : 0;
+	while (remaining.load(std::memory_order_acquire)) {
+		Task task;
+		if (take(self, task))
+			run(task);
+		else
+			std::this_thread::yield();
+	}
+}
+
+//****************************************************************************
+//
+// * our own queue first (newest first, it's likely still in cache), then
+//   the oldest task of everybody else
+//============================================================================
+bool ThreadPool::
+take(size_t self, Task& task)
+//============================================================================
+{
+	if (!queued.load(std::memory_order_relaxed))
+		return false;
+
+	size_t nQueues = queues.size();
+	for (size_t i = 0; i < nQueues; ++i) {
+		Queue& queue = *queues[(self + i) % nQueues];
+		std::lock_guard<std::mutex> guard(queue.lock);
+		if (queue.tasks.empty())
+			continue;
+		if (i == 0) {
+			task = queue.tasks.back();
+			queue.tasks.pop_back();
+		} else {
+			task = queue.tasks.front();
+			queue.tasks.pop_front();
+		}
+		queued.fetch_sub(1);
+		return true;
+	}
+	return false;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void ThreadPool::
+run(Task& task)
+//============================================================================
+{
+	(*task.body)(task.begin, task.end);
+	task.remaining->fetch_sub(1, std::memory_order_release);
+}
+
+//****************************************************************************
+//
+// * a worker: run tasks while there are any, sleep when there aren't
+//============================================================================
+void ThreadPool::
+workerLoop(size_t index)
+//============================================================================
+{
+	myPool = this;
+	myQueue = index;
+
+	char name[32];
+	sprintf(name, "Pool %d", (int) index);
+	Trace::setThreadName(name);
+
+	for (;;) {
+		Task task;
+		if (take(index, task)) {
+			run(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> guard(sleepLock);
+		sleep.wait(guard, [this] { return quit || queued.load() > 0; });
+		if (quit)
+			return;
+	}
+}
@@ -0,0 +1,203 @@
+/************************************************************************
+     File:        Trace.cpp
+
+     Comment:     Light-weight scoped timers for finding out where a
+						frame goes. See Trace.H
+
+						Every thread gets its own fixed size ring of events.
+						Only the owning thread writes into a ring, so the
+						writer just bumps a counter. The dump copies the
+						rings out and throws away anything that might have
+						been overwritten while it was copying.
+
+     Platform:    Visio Studio.Net 2003/2005
+
+*************************************************************************/
+
+#include "Trace.H"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+// number of events each thread remembers (older ones get overwritten)
+static const uint32_t TRACE_RING_SIZE = 1 << 14;
+
+struct TraceEvent {
+	const char*	name;
+	uint64_t		start;
+	uint64_t		end;
+};
+
+struct TraceRing {
+	TraceEvent					events[TRACE_RING_SIZE];
+	std::atomic<uint32_t>	head;		// total number of events ever written
+	std::atomic<uint32_t>	tail;		// events before this have been cleared
+	uint32_t						tid;
+	char							name[32];
+};
+
+std::atomic<bool> Trace::on(false);
+
+// all the rings ever made - rings are never freed, so a thread that has
+// finished still shows up in the dump
+static std::mutex					ringLock;
+static std::vector<TraceRing*>	rings;
+
+//****************************************************************************
+//
+// * get (and the first time, make) the ring for the calling thread
+//============================================================================
+static TraceRing* threadRing()
+//============================================================================
+{
+	static thread_local TraceRing* ring = 0;
+	if (!ring) {
+		ring = new TraceRing;
+		ring->head.store(0);
+		ring->tail.store(0);
+		ring->name[0] = 0;
+
+		std::lock_guard<std::mutex> lock(ringLock);
+		ring->tid = (uint32_t) rings.size() + 1;
+		rings.push_back(ring);
+	}
+	return ring;
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void Trace::
+setEnabled(bool _on)
+//============================================================================
+{
+	on.store(_on, std::memory_order_relaxed);
+}
+
+//****************************************************************************
+//
+// * nanoseconds from some fixed point in the past
+//============================================================================
+uint64_t Trace::
+now()
+//============================================================================
+{
+	return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//****************************************************************************
+//
+// * only the owning thread writes, so there is no need for a lock - we
+//   publish the event by bumping head after it is written
+//============================================================================
+void Trace::
+record(const char* name, uint64_t start, uint64_t end)
+//============================================================================
+{
+	TraceRing* ring = threadRing();
+	uint32_t h = ring->head.load(std::memory_order_relaxed);
+	TraceEvent& e = ring->events[h % TRACE_RING_SIZE];
+	e.name = name;
+	e.start = start;
+	e.end = end;
+	ring->head.store(h + 1, std::memory_order_release);
+}
+
+//****************************************************************************
+//
+// *
+//============================================================================
+void Trace::
+setThreadName(const char* name)
+//============================================================================
+{
+	TraceRing* ring = threadRing();
+	strncpy(ring->name, name, sizeof(ring->name) - 1);
+	ring->name[sizeof(ring->name) - 1] = 0;
+}
+
+//****************************************************************************
+//
+// * drop everything recorded so far. each ring just forgets up to the
+//   current head, so we don't disturb a writer
+//============================================================================
+void Trace::
+clear()
+//============================================================================
+{
+	std::lock_guard<std::mutex> lock(ringLock);
+	for (size_t i = 0; i < rings.size(); ++i) {
+		TraceRing* r = rings[i];
+		r->tail.store(r->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+	}
+}
+
+//****************************************************************************
+//
+// * write out the chrome trace format
+//   https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+//   times in the file are in micro seconds
+//============================================================================
+bool Trace::
+dump(const char* filename)
+//============================================================================
+{
+	std::lock_guard<std::mutex> lock(ringLock);
+
+	// copy the events out first, so the file writing doesn't race with
+	// threads that are still recording
+	std::vector<TraceEvent> events;
+	std::vector<uint32_t> tids;
+	uint64_t t0 = ~(uint64_t)0;
+	for (size_t r = 0; r < rings.size(); ++r) {
+		TraceRing* ring = rings[r];
+		uint32_t h = ring->head.load(std::memory_order_acquire);
+		uint32_t first = (h > TRACE_RING_SIZE) ? h - TRACE_RING_SIZE : 0;
+		first = std::max(first, ring->tail.load(std::memory_order_relaxed));
+		size_t base = events.size();
+		for (uint32_t i = first; i < h; ++i)
+			events.push_back(ring->events[i % TRACE_RING_SIZE]);
+
+		// the writer might have lapped us while we were copying - anything
+		// it could have overwritten is not trustworthy
+		uint32_t h2 = ring->head.load(std::memory_order_acquire);
+		uint32_t safe = (h2 > TRACE_RING_SIZE) ? h2 - TRACE_RING_SIZE : 0;
+		if (safe > first) {
+			size_t drop = std::min<size_t>(safe - first, events.size() - base);
+			events.erase(events.begin() + base, events.begin() + base + drop);
+		}
+		tids.resize(events.size(), ring->tid);
+		for (size_t i = base; i < events.size(); ++i)
+			t0 = std::min(t0, events[i].start);
+	}
+	if (events.empty())
+		return false;
+
+	FILE* fp = fopen(filename, "w");
+	if (!fp)
+		return false;
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (size_t r = 0; r < rings.size(); ++r) {
+		const char* name = rings[r]->name[0] ? rings[r]->name : "thread";
+		fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}},\n",
+			rings[r]->tid, name);
+	}
+	for (size_t i = 0; i < events.size(); ++i) {
+		const TraceEvent& e = events[i];
+		fprintf(fp, "{\"name\":\"%s\",\"cat\":\"train\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+			e.name, tids[i],
+			(e.start - t0) / 1000.0, (e.end - e.start) / 1000.0,
+			(i + 1 < events.size()) ? "," : "");
+	}
+	fprintf(fp, "]}\n");
+	fclose(fp);
+	return true;
+}
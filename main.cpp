@@ -23,7 +23,13 @@
 *************************************************************************/
 
 #include "stdio.h"
+#include "string.h"
 #include "TrainWindow.H"
+#include "TrainView.H"
+#include "Track.H"
+#include "TrackIO.H"
+#include "TrackSweep.H"
+#include "Utilities/Trace.H"
 
 #pragma warning(push)
 #pragma warning(disable:4312)
@@ -32,12 +38,107 @@
 #pragma warning(pop)
 
 
-int main(int, char**)
+//************************************************************************
+// train --sweep track.txt results.csv [--tension a:b:n] [--speed a:b:n]
+//       [--cars a:b:n] [--divide a:b:n] [--spline linear|cardinal|bspline]
+//       [--physics] [--trace]
+// tries every combination without opening the window. --trace records
+// where the time goes, into TRACE_FILE
+//************************************************************************
+static int sweep(int argc, char** argv)
 {
+	if (argc < 4) {
+		printf("usage: %s --sweep track.txt results.csv [--tension a:b:n] [--speed a:b:n]\n"
+				 "          [--cars a:b:n] [--divide a:b:n] [--spline linear|cardinal|bspline]\n"
+				 "          [--physics] [--trace]\n", argv[0]);
+		return 1;
+	}
+
+	SweepOptions options;
+	for (int i = 4; i < argc; ++i) {
+		const char* arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : "";
+		SweepRange* range = 0;
+		if (!strcmp(arg, "--tension"))
+			range = &options.tension;
+		else if (!strcmp(arg, "--speed"))
+			range = &options.speed;
+		else if (!strcmp(arg, "--cars"))
+			range = &options.cars;
+		else if (!strcmp(arg, "--divide"))
+			range = &options.divide;
+
+		if (range) {
+			if (!parseSweepRange(value, *range)) {
+				printf("%s wants a value or first:last:count, not \"%s\"\n", arg, value);
+				return 1;
+			}
+			++i;
+		} else if (!strcmp(arg, "--spline")) {
+			if (!strcmp(value, "linear"))
+				options.splineType = SPLINE_LINEAR;
+			else if (!strcmp(value, "cardinal"))
+				options.splineType = SPLINE_CARDINAL;
+			else if (!strcmp(value, "bspline"))
+				options.splineType = SPLINE_BSPLINE;
+			else {
+				printf("--spline wants linear, cardinal or bspline, not \"%s\"\n", value);
+				return 1;
+			}
+			++i;
+		} else if (!strcmp(arg, "--physics"))
+			options.physics = true;
+		else if (!strcmp(arg, "--trace"))
+			Trace::setEnabled(true);
+		else {
+			printf("don't know what %s is\n", arg);
+			return 1;
+		}
+	}
+
+	CTrack track;
+	TrackIOError error;
+	if (!track.readPoints(argv[2], error)) {
+		printf("%s\n", error.message);
+		return 1;
+	}
+
+	uint64_t start = Trace::now();
+	vector<SweepResult> results;
+	runSweep(track.points, options, results);
+	printf("Tried %d combinations in %.3f seconds\n", (int) results.size(),
+			 (Trace::now() - start) * 1e-9);
+
+	if (!writeSweep(argv[3], results, error)) {
+		printf("%s\n", error.message);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "--sweep")) {
+		Trace::setThreadName("Main");
+		int status = sweep(argc, argv);
+		if (Trace::dump(TRACE_FILE))
+			printf("Wrote trace to %s\n", TRACE_FILE);
+		return status;
+	}
+
 	printf("CS559 Train Assignment\n");
+	Trace::setThreadName("UI");
+
+	// the track gets compiled on another thread, which wakes us up
+	// with Fl::awake when it's done
+	Fl::lock();
 
 	TrainWindow tw;
 	tw.show();
 
 	Fl::run();
+
+	// if anything got traced, don't lose it
+	if (Trace::dump(TRACE_FILE))
+		printf("Wrote trace to %s\n", TRACE_FILE);
 }
\ No newline at end of file